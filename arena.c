@@ -0,0 +1,172 @@
+#if defined (__unix__) || defined (__APPLE__)
+#define NAR_ARENA_MMAP
+#include <sys/mman.h>
+#endif
+
+#include "arena.h"
+
+#if !defined(NAR_ARENA_MMAP)
+#undef NAR_ARENA_HUGE_PAGES
+#endif
+
+arena_t *arena_new(const nar_allocator_t *allocator, size_t item_size) {
+    arena_t *a = allocator_alloc(allocator, sizeof(arena_t));
+    memset(a, 0, sizeof(arena_t));
+    a->allocator = allocator;
+    a->item_size = item_size;
+    while (((size_t) 2 << a->chunk_shift) * item_size <= ARENA_CHUNK_SIZE) {
+        a->chunk_shift++;
+    }
+    return a;
+}
+
+nar_byte_t *arena_chunk_alloc(const nar_allocator_t *allocator, size_t size) {
+#ifdef NAR_ARENA_HUGE_PAGES
+    void *chunk = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (chunk == MAP_FAILED) {
+        return NULL;
+    }
+#ifdef MADV_HUGEPAGE
+    madvise(chunk, size, MADV_HUGEPAGE);
+#endif
+    (void) allocator;
+    return chunk;
+#else
+    return allocator_alloc(allocator, size);
+#endif
+}
+
+void arena_chunk_free(const nar_allocator_t *allocator, nar_byte_t *chunk, size_t size) {
+#ifdef NAR_ARENA_HUGE_PAGES
+    (void) allocator;
+    munmap(chunk, size);
+#else
+    (void) size;
+    allocator_free(allocator, chunk);
+#endif
+}
+
+nar_bool_t chunk_append(
+        const nar_allocator_t *allocator, nar_byte_t ***chunks, size_t *num_chunks,
+        size_t *capacity, size_t size) {
+    if (*num_chunks == *capacity) {
+        *capacity = *capacity == 0 ? 8 : *capacity * 2;
+        *chunks = allocator_realloc(allocator, *chunks, *capacity * sizeof(nar_byte_t *));
+    }
+    nar_byte_t *chunk = arena_chunk_alloc(allocator, size);
+    if (chunk == NULL) {
+        nar_fail(NULL, "arena: out of memory");
+        return nar_false;
+    }
+    (*chunks)[(*num_chunks)++] = chunk;
+    return nar_true;
+}
+
+void arena_grow(arena_t *a) {
+    chunk_append(a->allocator, &a->chunks, &a->num_chunks, &a->directory_capacity,
+            a->item_size << a->chunk_shift);
+}
+
+void arena_reserve(arena_t *a, size_t num_chunks) {
+    while (a->num_chunks < num_chunks &&
+            chunk_append(a->allocator, &a->chunks, &a->num_chunks, &a->directory_capacity,
+                    a->item_size << a->chunk_shift)) {
+    }
+}
+
+size_t usage_max(const arena_usage_t *u) {
+    size_t max = 0;
+    for (size_t i = 0; i < ARENA_HISTORY; i++) {
+        if (u->chunks[i] > max) {
+            max = u->chunks[i];
+        }
+    }
+    return max;
+}
+
+// records chunks used by the finished frame and returns the maximum of recent frames
+size_t usage_record(arena_usage_t *u, size_t used_chunks) {
+    u->chunks[u->next] = used_chunks;
+    u->next = (u->next + 1) % ARENA_HISTORY;
+    u->peak = 0;
+    return usage_max(u);
+}
+
+// releases chunks after the first `keep` ones if there are more than twice as many
+void chunks_trim(
+        const nar_allocator_t *allocator, nar_byte_t **chunks, size_t *num_chunks, size_t keep,
+        size_t size) {
+    if (*num_chunks <= 2 * keep + 1) {
+        return;
+    }
+    for (size_t i = keep; i < *num_chunks; i++) {
+        arena_chunk_free(allocator, chunks[i], size);
+    }
+    *num_chunks = keep;
+}
+
+size_t arena_working_set(arena_t *a) {
+    return usage_max(&a->usage);
+}
+
+void arena_adapt(arena_t *a) {
+    size_t items_per_chunk = (size_t) 1 << a->chunk_shift;
+    size_t used = (a->size + items_per_chunk - 1) >> a->chunk_shift;
+    size_t peak = (a->usage.peak + items_per_chunk - 1) >> a->chunk_shift;
+    size_t keep = usage_record(&a->usage, peak);
+    chunks_trim(a->allocator, a->chunks, &a->num_chunks, keep > used ? keep : used,
+            a->item_size << a->chunk_shift);
+}
+
+void arena_free(arena_t *a) {
+    if (a == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < a->num_chunks; i++) {
+        arena_chunk_free(a->allocator, a->chunks[i], a->item_size << a->chunk_shift);
+    }
+    allocator_free(a->allocator, a->chunks);
+    allocator_free(a->allocator, a);
+}
+
+bump_t *bump_new(const nar_allocator_t *allocator) {
+    bump_t *b = allocator_alloc(allocator, sizeof(bump_t));
+    memset(b, 0, sizeof(bump_t));
+    b->allocator = allocator;
+    return b;
+}
+
+size_t bump_alloc(bump_t *b, size_t size) {
+    size = (size + 7) & ~(size_t) 7;
+    size_t offset = b->size;
+    if (offset % ARENA_CHUNK_SIZE + size > ARENA_CHUNK_SIZE) {
+        offset += ARENA_CHUNK_SIZE - offset % ARENA_CHUNK_SIZE;
+    }
+    while (offset + size > b->num_chunks * ARENA_CHUNK_SIZE) {
+        if (!chunk_append(b->allocator, &b->chunks, &b->num_chunks, &b->directory_capacity,
+                ARENA_CHUNK_SIZE)) {
+            return BUMP_FAILED;
+        }
+    }
+    b->size = offset + size;
+    return offset;
+}
+
+void bump_adapt(bump_t *b) {
+    size_t used = (b->size + ARENA_CHUNK_SIZE - 1) / ARENA_CHUNK_SIZE;
+    size_t peak = (b->usage.peak + ARENA_CHUNK_SIZE - 1) / ARENA_CHUNK_SIZE;
+    size_t keep = usage_record(&b->usage, peak);
+    chunks_trim(b->allocator, b->chunks, &b->num_chunks, keep > used ? keep : used,
+            ARENA_CHUNK_SIZE);
+}
+
+void bump_free(bump_t *b) {
+    if (b == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < b->num_chunks; i++) {
+        arena_chunk_free(b->allocator, b->chunks[i], ARENA_CHUNK_SIZE);
+    }
+    allocator_free(b->allocator, b->chunks);
+    allocator_free(b->allocator, b);
+}
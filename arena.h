@@ -0,0 +1,159 @@
+#ifndef NAR_RUNTIME_ARENA_H
+#define NAR_RUNTIME_ARENA_H
+
+#include <stddef.h>
+#include <string.h>
+#include "include/nar.h"
+#include "include/nar-runtime.h"
+
+// Allocator calls with nar_alloc semantics: zero size gives NULL, freeing NULL does nothing.
+
+static nar_ptr_t allocator_alloc(const nar_allocator_t *a, nar_size_t size) {
+    return size == 0 ? NULL : a->alloc(a->ctx, size);
+}
+
+static void allocator_free(const nar_allocator_t *a, nar_ptr_t mem) {
+    if (mem != NULL) {
+        a->free(a->ctx, mem);
+    }
+}
+
+static nar_ptr_t allocator_realloc(const nar_allocator_t *a, nar_ptr_t mem, nar_size_t size) {
+    if (size == 0) {
+        allocator_free(a, mem);
+        return NULL;
+    }
+    return a->realloc(a->ctx, mem, size);
+}
+
+// Segmented arena: items are stored in fixed-size chunks listed in a directory.
+// Growth appends a chunk and never moves existing items, so item pointers stay valid
+// until the item is released. Chunks are kept for reuse when the arena is cleared.
+
+#ifdef NAR_ARENA_HUGE_PAGES
+#define ARENA_CHUNK_SIZE (2 * 1024 * 1024)
+#else
+#define ARENA_CHUNK_SIZE (64 * 1024)
+#endif
+
+// Kept chunks adapt to recent usage: peak usage of the last ARENA_HISTORY frames is remembered
+// and chunks above twice the recent maximum are released when a frame ends,
+// so a single spike does not pin its memory for the rest of the runtime lifetime.
+#define ARENA_HISTORY 8
+
+typedef struct {
+    size_t peak; // items (or bytes) used by the current frame
+    size_t chunks[ARENA_HISTORY]; // chunks used by recent frames, ring buffer
+    size_t next;
+} arena_usage_t;
+
+typedef struct {
+    const nar_allocator_t *allocator;
+    nar_byte_t **chunks;
+    size_t num_chunks;
+    size_t directory_capacity;
+    size_t size;
+    size_t item_size;
+    size_t chunk_shift; // log2 of items per chunk
+    arena_usage_t usage;
+} arena_t;
+
+arena_t *arena_new(const nar_allocator_t *allocator, size_t item_size);
+
+void arena_free(arena_t *a);
+
+void arena_grow(arena_t *a);
+
+// allocates chunks up front until the arena has `num_chunks` of them
+void arena_reserve(arena_t *a, size_t num_chunks);
+
+// maximal number of chunks used by recent frames
+size_t arena_working_set(arena_t *a);
+
+// ends the frame of a cleared arena: records its usage and releases unused chunks
+void arena_adapt(arena_t *a);
+
+static void *arena_at(arena_t *a, size_t index) {
+    if (index >= a->size) {
+        nar_fail(NULL, "arena_at: index >= a->size");
+        return NULL;
+    }
+    return a->chunks[index >> a->chunk_shift] +
+            (index & (((size_t) 1 << a->chunk_shift) - 1)) * a->item_size;
+}
+
+static size_t arena_size(arena_t *a) {
+    return a->size;
+}
+
+static void arena_push(arena_t *a, const void *item) {
+    if (a->size == a->num_chunks << a->chunk_shift) {
+        arena_grow(a);
+        if (a->size == a->num_chunks << a->chunk_shift) {
+            return;
+        }
+    }
+    a->size++;
+    memcpy(arena_at(a, a->size - 1), item, a->item_size);
+}
+
+static void arena_pop(arena_t *a, size_t n) {
+    if (n > a->size) {
+        nar_fail(NULL, "arena_pop: n > a->size");
+        return;
+    }
+    if (a->size > a->usage.peak) {
+        a->usage.peak = a->size;
+    }
+    a->size -= n;
+}
+
+static void arena_clear(arena_t *a) {
+    if (a->size > a->usage.peak) {
+        a->usage.peak = a->size;
+    }
+    a->size = 0;
+}
+
+// Bump region: items of different sizes are placed one after another in creation order.
+// An item that does not fit into the rest of a chunk starts the next chunk.
+
+#define BUMP_FAILED ((size_t) -1)
+
+typedef struct {
+    const nar_allocator_t *allocator;
+    nar_byte_t **chunks;
+    size_t num_chunks;
+    size_t directory_capacity;
+    size_t size; // offset of the next item
+    arena_usage_t usage;
+} bump_t;
+
+bump_t *bump_new(const nar_allocator_t *allocator);
+
+void bump_free(bump_t *b);
+
+// ends the frame of a truncated region: records its usage and releases unused chunks
+void bump_adapt(bump_t *b);
+
+// returns offset of the allocated item or BUMP_FAILED
+size_t bump_alloc(bump_t *b, size_t size);
+
+static void *bump_at(bump_t *b, size_t offset) {
+    if (offset >= b->size) {
+        nar_fail(NULL, "bump_at: offset >= b->size");
+        return NULL;
+    }
+    return b->chunks[offset / ARENA_CHUNK_SIZE] + offset % ARENA_CHUNK_SIZE;
+}
+
+static void bump_truncate(bump_t *b, size_t size) {
+    if (b->size > b->usage.peak) {
+        b->usage.peak = b->size;
+    }
+    if (size < b->size) {
+        b->size = size;
+    }
+}
+
+#endif //NAR_RUNTIME_ARENA_H
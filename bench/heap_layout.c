@@ -0,0 +1,89 @@
+#include <stdio.h>
+#include <time.h>
+#include "../include/nar-runtime.h"
+
+// Compares per-kind arenas with unified heap layout:
+// builds a list of records with int, float and string fields and walks it summing ints.
+
+#define NUM_ITEMS 200000
+#define NUM_ROUNDS 10
+
+// program without strings, constants and functions
+static const nar_byte_t empty_program[] = {
+        0, 'N', 'A', 'R', // signature
+        100, 0, 0, 0, // format version
+        1, 0, 0, 0, // compiler version
+        0, // debug
+        0, 0, 0, 0, // entry
+        0, 0, 0, 0, // strings
+        0, 0, 0, 0, // constants
+        0, 0, 0, 0, // functions
+        0, 0, 0, 0, // exports
+        0, 0, 0, 0, // packages
+};
+
+static double elapsed_ms(clock_t start) {
+    return (double) (clock() - start) * 1000.0 / CLOCKS_PER_SEC;
+}
+
+static nar_object_t build(nar_runtime_t rt) {
+    static const nar_cstring_t keys[] = {"id", "weight", "name"};
+    static const nar_cstring_t names[] = {"alpha", "beta", "gamma", "delta"};
+    nar_object_t list = nar_make_list(rt, 0, NULL);
+    for (nar_int_t i = 0; i < NUM_ITEMS; i++) {
+        nar_object_t values[] = {
+                nar_make_int(rt, i),
+                nar_make_float(rt, (nar_float_t) i * 0.5),
+                nar_make_string(rt, names[i % 4]),
+        };
+        list = nar_make_list_cons(rt, nar_make_record(rt, 3, keys, values), list);
+    }
+    return list;
+}
+
+static nar_int_t walk(nar_runtime_t rt, nar_object_t list) {
+    nar_int_t sum = 0;
+    while (nar_index_is_valid(rt, list)) {
+        nar_list_item_t item = nar_to_list_item(rt, list);
+        nar_object_t field = item.value;
+        while (nar_index_is_valid(rt, field)) {
+            nar_record_item_t record = nar_to_record_item(rt, field);
+            if (nar_object_get_kind(rt, record.value) == NAR_OBJECT_KIND_INT) {
+                sum += nar_to_int(rt, record.value);
+            }
+            field = record.parent;
+        }
+        list = item.next;
+    }
+    return sum;
+}
+
+static void run(nar_runtime_t rt, nar_cstring_t name) {
+    double build_ms = 0, walk_ms = 0;
+    nar_int_t sum = 0;
+    for (int round = 0; round < NUM_ROUNDS; round++) {
+        clock_t start = clock();
+        nar_object_t list = build(rt);
+        build_ms += elapsed_ms(start);
+        start = clock();
+        sum += walk(rt, list);
+        walk_ms += elapsed_ms(start);
+        nar_frame_free(rt);
+    }
+    printf("%-20s build %8.2f ms  walk %8.2f ms  (checksum %lld)\n",
+            name, build_ms / NUM_ROUNDS, walk_ms / NUM_ROUNDS, (long long) sum);
+}
+
+int main(void) {
+    nar_runtime_t rt = nar_runtime_new(nar_bytecode_new(sizeof(empty_program), empty_program));
+    if (rt == NULL) {
+        printf("failed to create runtime\n");
+        return 1;
+    }
+    printf("%d records, average of %d rounds\n", NUM_ITEMS, NUM_ROUNDS);
+    run(rt, "per-kind arenas");
+    nar_set_unified_heap(rt, nar_true);
+    run(rt, "unified heap");
+    nar_runtime_free(rt);
+    return 0;
+}
@@ -1,10 +1,70 @@
+#if defined (__unix__) || defined (__APPLE__)
+#define NAR_BYTECODE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <stdio.h>
 #include <string.h>
 #include "bytecode.h"
 #include "include/nar-runtime.h"
+#include "runtime.h"
 
 const uint32_t k_signature = 'N' << 8 | 'A' << 16 | 'R' << 24;
 const uint32_t k_formatVersion = 100;
 
+// Aligned format (v2) is used in place from the mapped file: the header is followed by
+// 8-aligned sections in native byte order, strings are NUL-terminated in the text section.
+// Only tables of pointers (program strings, functions, exports and packages) are allocated
+// on open, ops, constants, locations and string data stay in the mapping,
+// so processes running the same program share its pages.
+
+#define BYTECODE_V2_VERSION 200
+#define BYTECODE_BYTE_ORDER 0x01020304
+#define BYTECODE_NO_TEXT UINT64_MAX
+
+typedef struct {
+    uint32_t signature;
+    uint32_t format_version;
+    uint32_t byte_order;
+    uint32_t const_size; // size of hashed_const_t
+    uint32_t compiler_version;
+    uint32_t num_strings;
+    uint32_t num_constants;
+    uint32_t num_functions;
+    uint32_t num_exports;
+    uint32_t num_packages;
+    uint64_t size;
+    uint64_t entry; // text offset
+    uint64_t text; // NUL-terminated strings
+    uint64_t text_size;
+    uint64_t strings; // of uint64_t text offsets
+    uint64_t constants; // of hashed_const_t
+    uint64_t functions; // of bytecode_func_t
+    uint64_t ops; // of op_t, ops of all functions
+    uint64_t num_ops;
+    uint64_t locations; // of location_t, locations of functions with debug info
+    uint64_t num_locations;
+    uint64_t exports; // of bytecode_name_t
+    uint64_t packages; // of bytecode_name_t
+} bytecode_header_t;
+
+typedef struct {
+    uint64_t name; // text offset
+    uint64_t file_path; // text offset, BYTECODE_NO_TEXT without debug info
+    uint64_t ops; // index of the first op
+    uint64_t locations; // index of the first location
+    uint32_t num_args;
+    uint32_t num_ops;
+} bytecode_func_t;
+
+typedef struct {
+    uint64_t name; // text offset
+    uint64_t value; // function index of export, version of package
+} bytecode_name_t;
+
 bool read_u8(const uint8_t *limit, uint8_t **data, uint8_t *out_value) {
     const size_t d = 1;
     if (*data + d < limit) {
@@ -35,10 +95,12 @@ bool read_u64(const uint8_t *limit, uint8_t **data, uint64_t *out_value) {
     return false;
 }
 
-bool read_string(const uint8_t *limit, uint8_t **data, nar_string_t *out_value) {
+bool read_string(
+        const nar_allocator_t *allocator, const uint8_t *limit, uint8_t **data,
+        nar_string_t *out_value) {
     uint32_t size;
     if (read_u32(limit, data, &size)) {
-        nar_string_t value = nar_alloc(size + 1);
+        nar_string_t value = allocator_alloc(allocator, size + 1);
         memcpy(value, *data, size);
         value[size] = 0;
         *out_value = value;
@@ -60,10 +122,6 @@ uint64_t exports_item_hash(const void *item, uint64_t seed0, uint64_t seed1) {
     return hashmap_sip(i->name, strlen(i->name), seed0, seed1);
 }
 
-void exports_item_free(void *item) {
-    exports_item_t *i = item;
-    nar_free((nar_string_t) i->name);
-}
 
 int packages_item_compare(const void *a, const void *b, __attribute__((unused)) void *data) {
     const packages_item_t *ia = a;
@@ -76,10 +134,6 @@ uint64_t packages_item_hash(const void *item, uint64_t seed0, uint64_t seed1) {
     return hashmap_sip(i->name, strlen(i->name), seed0, seed1);
 }
 
-void packages_item_free(void *item) {
-    packages_item_t *i = item;
-    nar_free((nar_string_t) i->name);
-}
 
 bool bytecode_load_binary(bytecode_t *btc, size_t size, uint8_t *data) {
     const uint8_t *limit = data + size;
@@ -106,16 +160,17 @@ bool bytecode_load_binary(bytecode_t *btc, size_t size, uint8_t *data) {
         goto eol;
     }
 
-    if (!read_string(limit, &data, &btc->entry)) {
+    if (!read_string(&btc->allocator, limit, &data, &btc->entry)) {
         goto eol;
     }
 
     if (!read_u32(limit, &data, &btc->num_strings)) {
         goto eol;
     }
-    btc->strings = (nar_string_t *) nar_alloc(btc->num_strings * sizeof(nar_string_t));
+    btc->strings = (nar_string_t *) allocator_alloc(
+            &btc->allocator, btc->num_strings * sizeof(nar_string_t));
     for (size_t i = 0; i < btc->num_strings; i++) {
-        if (!read_string(limit, &data, &btc->strings[i])) {
+        if (!read_string(&btc->allocator, limit, &data, &btc->strings[i])) {
             goto eol;
         }
     }
@@ -123,15 +178,16 @@ bool bytecode_load_binary(bytecode_t *btc, size_t size, uint8_t *data) {
     if (!read_u32(limit, &data, &btc->num_constants)) {
         goto eol;
     }
-    btc->constants = (hashed_const_t *) nar_alloc(
-            btc->num_constants * sizeof(hashed_const_t));
+    hashed_const_t *constants = (hashed_const_t *) allocator_alloc(
+            &btc->allocator, btc->num_constants * sizeof(hashed_const_t));
+    btc->constants = constants;
     for (size_t i = 0; i < btc->num_constants; i++) {
         uint8_t kind;
         if (!read_u8(limit, &data, &kind)) {
             goto eol;
         }
-        btc->constants[i].kind = (hashed_const_kind_t) kind;
-        if (!read_u64(limit, &data, &btc->constants[i].hashed_value)) {
+        constants[i].kind = (hashed_const_kind_t) kind;
+        if (!read_u64(limit, &data, &constants[i].hashed_value)) {
             goto eol;
         }
     }
@@ -139,7 +195,9 @@ bool bytecode_load_binary(bytecode_t *btc, size_t size, uint8_t *data) {
     if (!read_u32(limit, &data, &btc->num_functions)) {
         goto eol;
     }
-    btc->functions = (func_t *) nar_alloc(btc->num_functions * sizeof(func_t));
+    btc->functions = (func_t *) allocator_alloc(
+            &btc->allocator, btc->num_functions * sizeof(func_t));
+    memset(btc->functions, 0, btc->num_functions * sizeof(func_t));
     for (size_t i = 0; i < btc->num_functions; i++) {
         func_t *f = &btc->functions[i];
 
@@ -156,17 +214,18 @@ bool bytecode_load_binary(bytecode_t *btc, size_t size, uint8_t *data) {
         if (!read_u32(limit, &data, &f->num_ops)) {
             goto eol;
         }
-        f->ops = nar_alloc(f->num_ops * sizeof(op_t));
+        op_t *ops = allocator_alloc(&btc->allocator, f->num_ops * sizeof(op_t));
+        f->ops = ops;
         for (size_t j = 0; j < f->num_ops; j++) {
-            if (!read_u64(limit, &data, &f->ops[j])) {
+            if (!read_u64(limit, &data, &ops[j])) {
                 goto eol;
             }
         }
         if (debug) {
-            if (!read_string(limit, &data, &f->file_path)) {
+            if (!read_string(&btc->allocator, limit, &data, &f->file_path)) {
                 goto eol;
             }
-            f->locations = nar_alloc(f->num_ops * sizeof(location_t));
+            f->locations = allocator_alloc(&btc->allocator, f->num_ops * sizeof(location_t));
             for (size_t j = 0; j < f->num_ops; j++) {
                 if (!read_u32(limit, &data, &f->locations[j].line)) {
                     goto eol;
@@ -182,12 +241,12 @@ bool bytecode_load_binary(bytecode_t *btc, size_t size, uint8_t *data) {
     if (!read_u32(limit, &data, &num_exports)) {
         goto eol;
     }
-    btc->exports = hashmap_new(sizeof(exports_item_t), num_exports,
-            0, 0, &exports_item_hash, &exports_item_compare, &exports_item_free, NULL);
+    btc->exports = allocator_hashmap_new(&btc->allocator, sizeof(exports_item_t), num_exports,
+            &exports_item_hash, &exports_item_compare, NULL);
     for (size_t i = 0; i < num_exports; i++) {
         exports_item_t item = {0};
         nar_string_t name;
-        if (!read_string(limit, &data, &name)) {
+        if (!read_string(&btc->allocator, limit, &data, &name)) {
             goto eol;
         }
         item.name = name;
@@ -201,11 +260,11 @@ bool bytecode_load_binary(bytecode_t *btc, size_t size, uint8_t *data) {
     if (!read_u32(limit, &data, &num_packages)) {
         goto eol;
     }
-    btc->packages = hashmap_new(sizeof(packages_item_t), num_packages,
-            0, 0, &packages_item_hash, &packages_item_compare, &packages_item_free, NULL);
+    btc->packages = allocator_hashmap_new(&btc->allocator, sizeof(packages_item_t), num_packages,
+            &packages_item_hash, &packages_item_compare, NULL);
     for (size_t i = 0; i < num_packages; i++) {
         packages_item_t item = {0};
-        if (!read_string(limit, &data, &item.name)) {
+        if (!read_string(&btc->allocator, limit, &data, &item.name)) {
             goto eol;
         }
         if (!read_u32(limit, &data, &item.version)) {
@@ -220,9 +279,367 @@ bool bytecode_load_binary(bytecode_t *btc, size_t size, uint8_t *data) {
     return false;
 }
 
+// maps (or reads where mmap is not available) the whole file, returns NULL on failure
+nar_byte_t *bytecode_map(const nar_allocator_t *allocator, nar_cstring_t path, size_t *size) {
+#ifdef NAR_BYTECODE_MMAP
+    (void) allocator;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    void *data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        *size = st.st_size;
+        data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    return data == MAP_FAILED ? NULL : data;
+#else
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        return NULL;
+    }
+    nar_byte_t *data = NULL;
+    if (fseek(f, 0, SEEK_END) == 0) {
+        long length = ftell(f);
+        if (length > 0 && fseek(f, 0, SEEK_SET) == 0) {
+            *size = length;
+            data = allocator_alloc(allocator, *size);
+            if (fread(data, *size, 1, f) != 1) {
+                allocator_free(allocator, data);
+                data = NULL;
+            }
+        }
+    }
+    fclose(f);
+    return data;
+#endif
+}
+
+void bytecode_unmap(const nar_allocator_t *allocator, nar_byte_t *data, size_t size) {
+#ifdef NAR_BYTECODE_MMAP
+    (void) allocator;
+    munmap(data, size);
+#else
+    (void) size;
+    allocator_free(allocator, data);
+#endif
+}
+
+// checks that section of `count` items fits into the image
+bool image_section_valid(const bytecode_t *btc, uint64_t offset, uint64_t count, size_t item_size) {
+    return offset % 8 == 0 && offset <= btc->image_size &&
+            count <= (btc->image_size - offset) / item_size;
+}
+
+nar_string_t image_text(const bytecode_t *btc, uint64_t offset) {
+    const bytecode_header_t *header = (const bytecode_header_t *) btc->image;
+    if (offset >= header->text_size) {
+        return NULL;
+    }
+    return (nar_string_t) btc->image + header->text + offset;
+}
+
+// checks string, constant and function operands, so execution never indexes past the tables
+bool image_ops_valid(const bytecode_t *btc, const op_t *ops, size_t num_ops) {
+    for (size_t i = 0; i < num_ops; i++) {
+        reg_a_t a;
+        reg_b_t b;
+        reg_c_t c;
+        size_t limit = SIZE_MAX;
+        switch (decompose_op(ops[i], &a, &b, &c)) {
+            case OP_KIND_LOAD_LOCAL:
+            case OP_KIND_CALL:
+            case OP_KIND_ACCESS:
+            case OP_KIND_UPDATE:
+                limit = btc->num_strings;
+                break;
+            case OP_KIND_LOAD_GLOBAL:
+                limit = btc->num_functions;
+                break;
+            case OP_KIND_LOAD_CONST:
+                if (c == CONST_KIND_INT || c == CONST_KIND_FLOAT) {
+                    limit = btc->num_constants;
+                } else if (c == CONST_KIND_STRING) {
+                    limit = btc->num_strings;
+                }
+                break;
+            case OP_KIND_MAKE_PATTERN:
+                if (b == PATTERN_KIND_ALIAS || b == PATTERN_KIND_OPTION ||
+                        b == PATTERN_KIND_NAMED) {
+                    limit = btc->num_strings;
+                }
+                break;
+            default:
+                break;
+        }
+        if (a >= limit) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool bytecode_load_image(bytecode_t *btc) {
+    const bytecode_header_t *header = (const bytecode_header_t *) btc->image;
+    if (btc->image_size < sizeof(bytecode_header_t) || header->signature != k_signature ||
+            header->format_version != BYTECODE_V2_VERSION) {
+        nar_fail(NULL, "Unsupported bytecode format version");
+        return false;
+    }
+    if (header->byte_order != BYTECODE_BYTE_ORDER ||
+            header->const_size != sizeof(hashed_const_t)) {
+        nar_fail(NULL, "Bytecode was written for incompatible platform");
+        return false;
+    }
+    if (header->size != btc->image_size || header->text_size == 0 ||
+            !image_section_valid(btc, header->text, header->text_size, 1) ||
+            btc->image[header->text + header->text_size - 1] != 0 ||
+            !image_section_valid(btc, header->strings, header->num_strings, sizeof(uint64_t)) ||
+            !image_section_valid(btc, header->constants, header->num_constants,
+                    sizeof(hashed_const_t)) ||
+            !image_section_valid(btc, header->functions, header->num_functions,
+                    sizeof(bytecode_func_t)) ||
+            !image_section_valid(btc, header->ops, header->num_ops, sizeof(op_t)) ||
+            !image_section_valid(btc, header->locations, header->num_locations,
+                    sizeof(location_t)) ||
+            !image_section_valid(btc, header->exports, header->num_exports,
+                    sizeof(bytecode_name_t)) ||
+            !image_section_valid(btc, header->packages, header->num_packages,
+                    sizeof(bytecode_name_t))) {
+        goto corrupted;
+    }
+    btc->compiler_version = header->compiler_version;
+    btc->entry = image_text(btc, header->entry);
+    if (btc->entry == NULL) {
+        goto corrupted;
+    }
+
+    const uint64_t *strings = (const uint64_t *) (btc->image + header->strings);
+    btc->num_strings = header->num_strings;
+    btc->strings = allocator_alloc(&btc->allocator, btc->num_strings * sizeof(nar_string_t));
+    for (size_t i = 0; i < btc->num_strings; i++) {
+        btc->strings[i] = image_text(btc, strings[i]);
+        if (btc->strings[i] == NULL) {
+            goto corrupted;
+        }
+    }
+
+    btc->num_constants = header->num_constants;
+    btc->constants = (const hashed_const_t *) (btc->image + header->constants);
+
+    const bytecode_func_t *functions = (const bytecode_func_t *) (btc->image + header->functions);
+    btc->num_functions = header->num_functions;
+    btc->functions = allocator_alloc(&btc->allocator, btc->num_functions * sizeof(func_t));
+    memset(btc->functions, 0, btc->num_functions * sizeof(func_t));
+    for (size_t i = 0; i < btc->num_functions; i++) {
+        const bytecode_func_t *src = &functions[i];
+        func_t *f = &btc->functions[i];
+        f->name = image_text(btc, src->name);
+        if (f->name == NULL || src->ops > header->num_ops ||
+                src->num_ops > header->num_ops - src->ops) {
+            goto corrupted;
+        }
+        f->num_args = src->num_args;
+        f->num_ops = src->num_ops;
+        f->ops = (const op_t *) (btc->image + header->ops) + src->ops;
+        if (!image_ops_valid(btc, f->ops, f->num_ops)) {
+            goto corrupted;
+        }
+        if (src->file_path != BYTECODE_NO_TEXT) {
+            f->file_path = image_text(btc, src->file_path);
+            if (f->file_path == NULL || src->locations > header->num_locations ||
+                    src->num_ops > header->num_locations - src->locations) {
+                goto corrupted;
+            }
+            f->locations = (location_t *) (btc->image + header->locations) + src->locations;
+        }
+    }
+
+    const bytecode_name_t *exports = (const bytecode_name_t *) (btc->image + header->exports);
+    btc->exports = allocator_hashmap_new(&btc->allocator, sizeof(exports_item_t),
+            header->num_exports, &exports_item_hash, &exports_item_compare, NULL);
+    for (size_t i = 0; i < header->num_exports; i++) {
+        exports_item_t item = {.name = image_text(btc, exports[i].name)};
+        item.index = exports[i].value;
+        if (item.name == NULL || item.index >= btc->num_functions) {
+            goto corrupted;
+        }
+        hashmap_set(btc->exports, &item);
+    }
+
+    const bytecode_name_t *packages = (const bytecode_name_t *) (btc->image + header->packages);
+    btc->packages = allocator_hashmap_new(&btc->allocator, sizeof(packages_item_t),
+            header->num_packages, &packages_item_hash, &packages_item_compare, NULL);
+    for (size_t i = 0; i < header->num_packages; i++) {
+        packages_item_t item = {.name = image_text(btc, packages[i].name)};
+        item.version = packages[i].value;
+        if (item.name == NULL) {
+            goto corrupted;
+        }
+        hashmap_set(btc->packages, &item);
+    }
+    return true;
+
+    corrupted:
+    nar_fail(NULL, "Corrupted bytecode file");
+    return false;
+}
+
+nar_bytecode_t nar_bytecode_open_mmap(nar_cstring_t path) {
+    const nar_allocator_t *allocator = &nar_default_allocator;
+    size_t size = 0;
+    nar_byte_t *image = bytecode_map(allocator, path, &size);
+    if (image == NULL) {
+        nar_fail(NULL, "Could not open bytecode file");
+        return NULL;
+    }
+    bytecode_t *btc = allocator_alloc(allocator, sizeof(bytecode_t));
+    memset(btc, 0, sizeof(bytecode_t));
+    btc->allocator = *allocator;
+    bool ok;
+    if (size >= 2 * sizeof(uint32_t) && ((const uint32_t *) image)[1] == k_formatVersion) {
+        // v1 tables are copied out of the mapping
+        ok = bytecode_load_binary(btc, size, image);
+        bytecode_unmap(allocator, image, size);
+    } else {
+        btc->image = image;
+        btc->image_size = size;
+        ok = bytecode_load_image(btc);
+    }
+    if (!ok) {
+        nar_bytecode_free(btc);
+        return NULL;
+    }
+    return btc;
+}
+
+// appends 8-aligned section to the image and returns its offset
+uint64_t image_append(vector_t *image, const void *data, size_t size) {
+    static const nar_byte_t padding[8] = {0};
+    vector_push(image, (8 - vector_size(image) % 8) % 8, padding);
+    uint64_t offset = vector_size(image);
+    vector_push(image, size, data);
+    return offset;
+}
+
+uint64_t image_add_text(vector_t *text, nar_cstring_t value) {
+    uint64_t offset = vector_size(text);
+    vector_push(text, strlen(value) + 1, value);
+    return offset;
+}
+
+nar_bool_t nar_bytecode_write_v2(nar_bytecode_t bc, nar_cstring_t path) {
+    bytecode_t *btc = (bytecode_t *) bc;
+    const nar_allocator_t *allocator = &btc->allocator;
+    vector_t *text = avector_new(sizeof(char), 0, allocator);
+    vector_t *strings = avector_new(sizeof(uint64_t), btc->num_strings, allocator);
+    vector_t *functions = avector_new(sizeof(bytecode_func_t), btc->num_functions, allocator);
+    vector_t *ops = avector_new(sizeof(op_t), 0, allocator);
+    vector_t *locations = avector_new(sizeof(location_t), 0, allocator);
+    vector_t *exports = avector_new(sizeof(bytecode_name_t), 0, allocator);
+    vector_t *packages = avector_new(sizeof(bytecode_name_t), 0, allocator);
+
+    bytecode_header_t header = {
+            .signature = k_signature,
+            .format_version = BYTECODE_V2_VERSION,
+            .byte_order = BYTECODE_BYTE_ORDER,
+            .const_size = sizeof(hashed_const_t),
+            .compiler_version = btc->compiler_version,
+            .num_strings = btc->num_strings,
+            .num_constants = btc->num_constants,
+            .num_functions = btc->num_functions,
+            .entry = image_add_text(text, btc->entry),
+    };
+    for (size_t i = 0; i < btc->num_strings; i++) {
+        uint64_t offset = image_add_text(text, btc->strings[i]);
+        vector_push(strings, 1, &offset);
+    }
+    for (size_t i = 0; i < btc->num_functions; i++) {
+        const func_t *f = &btc->functions[i];
+        bytecode_func_t item = {
+                .name = image_add_text(text, f->name),
+                .file_path = BYTECODE_NO_TEXT,
+                .ops = vector_size(ops),
+                .num_args = f->num_args,
+                .num_ops = f->num_ops,
+        };
+        vector_push(ops, f->num_ops, f->ops);
+        if (f->locations != NULL) {
+            item.file_path = image_add_text(text, f->file_path);
+            item.locations = vector_size(locations);
+            vector_push(locations, f->num_ops, f->locations);
+        }
+        vector_push(functions, 1, &item);
+    }
+    size_t it = 0;
+    void *item;
+    while (hashmap_iter(btc->exports, &it, &item)) {
+        const exports_item_t *e = item;
+        bytecode_name_t name = {.name = image_add_text(text, e->name), .value = e->index};
+        vector_push(exports, 1, &name);
+    }
+    it = 0;
+    while (hashmap_iter(btc->packages, &it, &item)) {
+        const packages_item_t *p = item;
+        bytecode_name_t name = {.name = image_add_text(text, p->name), .value = p->version};
+        vector_push(packages, 1, &name);
+    }
+    header.num_exports = vector_size(exports);
+    header.num_packages = vector_size(packages);
+    header.num_ops = vector_size(ops);
+    header.num_locations = vector_size(locations);
+
+    vector_t *image = avector_new(sizeof(nar_byte_t), 0, allocator);
+    vector_push(image, sizeof(bytecode_header_t), &header);
+    header.text_size = vector_size(text);
+    header.text = image_append(image, vector_data(text), vector_size(text));
+    header.strings = image_append(image, vector_data(strings),
+            vector_size(strings) * sizeof(uint64_t));
+    header.constants = image_append(image, btc->constants,
+            btc->num_constants * sizeof(hashed_const_t));
+    header.functions = image_append(image, vector_data(functions),
+            vector_size(functions) * sizeof(bytecode_func_t));
+    header.ops = image_append(image, vector_data(ops), vector_size(ops) * sizeof(op_t));
+    header.locations = image_append(image, vector_data(locations),
+            vector_size(locations) * sizeof(location_t));
+    header.exports = image_append(image, vector_data(exports),
+            vector_size(exports) * sizeof(bytecode_name_t));
+    header.packages = image_append(image, vector_data(packages),
+            vector_size(packages) * sizeof(bytecode_name_t));
+    header.size = vector_size(image);
+    memcpy(vector_data(image), &header, sizeof(bytecode_header_t));
+
+    FILE *f = fopen(path, "wb");
+    nar_bool_t ok = f != NULL &&
+            fwrite(vector_data(image), vector_size(image), 1, f) == 1;
+    if (f != NULL && fclose(f) != 0) {
+        ok = false;
+    }
+    if (!ok) {
+        nar_fail(NULL, "Could not write bytecode file");
+    }
+    vector_free(text);
+    vector_free(strings);
+    vector_free(functions);
+    vector_free(ops);
+    vector_free(locations);
+    vector_free(exports);
+    vector_free(packages);
+    vector_free(image);
+    return ok;
+}
+
 nar_bytecode_t nar_bytecode_new(nar_size_t size, const nar_byte_t *data) {
-    bytecode_t *btc = nar_alloc(sizeof(bytecode_t));
+    return nar_bytecode_new_with_allocator(size, data, &nar_default_allocator);
+}
+
+nar_bytecode_t nar_bytecode_new_with_allocator(
+        nar_size_t size, const nar_byte_t *data, const nar_allocator_t *allocator) {
+    bytecode_t *btc = allocator_alloc(allocator, sizeof(bytecode_t));
     memset(btc, 0, sizeof(bytecode_t));
+    btc->allocator = *allocator;
     if (!bytecode_load_binary(btc, size, (nar_byte_t *) data)) {
         nar_bytecode_free(btc);
         return NULL;
@@ -234,30 +651,52 @@ nar_cstring_t nar_bytecode_get_entry(nar_bytecode_t btc) {
     return ((bytecode_t *) btc)->entry;
 }
 
+// frees hashmap of items that start with an allocated name
+void names_free(bytecode_t *btc, hashmap_t *map) {
+    if (map == NULL) {
+        return;
+    }
+    size_t it = 0;
+    void *item;
+    while (hashmap_iter(map, &it, &item)) {
+        allocator_free(&btc->allocator, *(nar_string_t *) item);
+    }
+    hashmap_free(map);
+}
+
 void nar_bytecode_free(nar_bytecode_t bc) {
     if (bc != NULL) {
         bytecode_t *btc = (bytecode_t *) bc;
+        // tables of mapped bytecode point into the image
+        bool owned = btc->image == NULL;
 
-        nar_free(btc->entry);
-
-        for (uint32_t i = 0; i < btc->num_strings; i++) {
-            nar_free(btc->strings[i]);
+        if (owned) {
+            allocator_free(&btc->allocator, btc->entry);
+            for (uint32_t i = 0; i < btc->num_strings; i++) {
+                allocator_free(&btc->allocator, btc->strings[i]);
+            }
+            allocator_free(&btc->allocator, (nar_ptr_t) btc->constants);
         }
-        nar_free(btc->strings);
+        allocator_free(&btc->allocator, btc->strings);
 
-        nar_free(btc->constants);
-
-        for (uint32_t i = 0; i < btc->num_functions; i++) {
+        for (uint32_t i = 0; owned && i < btc->num_functions; i++) {
             func_t *f = &btc->functions[i];
-            nar_free(f->ops);
-            nar_free(f->file_path);
-            nar_free(f->locations);
+            allocator_free(&btc->allocator, (nar_ptr_t) f->ops);
+            allocator_free(&btc->allocator, f->file_path);
+            allocator_free(&btc->allocator, f->locations);
+        }
+        allocator_free(&btc->allocator, btc->functions);
+
+        if (owned) {
+            names_free(btc, btc->exports);
+            names_free(btc, btc->packages);
+        } else {
+            hashmap_free(btc->exports);
+            hashmap_free(btc->packages);
+            bytecode_unmap(&btc->allocator, btc->image, btc->image_size);
         }
-        nar_free(btc->functions);
-
-        hashmap_free(btc->exports);
-        hashmap_free(btc->packages);
 
-        nar_free(btc);
+        nar_allocator_t allocator = btc->allocator;
+        allocator_free(&allocator, btc);
     }
 }
@@ -112,7 +112,7 @@ typedef struct {
 typedef struct {
     uint32_t num_args;
     uint32_t num_ops;
-    op_t *ops;
+    const op_t *ops;
     nar_string_t name;
     nar_string_t file_path;
     location_t *locations;
@@ -138,16 +138,19 @@ typedef struct {
 } packages_item_t;
 
 typedef struct {
+    nar_allocator_t allocator; // of all bytecode tables
     version_t compiler_version;
     uint32_t num_functions;
     uint32_t num_strings;
     uint32_t num_constants;
     func_t *functions;
     nar_string_t *strings;
-    hashed_const_t *constants;
+    const hashed_const_t *constants;
     nar_string_t entry;
     hashmap_t *exports; // exports_item_t
     hashmap_t *packages; // packages_item_t
+    nar_byte_t *image; // mapped v2 file the tables point into, NULL if tables are allocated
+    size_t image_size;
 } bytecode_t;
 
 static op_kind_t decompose_op(op_t op, reg_a_t *a, reg_b_t *b, reg_c_t *c) {
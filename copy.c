@@ -0,0 +1,137 @@
+#include <string.h>
+#include "include/nar-runtime.h"
+#include "runtime.h"
+
+// Copy walk is the deep copy shared by persistent heap, transfer between runtimes and snapshot
+// writer. Objects are copied children first: an item is read from the source runtime, its
+// children are replaced by their copies and the item is inserted to the destination. An object
+// that is met again is taken from the memo, so shared structure stays shared.
+
+typedef struct {
+    nar_object_t source;
+    nar_object_t copy;
+} copy_memo_t;
+
+typedef struct {
+    nar_object_t obj;
+    nar_bool_t expanded;
+} copy_entry_t;
+
+typedef struct {
+    const copy_walk_t *walk;
+    hashmap_t *memo; // of copy_memo_t
+    vector_t *stack; // of copy_entry_t
+    nar_bool_t failed;
+} copy_state_t;
+
+int copy_memo_compare(const void *a, const void *b, __attribute__((unused)) void *data) {
+    const copy_memo_t *ia = a;
+    const copy_memo_t *ib = b;
+    return ia->source == ib->source ? 0 : (ia->source < ib->source ? -1 : 1);
+}
+
+uint64_t copy_memo_hash(const void *item, uint64_t seed0, uint64_t seed1) {
+    const copy_memo_t *i = item;
+    return hashmap_sip(&i->source, sizeof(nar_object_t), seed0, seed1);
+}
+
+// resolves object that does not need (or already has) a copy with children
+nar_bool_t copy_resolve(copy_state_t *s, nar_object_t obj, nar_object_t *copy) {
+    const copy_walk_t *walk = s->walk;
+    if (obj == NAR_INVALID_OBJECT || (obj & NAR_INVALID_INDEX)) {
+        *copy = obj;
+        return true;
+    }
+    if (object_is_immediate(obj)) {
+        // payload of immediate option is its name string, callback resolves every string
+        nar_object_t name = build_object(NAR_OBJECT_KIND_STRING,
+                object_get_index(obj) & ~INDEX_FLAG_IMMEDIATE);
+        if (walk->resolve(walk->ctx, name, &name) != COPY_RESOLVED) {
+            s->failed = true;
+            name = NAR_INVALID_OBJECT;
+        }
+        *copy = build_object(nar_object_get_kind(walk->src, obj),
+                INDEX_FLAG_IMMEDIATE | object_get_index(name));
+        return true;
+    }
+    switch (walk->resolve(walk->ctx, obj, copy)) {
+        case COPY_RESOLVED:
+            return true;
+        case COPY_FAILED:
+            s->failed = true;
+            *copy = NAR_INVALID_OBJECT;
+            return true;
+        default:
+            break;
+    }
+    const copy_memo_t *found = hashmap_get(s->memo, &(copy_memo_t) {.source = obj});
+    if (found != NULL) {
+        *copy = found->copy;
+        return true;
+    }
+    return false;
+}
+
+void copy_push(void *ctx, nar_object_t *slot) {
+    copy_state_t *s = ctx;
+    nar_object_t copy;
+    if (!copy_resolve(s, *slot, &copy)) {
+        vector_push(s->stack, 1, &(copy_entry_t) {.obj = *slot});
+    }
+}
+
+void copy_rewrite(void *ctx, nar_object_t *slot) {
+    copy_resolve(ctx, *slot, slot);
+}
+
+nar_object_t copy_walk(const copy_walk_t *walk, nar_object_t obj) {
+    runtime_t *src = walk->src;
+    copy_state_t s = {
+            .walk = walk,
+            .memo = allocator_hashmap_new(&src->allocator, sizeof(copy_memo_t), 0,
+                    &copy_memo_hash, &copy_memo_compare, NULL),
+            .stack = rt_vector_new(src, sizeof(copy_entry_t), 16),
+    };
+    union {
+        string_header_t string;
+        nar_record_item_t record;
+        nar_closure_t closure;
+        nar_pattern_t pattern;
+        nar_byte_t bytes[64];
+    } item;
+
+    vector_push(s.stack, 1, &(copy_entry_t) {.obj = obj});
+    while (!s.failed && vector_size(s.stack) > 0) {
+        copy_entry_t *entry = vector_at(s.stack, vector_size(s.stack) - 1);
+        nar_object_t source = entry->obj;
+        nar_object_t copy;
+        if (copy_resolve(&s, source, &copy)) {
+            vector_pop(s.stack, 1, NULL);
+            continue;
+        }
+        nar_object_kind_t kind = nar_object_get_kind(src, source);
+        memset(&item, 0, sizeof(item));
+        memcpy(&item, find(src, kind, source), src->arenas[kind]->item_size);
+        if (!entry->expanded) {
+            entry->expanded = true;
+            object_visit_children(kind, &item, &s, &copy_push);
+            continue;
+        }
+        vector_pop(s.stack, 1, NULL);
+        object_visit_children(kind, &item, &s, &copy_rewrite);
+        copy = walk->insert(walk->ctx, kind, &item);
+        if (copy == NAR_INVALID_OBJECT) {
+            s.failed = true;
+            break;
+        }
+        hashmap_set(s.memo, &(copy_memo_t) {.source = source, .copy = copy});
+    }
+
+    nar_object_t result = NAR_INVALID_OBJECT;
+    if (!s.failed) {
+        copy_resolve(&s, obj, &result);
+    }
+    hashmap_free(s.memo);
+    vector_free(s.stack);
+    return s.failed ? NAR_INVALID_OBJECT : result;
+}
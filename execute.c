@@ -37,13 +37,15 @@ nar_bool_t const_equals_to(runtime_t *rt, nar_object_t x, nar_object_t y) {
         case NAR_OBJECT_KIND_FLOAT:
             return nar_to_float(rt, x) == nar_to_float(rt, y);
         case NAR_OBJECT_KIND_STRING:
-            return strcmp(nar_to_string(rt, x), nar_to_string(rt, y)) == 0;
+            return string_equals(rt, x, y);
         default:
             nar_fail(rt, "trying to compare objects of unsupported type");
             return false;
     }
 }
 
+// Pattern values are walked in place (no frame allocations), so long-running loops
+// do not accumulate memory that the collector cannot reclaim.
 nar_bool_t match( // NOLINT(*-no-recursion)
         runtime_t *rt, nar_object_t pattern, nar_object_t obj, size_t *num_locals) {
     nar_pattern_t p = nar_to_pattern(rt, pattern);
@@ -51,66 +53,74 @@ nar_bool_t match( // NOLINT(*-no-recursion)
         case PATTERN_KIND_ALIAS: {
             vector_push(rt->locals, 1, &(local_t) {.name = p.name, .value = obj});
             (*num_locals)++;
-            nar_list_t pat_values = nar_to_list(rt, p.values);
-            if (pat_values.size != 1) {
+            if (list_size(rt, p.values) != 1) {
                 nar_fail(rt, "alias pattern should have exactly one pat_values pattern");
                 return false;
             }
-            return match(rt, pat_values.items[0], obj, num_locals);
+            return match(rt, nar_to_list_item(rt, p.values).value, obj, num_locals);
         }
         case PATTERN_KIND_ANY:
             return true;
         case PATTERN_KIND_CONS: {
-            nar_list_t pat_values = nar_to_list(rt, p.values);
-            if (pat_values.size != 2) {
+            if (list_size(rt, p.values) != 2) {
                 nar_fail(rt, "cons pattern should have exactly two pat_values patterns");
                 return false;
             }
             if (!nar_index_is_valid(rt, obj)) {
                 return false;
             }
+            nar_list_item_t tail_pattern = nar_to_list_item(rt, p.values);
+            nar_list_item_t head_pattern = nar_to_list_item(rt, tail_pattern.next);
             nar_list_item_t list = nar_to_list_item(rt, obj);
-            nar_bool_t matched = match(rt, pat_values.items[1], list.value, num_locals);
+            nar_bool_t matched = match(rt, head_pattern.value, list.value, num_locals);
             if (!matched) {
                 return false;
             }
-            return match(rt, pat_values.items[0], list.next, num_locals);
+            return match(rt, tail_pattern.value, list.next, num_locals);
         }
         case PATTERN_KIND_CONST: {
-            nar_list_t pat_values = nar_to_list(rt, p.values);
-            if (pat_values.size != 1) {
+            if (list_size(rt, p.values) != 1) {
                 nar_fail(rt, "const pattern should have exactly one pat_values pattern");
                 return false;
             }
-            return const_equals_to(rt, pat_values.items[0], obj);
+            return const_equals_to(rt, nar_to_list_item(rt, p.values).value, obj);
         }
         case PATTERN_KIND_OPTION: {
-            nar_option_t opt = nar_to_option(rt, obj);
-            if (strcmp(p.name, opt.name) != 0) {
+            nar_option_item_t opt = nar_to_option_item(rt, obj);
+            if (!string_equals(rt, p.name, opt.name)) {
                 return false;
             }
-            nar_list_t pat_values = nar_to_list(rt, p.values);
-            if (pat_values.size != opt.size) {
+            if (list_size(rt, p.values) != list_size(rt, opt.values)) {
                 nar_fail(rt, "invalid option pattern match, number of values differs");
                 return false;
             }
-            for (size_t i = 0; i < pat_values.size; i++) {
-                if (!match(rt, pat_values.items[i], opt.values[i], num_locals)) {
+            nar_object_t pat_it = p.values;
+            nar_object_t opt_it = opt.values;
+            while (nar_index_is_valid(rt, pat_it)) {
+                nar_list_item_t pat_item = nar_to_list_item(rt, pat_it);
+                nar_list_item_t opt_item = nar_to_list_item(rt, opt_it);
+                if (!match(rt, pat_item.value, opt_item.value, num_locals)) {
                     return false;
                 }
+                pat_it = pat_item.next;
+                opt_it = opt_item.next;
             }
             return true;
         }
         case PATTERN_KIND_LIST: {
-            nar_list_t obj_list = nar_to_list(rt, obj);
-            nar_list_t pat_list = nar_to_list(rt, p.values);
-            if (obj_list.size != pat_list.size) {
+            if (list_size(rt, obj) != list_size(rt, p.values)) {
                 return false;
             }
-            for (size_t i = 0; i < obj_list.size; i++) {
-                if (!match(rt, pat_list.items[i], obj_list.items[i], num_locals)) {
+            nar_object_t pat_it = p.values;
+            nar_object_t obj_it = obj;
+            while (nar_index_is_valid(rt, pat_it)) {
+                nar_list_item_t pat_item = nar_to_list_item(rt, pat_it);
+                nar_list_item_t obj_item = nar_to_list_item(rt, obj_it);
+                if (!match(rt, pat_item.value, obj_item.value, num_locals)) {
                     return false;
                 }
+                pat_it = pat_item.next;
+                obj_it = obj_item.next;
             }
             return true;
         }
@@ -120,28 +130,40 @@ nar_bool_t match( // NOLINT(*-no-recursion)
             return true;
         }
         case PATTERN_KIND_RECORD: {
-            nar_list_t field_names = nar_to_list(rt, p.values);
-            for (size_t i = 0; i < field_names.size; i++) {
-                nar_cstring_t name = nar_to_string(rt, field_names.items[i]);
-                nar_object_t field = nar_to_record_field(rt, obj, name);
+            for (nar_object_t it = p.values; nar_index_is_valid(rt, it);) {
+                nar_list_item_t item = nar_to_list_item(rt, it);
+                nar_object_t name = item.value;
+                nar_object_t field = nar_to_record_field_obj(rt, obj, name);
                 if (!nar_object_is_valid(rt, field)) {
                     return false;
                 }
                 vector_push(rt->locals, 1, &(local_t) {.name = name, .value = field});
                 (*num_locals)++;
+                it = item.next;
             }
             return true;
         }
         case PATTERN_KIND_TUPLE: {
-            nar_tuple_t tuple = nar_to_tuple(rt, obj);
-            nar_list_t pat_items = nar_to_list(rt, p.values);
-            if (pat_items.size != tuple.size) {
+            if (!check_type(rt, obj, NAR_OBJECT_KIND_TUPLE)) {
                 return false;
             }
-            for (size_t i = 0; i < pat_items.size; i++) {
-                if (!match(rt, pat_items.items[i], tuple.values[i], num_locals)) {
+            nar_size_t tuple_size = 0;
+            for (nar_object_t it = obj; nar_index_is_valid(rt, it); tuple_size++) {
+                it = nar_to_tuple_item(rt, it).next;
+            }
+            if (list_size(rt, p.values) != tuple_size) {
+                return false;
+            }
+            nar_object_t pat_it = p.values;
+            nar_object_t obj_it = obj;
+            while (nar_index_is_valid(rt, pat_it)) {
+                nar_list_item_t pat_item = nar_to_list_item(rt, pat_it);
+                nar_tuple_item_t obj_item = nar_to_tuple_item(rt, obj_it);
+                if (!match(rt, pat_item.value, obj_item.value, num_locals)) {
                     return false;
                 }
+                pat_it = pat_item.next;
+                obj_it = obj_item.next;
             }
             return true;
         }
@@ -152,12 +174,12 @@ nar_bool_t match( // NOLINT(*-no-recursion)
     }
 }
 
-nar_cstring_t get_string(runtime_t *rt, index_t index) {
+nar_object_t get_string_object(runtime_t *rt, index_t index) {
     if(index >= rt->program->num_strings) {
         nar_fail(rt, "loaded bytecode is corrupted (invalid string index)");
-        return NULL;
+        return NAR_INVALID_OBJECT;
     }
-    return rt->program->strings[index];
+    return rt->program_strings[index];
 }
 
 const func_t *get_function(runtime_t *rt, index_t index) {
@@ -177,14 +199,29 @@ const hashed_const_t *get_hashed_const(runtime_t *rt, index_t index) {
 }
 
 nar_object_t execute(runtime_t *rt, const func_t *fn, vector_t *stack) { // NOLINT(*-no-recursion)
-    vector_t *pattern_stack = rvector_new(sizeof(nar_object_t), 0);
+    vector_t *pattern_stack = rt_vector_new(rt, sizeof(nar_object_t), 0);
     vector_push(rt->call_stack, 1, &fn->name);
+    gc_push_root(rt, stack);
+    gc_push_root(rt, pattern_stack);
+    if (rt->refcounts != NULL) {
+        rc_enter(rt);
+    }
     size_t num_locals = 0;
+    size_t num_executed = 0; // ops not yet charged as fuel
     nar_object_t result = NAR_INVALID_OBJECT;
 
     for (size_t index = 0; index < fn->num_ops; index++) {
         if (rt->last_error != NULL) {
-            return NAR_INVALID_OBJECT;
+            goto cleanup;
+        }
+        num_executed++;
+        // native code keeps objects in C locals, collection waits until it returns
+        if (rt->native_depth == 0) {
+            if (rt->gc_requested) {
+                gc_collect(rt);
+            } else if (rt->nursery_requested) {
+                gc_minor_collect(rt);
+            }
         }
 
         reg_a_t a;
@@ -194,12 +231,12 @@ nar_object_t execute(runtime_t *rt, const func_t *fn, vector_t *stack) { // NOLI
 
         switch (op_kind) {
             case OP_KIND_LOAD_LOCAL: {
-                nar_cstring_t name = get_string(rt, a);
+                nar_object_t name = get_string_object(rt, a);
                 bool found = false;
                 local_t *start = vector_at(rt->locals, vector_size(rt->locals) - 1);
                 local_t *end = start - num_locals;
                 for (local_t *it = start; it != end; it--) {
-                    if (strcmp(it->name, name) == 0) {
+                    if (it->name == name) {
                         vector_push(stack, 1, &it->value);
                         found = true;
                         break;
@@ -214,7 +251,11 @@ nar_object_t execute(runtime_t *rt, const func_t *fn, vector_t *stack) { // NOLI
             case OP_KIND_LOAD_GLOBAL: {
                 const func_t *glob = get_function(rt, a);
                 if (glob->num_args == 0) {
-                    vector_t *inner_stack = rvector_new(sizeof(nar_object_t), 0);
+                    if (!fuel_charge(rt, num_executed)) {
+                        goto cleanup;
+                    }
+                    num_executed = 0;
+                    vector_t *inner_stack = rt_vector_new(rt, sizeof(nar_object_t), 0);
                     nar_object_t const_value = execute(rt, glob, inner_stack);
                     vector_free(inner_stack);
 
@@ -245,7 +286,7 @@ nar_object_t execute(runtime_t *rt, const func_t *fn, vector_t *stack) { // NOLI
                         break;
                     }
                     case CONST_KIND_STRING: {
-                        value = nar_make_string(rt, get_string(rt, a));
+                        value = get_string_object(rt, a);
                         break;
                     }
                     default: {
@@ -274,15 +315,19 @@ nar_object_t execute(runtime_t *rt, const func_t *fn, vector_t *stack) { // NOLI
                 vector_pop(stack, 1, &x);
                 nar_closure_t afn = nar_to_closure(rt, x);
                 size_t num_args = b;
-                nar_list_t curried = nar_to_list(rt, afn.curried);
-                size_t num_params = num_args + curried.size;
-                vector_t *args = rvector_new(sizeof(nar_object_t), num_params);
-                vector_push(args, curried.size, curried.items);
+                vector_t *args = rt_vector_new(rt, sizeof(nar_object_t), num_args);
+                list_push_items(rt, afn.curried, args);
+                size_t num_params = num_args + vector_size(args);
                 vector_pop_vec(stack, num_args, args);
 
                 func_t *f = &rt->program->functions[afn.fn_index];
                 nar_object_t apply_result;
                 if (f->num_args == num_params) {
+                    if (!fuel_charge(rt, num_executed)) {
+                        vector_free(args);
+                        goto cleanup;
+                    }
+                    num_executed = 0;
                     apply_result = execute(rt, f, args);
                 } else {
                     apply_result = nar_make_closure(rt, afn.fn_index, vector_size(args),
@@ -290,12 +335,20 @@ nar_object_t execute(runtime_t *rt, const func_t *fn, vector_t *stack) { // NOLI
                 }
                 vector_free(args);
                 vector_push(stack, 1, &apply_result);
+                if (rt->refcounts != NULL) {
+                    rc_free(rt, x, num_locals);
+                }
                 break;
             }
             case OP_KIND_CALL: {
-                nar_cstring_t name = get_string(rt, a);
-                const native_def_item_t *def = hashmap_get(rt->native_defs,
-                        &(native_def_item_t) {.name = name});
+                nar_object_t name_obj = get_string_object(rt, a);
+                if (!nar_object_is_valid(rt, name_obj)) {
+                    goto cleanup;
+                }
+                const string_header_t *header = string_header(rt, name_obj);
+                nar_cstring_t name = header->data;
+                const native_def_item_t *def = hashmap_get_with_hash(rt->native_defs,
+                        &(native_def_item_t) {.name = name}, header->hash);
                 if (def == NULL) {
                     char err[1024];
                     snprintf(err, 1024,
@@ -304,10 +357,16 @@ nar_object_t execute(runtime_t *rt, const func_t *fn, vector_t *stack) { // NOLI
                     goto cleanup;
                 }
 
+                if (!fuel_charge(rt, num_executed)) {
+                    goto cleanup;
+                }
+                num_executed = 0;
+
+                // arguments stay on the (rooted) stack until native returns
                 nar_object_t call_result = NAR_INVALID_OBJECT;
                 size_t n = vector_size(stack);
-                nar_object_t *args = nar_alloc(n * sizeof(nar_object_t));
-                vector_pop(stack, n, args);
+                nar_object_t *args = vector_data(stack);
+                rt->native_depth++;
                 switch (def->arity) {
                     case 0:
                         call_result = (*(fn0_t) def->fn)(rt);
@@ -342,10 +401,12 @@ nar_object_t execute(runtime_t *rt, const func_t *fn, vector_t *stack) { // NOLI
                                 args[4], args[5], args[6], args[7]);
                         break;
                     default:
+                        rt->native_depth--;
                         nar_fail(rt, "function has too many parameters");
                         goto cleanup;
                 }
-                nar_free(args);
+                rt->native_depth--;
+                vector_pop(stack, n, NULL);
                 if (!nar_object_is_valid(rt, call_result)) {
                     char err[1024];
                     snprintf(err, 1024, "definition `%s` returned invalid object", name);
@@ -374,37 +435,36 @@ nar_object_t execute(runtime_t *rt, const func_t *fn, vector_t *stack) { // NOLI
             case OP_KIND_MAKE_OBJECT:
                 switch ((object_kind_t) b) {
                     case OBJECT_KIND_LIST: {
-                        nar_object_t *items = nar_alloc(a * sizeof(nar_object_t));
+                        nar_object_t *items = rt_alloc(rt, a * sizeof(nar_object_t));
                         vector_pop(stack, a, items);
                         nar_object_t list = nar_make_list(rt, a, items);
-                        nar_free(items);
+                        rt_free(rt, items);
                         vector_push(stack, 1, &list);
                         break;
                     }
                     case OBJECT_KIND_TUPLE: {
-                        nar_object_t *items = nar_alloc(a * sizeof(nar_object_t));
+                        nar_object_t *items = rt_alloc(rt, a * sizeof(nar_object_t));
                         vector_pop(stack, a, items);
                         nar_object_t tuple = nar_make_tuple(rt, a, items);
-                        nar_free(items);
+                        rt_free(rt, items);
                         vector_push(stack, 1, &tuple);
                         break;
                     }
                     case OBJECT_KIND_RECORD: {
-                        nar_object_t *items = nar_alloc(a * 2 * sizeof(nar_object_t));
+                        nar_object_t *items = rt_alloc(rt, a * 2 * sizeof(nar_object_t));
                         vector_pop(stack, a * 2, items);
                         nar_object_t record = nar_make_record_raw(rt, a, items);
-                        nar_free(items);
+                        rt_free(rt, items);
                         vector_push(stack, 1, &record);
                         break;
                     }
                     case OBJECT_KIND_OPTION: {
-                        nar_object_t name_obj;
-                        vector_pop(stack, 1, &name_obj);
-                        nar_cstring_t name = nar_to_string(rt, name_obj);
-                        nar_object_t *values = nar_alloc(a * sizeof(nar_object_t));
+                        nar_object_t name;
+                        vector_pop(stack, 1, &name);
+                        nar_object_t *values = rt_alloc(rt, a * sizeof(nar_object_t));
                         vector_pop(stack, a, values);
-                        nar_object_t option = nar_make_option(rt, name, a, values);
-                        nar_free(values);
+                        nar_object_t option = nar_make_option_obj(rt, name, a, values);
+                        rt_free(rt, values);
                         vector_push(stack, 1, &option);
                         break;
                     }
@@ -415,13 +475,13 @@ nar_object_t execute(runtime_t *rt, const func_t *fn, vector_t *stack) { // NOLI
                 }
                 break;
             case OP_KIND_MAKE_PATTERN: {
-                nar_cstring_t name = "";
+                nar_object_t name = EMPTY_STRING_OBJECT;
                 nar_object_t *items = NULL;
                 size_t num_items = 0;
                 pattern_kind_t kind = (pattern_kind_t) b;
                 switch (kind) {
                     case PATTERN_KIND_ALIAS: {
-                        name = get_string(rt, a);
+                        name = get_string_object(rt, a);
                         num_items = 1;
                         break;
                     }
@@ -437,7 +497,7 @@ nar_object_t execute(runtime_t *rt, const func_t *fn, vector_t *stack) { // NOLI
                         break;
                     }
                     case PATTERN_KIND_OPTION: {
-                        name = get_string(rt, a);
+                        name = get_string_object(rt, a);
                         num_items = c;
                         break;
                     }
@@ -446,7 +506,7 @@ nar_object_t execute(runtime_t *rt, const func_t *fn, vector_t *stack) { // NOLI
                         break;
                     }
                     case PATTERN_KIND_NAMED: {
-                        name = get_string(rt, a);
+                        name = get_string_object(rt, a);
                         break;
                     }
                     case PATTERN_KIND_RECORD: {
@@ -462,10 +522,10 @@ nar_object_t execute(runtime_t *rt, const func_t *fn, vector_t *stack) { // NOLI
                     }
                 }
 
-                items = nar_alloc(num_items * sizeof(nar_object_t));
+                items = rt_alloc(rt, num_items * sizeof(nar_object_t));
                 vector_pop(pattern_stack, num_items, items);
                 nar_object_t pattern = nar_make_pattern(rt, kind, name, num_items, items);
-                nar_free(items);
+                rt_free(rt, items);
                 if (!nar_object_is_valid(rt, pattern)) {
                     nar_fail(rt, "loaded bytecode is corrupted (failed to create pattern)");
                     goto cleanup;
@@ -476,8 +536,7 @@ nar_object_t execute(runtime_t *rt, const func_t *fn, vector_t *stack) { // NOLI
             case OP_KIND_ACCESS: {
                 nar_object_t record;
                 vector_pop(stack, 1, &record);
-                nar_cstring_t name = get_string(rt, a);
-                nar_object_t field = nar_to_record_field(rt, record, name);
+                nar_object_t field = nar_to_record_field_obj(rt, record, get_string_object(rt, a));
                 if (!nar_object_is_valid(rt, field)) {
                     nar_fail(rt, "loaded bytecode is corrupted (record missing field)");
                     goto cleanup;
@@ -486,25 +545,38 @@ nar_object_t execute(runtime_t *rt, const func_t *fn, vector_t *stack) { // NOLI
                 break;
             }
             case OP_KIND_UPDATE: {
-                nar_cstring_t key = get_string(rt, a);
+                nar_object_t key = get_string_object(rt, a);
                 nar_object_t value, record;
                 vector_pop(stack, 1, &value);
                 vector_pop(stack, 1, &record);
-                nar_object_t updated = nar_make_record_field(rt, record, key, value);
+                nar_object_t updated = NAR_INVALID_OBJECT;
+                if (rt->refcounts != NULL) {
+                    updated = rc_update_record(rt, record, key, value, num_locals);
+                }
+                if (!nar_object_is_valid(rt, updated)) {
+                    updated = nar_make_record_field_obj(rt, record, key, value);
+                }
                 vector_push(stack, 1, &updated);
                 break;
             }
             case OP_KIND_SWAP_POP: {
                 switch ((swap_pop_kind_t) b) {
                     case SWAP_POP_KIND_BOTH: {
-                        nar_object_t v;
+                        nar_object_t v, dropped;
                         vector_pop(stack, 1, &v);
-                        vector_pop(stack, 1, NULL);
+                        vector_pop(stack, 1, &dropped);
                         vector_push(stack, 1, &v);
+                        if (rt->refcounts != NULL) {
+                            rc_free(rt, dropped, num_locals);
+                        }
                         break;
                     }
                     case SWAP_POP_KIND_POP: {
-                        vector_pop(stack, 1, NULL);
+                        nar_object_t dropped;
+                        vector_pop(stack, 1, &dropped);
+                        if (rt->refcounts != NULL) {
+                            rc_free(rt, dropped, num_locals);
+                        }
                         break;
                     }
                     default: {
@@ -528,6 +600,14 @@ nar_object_t execute(runtime_t *rt, const func_t *fn, vector_t *stack) { // NOLI
     vector_pop(stack, 1, &result);
 
     cleanup:
+    if (rt->fuel_limited) {
+        rt->fuel = rt->fuel > num_executed ? rt->fuel - num_executed : 0;
+    }
+    if (rt->refcounts != NULL) {
+        rc_leave(rt);
+    }
+    gc_pop_root(rt);
+    gc_pop_root(rt);
     vector_free(pattern_stack);
     vector_pop(rt->locals, num_locals, NULL);
     vector_pop(rt->call_stack, 1, NULL);
@@ -0,0 +1,444 @@
+#include <string.h>
+#include "include/nar-runtime.h"
+#include "runtime.h"
+
+// Precise compacting collector for frame objects.
+// Roots are value stacks of running functions, bound locals and pinned objects.
+// Collection happens only at safe points of the interpreter loop (or when requested by host)
+// and is deferred while a native is running, so objects held by native code in C locals
+// are not moved when it calls back with `nar_apply_func`.
+//
+// With the nursery enabled new objects (except strings) are allocated in small per-kind
+// arenas first. Minor collection copies survivors into main arenas and empties the nursery.
+// Objects are immutable, so only main arena objects allocated since the last minor
+// collection can point into the nursery; they are scanned as additional roots.
+// Nursery objects allocated before the latest frame mark stay in place until the mark is
+// released, so promoted objects are always newer than every checkpoint and are dropped with it.
+
+typedef struct {
+    runtime_t *rt;
+    size_t *forward[NAR_OBJECT_KIND__COUNT]; // mark of every arena slot, then its new index
+    vector_t *worklist; // of nar_object_t
+} gc_t;
+
+nar_object_t gc_immediate_name(nar_object_t obj) {
+    return build_object(NAR_OBJECT_KIND_STRING, object_get_index(obj) & ~INDEX_FLAG_IMMEDIATE);
+}
+
+nar_bool_t gc_is_arena_object(runtime_t *rt, nar_object_t obj) {
+    if (obj == NAR_INVALID_OBJECT ||
+            (obj & (NAR_INVALID_INDEX | INDEX_FLAG_IMMEDIATE |
+                    INDEX_FLAG_PERMANENT | INDEX_FLAG_NURSERY | INDEX_DOMAIN_FLAGS))) {
+        return false;
+    }
+    arena_t *arena = rt->arenas[nar_object_get_kind(rt, obj)];
+    return arena != NULL && object_get_index(obj) < arena_size(arena);
+}
+
+void gc_mark(void *ctx, nar_object_t *slot) {
+    gc_t *gc = ctx;
+    nar_object_t obj = *slot;
+    if (object_is_immediate(obj) && nar_object_get_kind(gc->rt, obj) == NAR_OBJECT_KIND_OPTION) {
+        obj = gc_immediate_name(obj);
+    }
+    if (!gc_is_arena_object(gc->rt, obj)) {
+        return;
+    }
+    size_t *mark = &gc->forward[nar_object_get_kind(gc->rt, obj)][object_get_index(obj)];
+    if (*mark == 0) {
+        *mark = 1;
+        vector_push(gc->worklist, 1, &obj);
+    }
+}
+
+void gc_forward(void *ctx, nar_object_t *slot) {
+    gc_t *gc = ctx;
+    nar_object_t obj = *slot;
+    nar_object_kind_t kind = nar_object_get_kind(gc->rt, obj);
+    if (object_is_immediate(obj)) {
+        if (kind == NAR_OBJECT_KIND_OPTION) {
+            nar_object_t name = gc_immediate_name(obj);
+            gc_forward(gc, &name);
+            *slot = build_object(kind, INDEX_FLAG_IMMEDIATE | object_get_index(name));
+        }
+        return;
+    }
+    if (gc_is_arena_object(gc->rt, obj)) {
+        *slot = build_object(kind, gc->forward[kind][object_get_index(obj)]);
+    }
+}
+
+void object_visit_children(nar_object_kind_t kind, void *item, void *ctx, object_visit_fn_t visit) {
+    switch (kind) {
+        case NAR_OBJECT_KIND_STRING: {
+            string_header_t *header = item;
+            if (header->flags & STRING_FLAG_ROPE) {
+                visit(ctx, &header->rope->left);
+                visit(ctx, &header->rope->right);
+            }
+            break;
+        }
+        case NAR_OBJECT_KIND_RECORD: {
+            nar_record_item_t *field = item;
+            visit(ctx, &field->key);
+            visit(ctx, &field->value);
+            visit(ctx, &field->parent);
+            break;
+        }
+        case NAR_OBJECT_KIND_LIST: {
+            nar_list_item_t *list_item = item;
+            visit(ctx, &list_item->value);
+            visit(ctx, &list_item->next);
+            break;
+        }
+        case NAR_OBJECT_KIND_TUPLE: {
+            nar_tuple_item_t *tuple_item = item;
+            visit(ctx, &tuple_item->value);
+            visit(ctx, &tuple_item->next);
+            break;
+        }
+        case NAR_OBJECT_KIND_OPTION: {
+            nar_option_item_t *option = item;
+            visit(ctx, &option->name);
+            visit(ctx, &option->values);
+            break;
+        }
+        case NAR_OBJECT_KIND_CLOSURE: {
+            nar_closure_t *closure = item;
+            visit(ctx, &closure->curried);
+            break;
+        }
+        case NAR_OBJECT_KIND_PATTERN: {
+            nar_pattern_t *pattern = item;
+            visit(ctx, &pattern->name);
+            visit(ctx, &pattern->values);
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+// number of nursery objects allocated before the latest frame mark, they are not promoted
+size_t gc_nursery_kept(runtime_t *rt, nar_object_kind_t kind) {
+    size_t num_checkpoints = vector_size(rt->checkpoints);
+    if (rt->nurseries[kind] == NULL || num_checkpoints == 0) {
+        return 0;
+    }
+    frame_checkpoint_t *last = vector_at(rt->checkpoints, num_checkpoints - 1);
+    return last->nursery_sizes[kind];
+}
+
+void gc_visit_roots(gc_t *gc, object_visit_fn_t visit) {
+    runtime_t *rt = gc->rt;
+    for (vector_t **it = vector_begin(rt->roots); it != vector_end(rt->roots); it++) {
+        for (nar_object_t *obj = vector_begin(*it); obj != vector_end(*it); obj++) {
+            visit(gc, obj);
+        }
+    }
+    for (local_t *it = vector_begin(rt->locals); it != vector_end(rt->locals); it++) {
+        visit(gc, &it->name);
+        visit(gc, &it->value);
+    }
+    for (nar_object_t *it = vector_begin(rt->pinned); it != vector_end(rt->pinned); it++) {
+        visit(gc, it);
+    }
+    for (size_t kind = 0; kind < NAR_OBJECT_KIND__COUNT; kind++) {
+        size_t kept = gc_nursery_kept(rt, kind);
+        for (size_t i = 0; i < kept; i++) {
+            object_visit_children(kind, vector_at(rt->nurseries[kind], i), gc, visit);
+        }
+    }
+}
+
+void gc_compact(gc_t *gc, nar_object_kind_t kind) {
+    arena_t *arena = gc->rt->arenas[kind];
+    size_t *forward = gc->forward[kind];
+    vector_t *counts = gc->rt->refcounts == NULL ? NULL : gc->rt->refcounts[kind];
+    size_t size = arena_size(arena);
+    size_t num_live = 0;
+    for (size_t i = 0; i < size; i++) {
+        void *item = arena_at(arena, i);
+        if (forward[i] == GC_UNREACHABLE) {
+            if (kind == NAR_OBJECT_KIND_STRING) {
+                string_release_data(gc->rt, item);
+            }
+            continue;
+        }
+        if (forward[i] != i) {
+            memcpy(arena_at(arena, forward[i]), item, arena->item_size);
+            if (counts != NULL) {
+                *(uint32_t *) vector_at(counts, forward[i]) = *(uint32_t *) vector_at(counts, i);
+            }
+        }
+        num_live++;
+    }
+    arena_pop(arena, size - num_live);
+    if (counts != NULL) {
+        vector_pop(counts, size - num_live, NULL);
+    }
+}
+
+void gc_rebuild_string_hashes(runtime_t *rt) {
+    hashmap_clear(rt->string_hashes, false);
+    arena_t *strings = rt->arenas[NAR_OBJECT_KIND_STRING];
+    for (size_t i = 0; i < arena_size(strings); i++) {
+        string_header_t *header = arena_at(strings, i);
+        if (header->flags & STRING_FLAG_TRANSIENT) {
+            continue;
+        }
+        string_hast_t item = {
+                .string = header->data,
+                .length = header->length,
+                .index = build_object(NAR_OBJECT_KIND_STRING, i)
+        };
+        hashmap_set_with_hash(rt->string_hashes, &item, string_header_hash(header));
+    }
+}
+
+void gc_evacuate(void *ctx, nar_object_t *slot) {
+    gc_t *gc = ctx;
+    nar_object_t obj = *slot;
+    if (obj == NAR_INVALID_OBJECT || (obj & (NAR_INVALID_INDEX | INDEX_FLAG_IMMEDIATE)) ||
+            !(obj & INDEX_FLAG_NURSERY)) {
+        return;
+    }
+    runtime_t *rt = gc->rt;
+    nar_object_kind_t kind = nar_object_get_kind(rt, obj);
+    size_t index = object_get_index(obj) & ~INDEX_FLAG_NURSERY;
+    if (index < gc_nursery_kept(rt, kind)) {
+        return;
+    }
+    size_t *forward = &gc->forward[kind][index];
+    if (*forward == 0) {
+        arena_t *arena = rt->arenas[kind];
+        arena_push(arena, vector_at(rt->nurseries[kind], index));
+        if (rt->refcounts != NULL) {
+            rc_track(rt, kind);
+        }
+        *forward = arena_size(arena);
+        rt->gc_allocated++;
+    }
+    *slot = build_object(kind, *forward - 1);
+}
+
+// arena items do not move on growth, so children are updated in place during evacuation
+void gc_scan_tenured(gc_t *gc, nar_object_kind_t kind, size_t index) {
+    object_visit_children(kind, arena_at(gc->rt->arenas[kind], index), gc, &gc_evacuate);
+}
+
+// object limit counts live objects, so collections set the count to survivors
+void gc_recount_objects(runtime_t *rt) {
+    size_t num_objects = 0;
+    for (size_t kind = 0; kind < NAR_OBJECT_KIND__COUNT; kind++) {
+        num_objects += rt->arenas[kind] == NULL ? 0 : arena_size(rt->arenas[kind]);
+        num_objects += rt->nurseries[kind] == NULL ? 0 : vector_size(rt->nurseries[kind]);
+    }
+    rt->frame_objects = num_objects;
+    for (frame_checkpoint_t *it = vector_begin(rt->checkpoints);
+            it != vector_end(rt->checkpoints); it++) {
+        it->frame_objects = 0;
+        for (size_t kind = 0; kind < NAR_OBJECT_KIND__COUNT; kind++) {
+            it->frame_objects += it->arena_sizes[kind] + it->nursery_sizes[kind];
+        }
+    }
+}
+
+void gc_minor_collect(runtime_t *rt) {
+    if (rt->nursery_capacity == 0) {
+        return;
+    }
+    gc_t gc = {.rt = rt};
+    for (size_t kind = 0; kind < NAR_OBJECT_KIND__COUNT; kind++) {
+        vector_t *nursery = rt->nurseries[kind];
+        if (nursery != NULL && vector_size(nursery) > 0) {
+            size_t size = vector_size(nursery) * sizeof(size_t);
+            gc.forward[kind] = rt_alloc(rt, size);
+            memset(gc.forward[kind], 0, size);
+        }
+    }
+
+    gc_visit_roots(&gc, &gc_evacuate);
+
+    // Cheney-style scan: remembered objects first, then promoted ones appended after them
+    nar_bool_t progress = true;
+    while (progress) {
+        progress = false;
+        for (size_t kind = 0; kind < NAR_OBJECT_KIND__COUNT; kind++) {
+            arena_t *arena = rt->arenas[kind];
+            while (arena != NULL && rt->nursery_scan[kind] < arena_size(arena)) {
+                gc_scan_tenured(&gc, kind, rt->nursery_scan[kind]++);
+                progress = true;
+            }
+        }
+    }
+
+    for (size_t kind = 0; kind < NAR_OBJECT_KIND__COUNT; kind++) {
+        vector_t *nursery = rt->nurseries[kind];
+        if (nursery != NULL) {
+            vector_pop(nursery, vector_size(nursery) - gc_nursery_kept(rt, kind), NULL);
+        }
+        rt_free(rt, gc.forward[kind]);
+    }
+    rt->nursery_requested = false;
+    rc_reset_marks(rt);
+    gc_recount_objects(rt);
+    if (rt->gc_threshold != 0 && rt->gc_allocated >= rt->gc_trigger) {
+        rt->gc_requested = true;
+    }
+}
+
+void gc_collect(runtime_t *rt) {
+    if (rt->unified != NULL) {
+        return;
+    }
+    gc_minor_collect(rt);
+    gc_t gc = {.rt = rt, .worklist = rt_vector_new(rt, sizeof(nar_object_t), 256)};
+    for (size_t kind = 0; kind < NAR_OBJECT_KIND__COUNT; kind++) {
+        if (rt->arenas[kind] != NULL) {
+            size_t size = arena_size(rt->arenas[kind]);
+            gc.forward[kind] = rt_alloc(rt, size * sizeof(size_t));
+            if (size > 0) {
+                memset(gc.forward[kind], 0, size * sizeof(size_t));
+            }
+        }
+    }
+
+    gc_visit_roots(&gc, &gc_mark);
+    while (vector_size(gc.worklist) > 0) {
+        nar_object_t obj;
+        vector_pop(gc.worklist, 1, &obj);
+        nar_object_kind_t kind = nar_object_get_kind(rt, obj);
+        void *item = arena_at(rt->arenas[kind], object_get_index(obj));
+        object_visit_children(kind, item, &gc, &gc_mark);
+    }
+
+    size_t num_live = 0;
+    for (size_t kind = 0; kind < NAR_OBJECT_KIND__COUNT; kind++) {
+        size_t *forward = gc.forward[kind];
+        size_t size = rt->arenas[kind] == NULL ? 0 : arena_size(rt->arenas[kind]);
+        size_t next = 0;
+        for (size_t i = 0; i < size; i++) {
+            forward[i] = forward[i] ? next++ : GC_UNREACHABLE;
+        }
+        if (rt->arenas[kind] != NULL) {
+            frame_checkpoints_compacted(rt, kind, forward, next);
+        }
+        num_live += next;
+    }
+
+    // references are updated while objects are still at their old positions
+    for (size_t kind = 0; kind < NAR_OBJECT_KIND__COUNT; kind++) {
+        arena_t *arena = rt->arenas[kind];
+        size_t size = arena == NULL ? 0 : arena_size(arena);
+        for (size_t i = 0; i < size; i++) {
+            if (gc.forward[kind][i] != GC_UNREACHABLE) {
+                object_visit_children(kind, arena_at(arena, i), &gc, &gc_forward);
+            }
+        }
+    }
+    gc_visit_roots(&gc, &gc_forward);
+
+    for (size_t kind = 0; kind < NAR_OBJECT_KIND__COUNT; kind++) {
+        if (rt->arenas[kind] != NULL) {
+            gc_compact(&gc, kind);
+        }
+        rt_free(rt, gc.forward[kind]);
+    }
+    vector_free(gc.worklist);
+
+    gc_rebuild_string_hashes(rt);
+
+    for (size_t kind = 0; kind < NAR_OBJECT_KIND__COUNT; kind++) {
+        rt->nursery_scan[kind] = rt->arenas[kind] == NULL ? 0 : arena_size(rt->arenas[kind]);
+    }
+    rc_reset_marks(rt);
+    gc_recount_objects(rt);
+    rt->gc_allocated = 0;
+    rt->gc_trigger = num_live > rt->gc_threshold ? num_live : rt->gc_threshold;
+    rt->gc_requested = false;
+}
+
+void gc_push_root(runtime_t *rt, vector_t *stack) {
+    vector_push(rt->roots, 1, &stack);
+}
+
+void gc_pop_root(runtime_t *rt) {
+    vector_pop(rt->roots, 1, NULL);
+}
+
+void nar_set_gc_threshold(nar_runtime_t rt, nar_size_t num_objects) {
+    runtime_t *r = (runtime_t *) rt;
+    r->gc_threshold = num_objects;
+    r->gc_trigger = num_objects;
+    r->gc_allocated = 0;
+    r->gc_requested = false;
+}
+
+void nar_gc_collect(nar_runtime_t rt) {
+    runtime_t *r = (runtime_t *) rt;
+    if (r->native_depth > 0) {
+        r->gc_requested = true; // collected once natives on the call stack return
+        return;
+    }
+    gc_collect(r);
+}
+
+void nar_set_nursery_size(nar_runtime_t rt, nar_size_t num_objects) {
+    runtime_t *r = (runtime_t *) rt;
+    if (r->unified != NULL) {
+        nar_fail(rt, "nursery cannot be used with unified heap");
+        return;
+    }
+    gc_minor_collect(r);
+    for (size_t kind = 0; kind < NAR_OBJECT_KIND__COUNT; kind++) {
+        vector_free(r->nurseries[kind]);
+        r->nurseries[kind] = NULL;
+        // strings stay in main arena as intern table refers to them
+        if (num_objects != 0 && r->arenas[kind] != NULL && kind != NAR_OBJECT_KIND_STRING) {
+            r->nurseries[kind] = rt_vector_new(r, r->arenas[kind]->item_size, num_objects);
+        }
+    }
+    for (size_t kind = 0; kind < NAR_OBJECT_KIND__COUNT; kind++) {
+        r->nursery_scan[kind] = r->arenas[kind] == NULL ? 0 : arena_size(r->arenas[kind]);
+    }
+    r->nursery_capacity = num_objects;
+}
+
+nar_size_t nar_pin(nar_runtime_t rt, nar_object_t obj) {
+    runtime_t *r = (runtime_t *) rt;
+    vector_t *pinned = r->pinned;
+    nar_size_t size = vector_size(pinned);
+    // slots below the last checkpoint must not hold pins that it releases
+    nar_size_t first = 0;
+    size_t num_checkpoints = vector_size(r->checkpoints);
+    if (num_checkpoints > 0) {
+        frame_checkpoint_t *last = vector_at(r->checkpoints, num_checkpoints - 1);
+        first = last->pinned_size;
+    }
+    for (nar_size_t i = first; i < size; i++) {
+        nar_object_t *it = vector_at(pinned, i);
+        if (*it == NAR_INVALID_OBJECT) {
+            *it = obj;
+            return i;
+        }
+    }
+    vector_push(pinned, 1, &obj);
+    return size;
+}
+
+nar_object_t nar_pinned_get(nar_runtime_t rt, nar_size_t pin) {
+    vector_t *pinned = ((runtime_t *) rt)->pinned;
+    if (pin >= vector_size(pinned)) {
+        nar_fail(rt, "invalid pin handle");
+        return NAR_INVALID_OBJECT;
+    }
+    return *(nar_object_t *) vector_at(pinned, pin);
+}
+
+void nar_unpin(nar_runtime_t rt, nar_size_t pin) {
+    vector_t *pinned = ((runtime_t *) rt)->pinned;
+    if (pin < vector_size(pinned)) {
+        *(nar_object_t *) vector_at(pinned, pin) = NAR_INVALID_OBJECT;
+    }
+}
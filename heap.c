@@ -0,0 +1,251 @@
+#include <string.h>
+#include "include/nar-runtime.h"
+#include "runtime.h"
+
+// Heaps separate frame memory of request contexts that are interleaved on one runtime.
+// Objects of one heap are not valid in another one, while program strings and persistent
+// objects are shared by all heaps. Nursery size and refcounting mode are set per heap.
+//
+// A heap can use unified layout instead of per-kind arenas: objects of all kinds are
+// bump-allocated in one region, object index is the byte offset of its item, so objects
+// created together stay close in memory. Unified heap is released only as a whole
+// (or by checkpoints), garbage collection, nursery and refcounting are not available.
+
+heap_t *heap_new(runtime_t *rt) {
+    heap_t *heap = rt_alloc(rt, sizeof(heap_t));
+    memset(heap, 0, sizeof(heap_t));
+    heap->string_hashes = allocator_hashmap_new(&rt->allocator, sizeof(string_hast_t), 128,
+            &string_hast_hash, &string_hast_compare, NULL);
+
+    heap->arenas = rt_alloc(rt, NAR_OBJECT_KIND__COUNT * sizeof(void *));
+    memset(heap->arenas, 0, NAR_OBJECT_KIND__COUNT * sizeof(void *));
+    heap->arenas[NAR_OBJECT_KIND_CHAR] = arena_new(&rt->allocator, sizeof(nar_char_t));
+    heap->arenas[NAR_OBJECT_KIND_INT] = arena_new(&rt->allocator, sizeof(nar_int_t));
+    heap->arenas[NAR_OBJECT_KIND_FLOAT] = arena_new(&rt->allocator, sizeof(nar_float_t));
+    heap->arenas[NAR_OBJECT_KIND_STRING] = arena_new(&rt->allocator, sizeof(string_header_t));
+    heap->arenas[NAR_OBJECT_KIND_RECORD] = arena_new(&rt->allocator, sizeof(nar_record_item_t));
+    heap->arenas[NAR_OBJECT_KIND_TUPLE] = arena_new(&rt->allocator, sizeof(nar_tuple_item_t));
+    heap->arenas[NAR_OBJECT_KIND_LIST] = arena_new(&rt->allocator, sizeof(nar_list_item_t));
+    heap->arenas[NAR_OBJECT_KIND_OPTION] = arena_new(&rt->allocator, sizeof(nar_option_item_t));
+    heap->arenas[NAR_OBJECT_KIND_FUNCTION] = arena_new(&rt->allocator, sizeof(nar_func_t));
+    heap->arenas[NAR_OBJECT_KIND_CLOSURE] = arena_new(&rt->allocator, sizeof(nar_closure_t));
+    heap->arenas[NAR_OBJECT_KIND_NATIVE] = arena_new(&rt->allocator, sizeof(nar_native_t));
+    heap->arenas[NAR_OBJECT_KIND_PATTERN] = arena_new(&rt->allocator, sizeof(nar_pattern_t));
+    if (rt->arenas != NULL && rt->arena_byte_limit == 0) {
+        // new request context is likely to need as much memory as the active one,
+        // with a limit chunks are added only by growth that checks it
+        for (size_t i = 0; i < NAR_OBJECT_KIND__COUNT; i++) {
+            if (heap->arenas[i] != NULL) {
+                arena_reserve(heap->arenas[i], arena_working_set(rt->arenas[i]));
+            }
+        }
+    }
+    heap->nurseries = rt_alloc(rt, NAR_OBJECT_KIND__COUNT * sizeof(void *));
+    memset(heap->nurseries, 0, NAR_OBJECT_KIND__COUNT * sizeof(void *));
+    heap->nursery_scan = rt_alloc(rt, NAR_OBJECT_KIND__COUNT * sizeof(nar_size_t));
+    memset(heap->nursery_scan, 0, NAR_OBJECT_KIND__COUNT * sizeof(nar_size_t));
+
+    heap->frame_memory = rt_vector_new(rt, sizeof(nar_ptr_t), 16);
+    heap->frame_slab = bump_new(&rt->allocator);
+    heap->checkpoints = rt_vector_new(rt, sizeof(frame_checkpoint_t), 0);
+    heap->pinned = rt_vector_new(rt, sizeof(nar_object_t), 0);
+    heap->gc_trigger = rt->gc_threshold;
+    return heap;
+}
+
+void heap_save(runtime_t *rt) {
+    heap_t *heap = rt->heap;
+    heap->string_hashes = rt->string_hashes;
+    heap->arenas = rt->arenas;
+    heap->frame_memory = rt->frame_memory;
+    heap->frame_slab = rt->frame_slab;
+    heap->checkpoints = rt->checkpoints;
+    heap->pinned = rt->pinned;
+    heap->gc_trigger = rt->gc_trigger;
+    heap->gc_allocated = rt->gc_allocated;
+    heap->gc_requested = rt->gc_requested;
+    heap->nurseries = rt->nurseries;
+    heap->nursery_capacity = rt->nursery_capacity;
+    heap->nursery_scan = rt->nursery_scan;
+    heap->nursery_requested = rt->nursery_requested;
+    heap->refcounts = rt->refcounts;
+    heap->free_slots = rt->free_slots;
+    heap->frame_marks = rt->frame_marks;
+    heap->unified = rt->unified;
+    heap->unified_strings = rt->unified_strings;
+    heap->frame_bytes = rt->frame_bytes;
+    heap->frame_objects = rt->frame_objects;
+}
+
+void heap_load(runtime_t *rt, heap_t *heap) {
+    rt->heap = heap;
+    rt->string_hashes = heap->string_hashes;
+    rt->arenas = heap->arenas;
+    rt->frame_memory = heap->frame_memory;
+    rt->frame_slab = heap->frame_slab;
+    rt->checkpoints = heap->checkpoints;
+    rt->pinned = heap->pinned;
+    rt->gc_trigger = heap->gc_trigger;
+    rt->gc_allocated = heap->gc_allocated;
+    rt->gc_requested = heap->gc_requested;
+    rt->nurseries = heap->nurseries;
+    rt->nursery_capacity = heap->nursery_capacity;
+    rt->nursery_scan = heap->nursery_scan;
+    rt->nursery_requested = heap->nursery_requested;
+    rt->refcounts = heap->refcounts;
+    rt->free_slots = heap->free_slots;
+    rt->frame_marks = heap->frame_marks;
+    rt->unified = heap->unified;
+    rt->unified_strings = heap->unified_strings;
+    rt->frame_bytes = heap->frame_bytes;
+    rt->frame_objects = heap->frame_objects;
+}
+
+// frees the active heap, runtime fields are left dangling until another heap is loaded
+void heap_release(runtime_t *rt) {
+    frame_free(rt);
+    hashmap_free(rt->string_hashes);
+    for (size_t i = 0; i < NAR_OBJECT_KIND__COUNT; i++) {
+        arena_free(rt->arenas[i]);
+        vector_free(rt->nurseries[i]);
+    }
+    rt_free(rt, rt->arenas);
+    rt_free(rt, rt->nurseries);
+    rt_free(rt, rt->nursery_scan);
+    vector_free(rt->frame_memory);
+    bump_free(rt->frame_slab);
+    vector_free(rt->checkpoints);
+    vector_free(rt->pinned);
+    rc_free_state(rt);
+    bump_free(rt->unified);
+    vector_free(rt->unified_strings);
+    rt_free(rt, rt->heap);
+    rt->heap = NULL;
+}
+
+void heaps_frame_free(runtime_t *rt) {
+    heap_t *active = rt->heap;
+    heap_save(rt);
+    for (heap_t **it = vector_begin(rt->heaps); it != vector_end(rt->heaps); it++) {
+        heap_load(rt, *it);
+        frame_free(rt);
+        heap_save(rt);
+    }
+    heap_load(rt, active);
+}
+
+void heaps_free(runtime_t *rt) {
+    heap_save(rt);
+    for (heap_t **it = vector_begin(rt->heaps); it != vector_end(rt->heaps); it++) {
+        heap_load(rt, *it);
+        heap_release(rt);
+    }
+    vector_free(rt->heaps);
+}
+
+nar_heap_t nar_heap_new(nar_runtime_t rt) {
+    runtime_t *r = (runtime_t *) rt;
+    heap_t *heap = heap_new(r);
+    vector_push(r->heaps, 1, &heap);
+    return heap;
+}
+
+nar_heap_t nar_heap_select(nar_runtime_t rt, nar_heap_t heap) {
+    runtime_t *r = (runtime_t *) rt;
+    heap_t *active = r->heap;
+    if (heap == NULL) {
+        heap = *(heap_t **) vector_at(r->heaps, 0);
+    }
+    if (heap == active) {
+        return active;
+    }
+    if (vector_size(r->call_stack) > 0) {
+        nar_fail(rt, "heap cannot be selected during execution");
+        return active;
+    }
+    heap_save(r);
+    heap_load(r, heap);
+    return active;
+}
+
+void nar_heap_free(nar_runtime_t rt, nar_heap_t heap) {
+    runtime_t *r = (runtime_t *) rt;
+    size_t index = 0;
+    while (index < vector_size(r->heaps) && *(heap_t **) vector_at(r->heaps, index) != heap) {
+        index++;
+    }
+    if (index == 0 || index == vector_size(r->heaps)) {
+        nar_fail(rt, "only heaps created with nar_heap_new can be freed");
+        return;
+    }
+    if (heap == r->heap) {
+        if (vector_size(r->call_stack) > 0) {
+            nar_fail(rt, "active heap cannot be freed during execution");
+            return;
+        }
+        nar_heap_select(rt, NULL);
+    }
+
+    heap_t *active = r->heap;
+    heap_save(r);
+    heap_load(r, heap);
+    heap_release(r);
+    heap_load(r, active);
+    vector_remove(r->heaps, index);
+}
+
+nar_object_t unified_insert(runtime_t *rt, nar_object_kind_t kind, const void *value) {
+    size_t item_size = rt->arenas[kind]->item_size;
+    if (rt->arena_byte_limit != 0 &&
+            rt->unified->size + item_size > rt->unified->num_chunks * ARENA_CHUNK_SIZE &&
+            !limit_arena_grow(rt, kind, ARENA_CHUNK_SIZE)) {
+        return NAR_INVALID_OBJECT;
+    }
+    size_t offset = bump_alloc(rt->unified, item_size);
+    if (offset == BUMP_FAILED) {
+        return NAR_INVALID_OBJECT;
+    }
+    memcpy(bump_at(rt->unified, offset), value, item_size);
+    if (kind == NAR_OBJECT_KIND_STRING) {
+        vector_push(rt->unified_strings, 1, &offset);
+    }
+    return build_object(kind, offset);
+}
+
+// frees strings created after the first `num_strings` ones and removes them from intern table
+void unified_release_strings(runtime_t *rt, size_t num_strings) {
+    vector_t *strings = rt->unified_strings;
+    for (size_t i = num_strings; i < vector_size(strings); i++) {
+        string_header_t *header = bump_at(rt->unified, *(size_t *) vector_at(strings, i));
+        if (!(header->flags & STRING_FLAG_TRANSIENT)) {
+            hashmap_delete_with_hash(rt->string_hashes, &(string_hast_t) {
+                    .string = header->data,
+                    .length = header->length
+            }, string_header_hash(header));
+        }
+        string_free_data(rt, header);
+    }
+    vector_pop(strings, vector_size(strings) - num_strings, NULL);
+}
+
+void nar_set_unified_heap(nar_runtime_t rt, nar_bool_t enabled) {
+    runtime_t *r = (runtime_t *) rt;
+    if (vector_size(r->call_stack) > 0) {
+        nar_fail(rt, "heap layout cannot be changed during execution");
+        return;
+    }
+    if (enabled && (r->nursery_capacity != 0 || r->refcounts != NULL)) {
+        nar_fail(rt, "unified heap cannot be used with nursery or refcounting");
+        return;
+    }
+    frame_free(r);
+    if (enabled && r->unified == NULL) {
+        r->unified = bump_new(&r->allocator);
+        r->unified_strings = rt_vector_new(r, sizeof(size_t), 0);
+    } else if (!enabled && r->unified != NULL) {
+        bump_free(r->unified);
+        vector_free(r->unified_strings);
+        r->unified = NULL;
+        r->unified_strings = NULL;
+    }
+}
@@ -38,6 +38,9 @@ struct hashmap {
     void *(*malloc)(size_t);
     void *(*realloc)(void *, size_t);
     void (*free)(void *);
+    void *(*ctx_malloc)(void *ctx, size_t);
+    void (*ctx_free)(void *ctx, void *);
+    void *alloc_ctx;
     size_t elsize;
     size_t cap;
     uint64_t seed0;
@@ -99,10 +102,22 @@ static uint64_t get_hash(struct hashmap *map, const void *key) {
 }
 
 
-// hashmap_new_with_allocator returns a new hash map using a custom allocator.
-// See hashmap_new for more information information
-struct hashmap *hashmap_new_with_allocator(void *(*_malloc)(size_t), 
+static void *map_malloc(struct hashmap *map, size_t size) {
+    return map->ctx_malloc ? map->ctx_malloc(map->alloc_ctx, size) : map->malloc(size);
+}
+
+static void map_free(struct hashmap *map, void *ptr) {
+    if (map->ctx_free) {
+        map->ctx_free(map->alloc_ctx, ptr);
+    } else {
+        map->free(ptr);
+    }
+}
+
+static struct hashmap *hashmap_new_internal(void *(*_malloc)(size_t), 
     void *(*_realloc)(void*, size_t), void (*_free)(void*),
+    void *(*ctx_malloc)(void *ctx, size_t), void (*ctx_free)(void *ctx, void *),
+    void *alloc_ctx,
     size_t elsize, size_t cap, uint64_t seed0, uint64_t seed1,
     uint64_t (*hash)(const void *item, uint64_t seed0, uint64_t seed1),
     int (*compare)(const void *a, const void *b, void *udata),
@@ -127,11 +142,17 @@ struct hashmap *hashmap_new_with_allocator(void *(*_malloc)(size_t),
     }
     // hashmap + spare + edata
     size_t size = sizeof(struct hashmap)+bucketsz*2;
-    struct hashmap *map = _malloc(size);
+    struct hashmap *map = ctx_malloc ? ctx_malloc(alloc_ctx, size) : _malloc(size);
     if (!map) {
         return NULL;
     }
     memset(map, 0, sizeof(struct hashmap));
+    map->malloc = _malloc;
+    map->realloc = _realloc;
+    map->free = _free;
+    map->ctx_malloc = ctx_malloc;
+    map->ctx_free = ctx_free;
+    map->alloc_ctx = alloc_ctx;
     map->elsize = elsize;
     map->bucketsz = bucketsz;
     map->seed0 = seed0;
@@ -145,9 +166,9 @@ struct hashmap *hashmap_new_with_allocator(void *(*_malloc)(size_t),
     map->cap = cap;
     map->nbuckets = cap;
     map->mask = map->nbuckets-1;
-    map->buckets = _malloc(map->bucketsz*map->nbuckets);
+    map->buckets = map_malloc(map, map->bucketsz*map->nbuckets);
     if (!map->buckets) {
-        _free(map);
+        map_free(map, map);
         return NULL;
     }
     memset(map->buckets, 0, map->bucketsz*map->nbuckets);
@@ -155,12 +176,38 @@ struct hashmap *hashmap_new_with_allocator(void *(*_malloc)(size_t),
     map->loadfactor = clamp_load_factor(HASHMAP_LOAD_FACTOR, GROW_AT) * 100;
     map->growat = map->nbuckets * (map->loadfactor / 100.0);
     map->shrinkat = map->nbuckets * SHRINK_AT;
-    map->malloc = _malloc;
-    map->realloc = _realloc;
-    map->free = _free;
     return map;  
 }
 
+// hashmap_new_with_allocator returns a new hash map using a custom allocator.
+// See hashmap_new for more information information
+struct hashmap *hashmap_new_with_allocator(void *(*_malloc)(size_t), 
+    void *(*_realloc)(void*, size_t), void (*_free)(void*),
+    size_t elsize, size_t cap, uint64_t seed0, uint64_t seed1,
+    uint64_t (*hash)(const void *item, uint64_t seed0, uint64_t seed1),
+    int (*compare)(const void *a, const void *b, void *udata),
+    void (*elfree)(void *item),
+    void *udata)
+{
+    return hashmap_new_internal(_malloc, _realloc, _free, NULL, NULL, NULL,
+        elsize, cap, seed0, seed1, hash, compare, elfree, udata);
+}
+
+// hashmap_new_with_context_allocator returns a new hash map using a custom
+// allocator that receives `alloc_ctx` with every call.
+// See hashmap_new for more information information
+struct hashmap *hashmap_new_with_context_allocator(
+    void *(*_malloc)(void *ctx, size_t), void (*_free)(void *ctx, void *),
+    void *alloc_ctx, size_t elsize, size_t cap, uint64_t seed0, uint64_t seed1,
+    uint64_t (*hash)(const void *item, uint64_t seed0, uint64_t seed1),
+    int (*compare)(const void *a, const void *b, void *udata),
+    void (*elfree)(void *item),
+    void *udata)
+{
+    return hashmap_new_internal(NULL, NULL, NULL, _malloc, _free, alloc_ctx,
+        elsize, cap, seed0, seed1, hash, compare, elfree, udata);
+}
+
 // hashmap_new returns a new hash map. 
 // Param `elsize` is the size of each element in the tree. Every element that
 // is inserted, deleted, or retrieved will be this size.
@@ -210,9 +257,9 @@ void hashmap_clear(struct hashmap *map, bool update_cap) {
     if (update_cap) {
         map->cap = map->nbuckets;
     } else if (map->nbuckets != map->cap) {
-        void *new_buckets = map->malloc(map->bucketsz*map->cap);
+        void *new_buckets = map_malloc(map, map->bucketsz*map->cap);
         if (new_buckets) {
-            map->free(map->buckets);
+            map_free(map, map->buckets);
             map->buckets = new_buckets;
         }
         map->nbuckets = map->cap;
@@ -224,9 +271,10 @@ void hashmap_clear(struct hashmap *map, bool update_cap) {
 }
 
 static bool resize0(struct hashmap *map, size_t new_cap) {
-    struct hashmap *map2 = hashmap_new_with_allocator(map->malloc, map->realloc, 
-        map->free, map->elsize, new_cap, map->seed0, map->seed1, map->hash, 
-        map->compare, map->elfree, map->udata);
+    struct hashmap *map2 = hashmap_new_internal(map->malloc, map->realloc, 
+        map->free, map->ctx_malloc, map->ctx_free, map->alloc_ctx, map->elsize,
+        new_cap, map->seed0, map->seed1, map->hash, map->compare, map->elfree,
+        map->udata);
     if (!map2) return false;
     for (size_t i = 0; i < map->nbuckets; i++) {
         struct bucket *entry = bucket_at(map, i);
@@ -250,13 +298,13 @@ static bool resize0(struct hashmap *map, size_t new_cap) {
             entry->dib += 1;
         }
     }
-    map->free(map->buckets);
+    map_free(map, map->buckets);
     map->buckets = map2->buckets;
     map->nbuckets = map2->nbuckets;
     map->mask = map2->mask;
     map->growat = map2->growat;
     map->shrinkat = map2->shrinkat;
-    map->free(map2);
+    map_free(map, map2);
     return true;
 }
 
@@ -421,8 +469,8 @@ size_t hashmap_count(struct hashmap *map) {
 void hashmap_free(struct hashmap *map) {
     if (!map) return;
     free_elements(map);
-    map->free(map->buckets);
-    map->free(map);
+    map_free(map, map->buckets);
+    map_free(map, map);
 }
 
 // hashmap_oom returns true if the last hashmap_set() call failed due to the 
@@ -30,6 +30,14 @@ struct hashmap *hashmap_new_with_allocator(void *(*malloc)(size_t),
     void (*elfree)(void *item),
     void *udata);
 
+struct hashmap *hashmap_new_with_context_allocator(
+    void *(*malloc)(void *ctx, size_t), void (*free)(void *ctx, void *),
+    void *alloc_ctx, size_t elsize, size_t cap, uint64_t seed0, uint64_t seed1,
+    uint64_t (*hash)(const void *item, uint64_t seed0, uint64_t seed1),
+    int (*compare)(const void *a, const void *b, void *udata),
+    void (*elfree)(void *item),
+    void *udata);
+
 
 typedef struct hashmap hashmap_t;
 
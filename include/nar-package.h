@@ -3,6 +3,11 @@
 
 #include "nar.h"
 
+// Version of the package interface: layout of nar_t and of the types packages share with the
+// runtime. Version 2 appends members to nar_t and stores an allocator in vector_t,
+// vectors are private to the side that created them and are never passed across the interface.
+#define NAR_PACKAGE_ABI_VERSION 2
+
 typedef struct {
     // Memory API
 
@@ -146,6 +151,78 @@ typedef struct {
     nar_object_t (*make_enum_option_flags)(nar_runtime_t rt, nar_cstring_t type, nar_int_t flags);
 
     void (*enum_def)(nar_cstring_t type, nar_cstring_t option, nar_int_t value);
+
+    // Members below were added after the first package ABI. New members are only appended,
+    // so packages built against an earlier header keep working with the members they know.
+
+    // package ABI version of the runtime, see NAR_PACKAGE_ABI_VERSION
+    nar_size_t abi_version;
+
+    // allocator of the runtime, memory shared with the runtime should be allocated with it
+    const nar_allocator_t *allocator;
+
+    nar_size_t (*frame_mark)(nar_runtime_t rt);
+
+    void (*frame_release_to)(nar_runtime_t rt, nar_size_t mark);
+
+    nar_object_t (*persist)(nar_runtime_t rt, nar_object_t obj);
+
+    void (*persistent_clear)(nar_runtime_t rt);
+
+    nar_object_t (*copy_object)(nar_runtime_t dst, nar_runtime_t src, nar_object_t obj);
+
+    nar_heap_t (*heap_new)(nar_runtime_t rt);
+
+    void (*heap_free)(nar_runtime_t rt, nar_heap_t heap);
+
+    nar_heap_t (*heap_select)(nar_runtime_t rt, nar_heap_t heap);
+
+    void (*set_unified_heap)(nar_runtime_t rt, nar_bool_t enabled);
+
+    void (*gc_collect)(nar_runtime_t rt);
+
+    nar_size_t (*pin)(nar_runtime_t rt, nar_object_t obj);
+
+    nar_object_t (*pinned_get)(nar_runtime_t rt, nar_size_t pin);
+
+    void (*unpin)(nar_runtime_t rt, nar_size_t pin);
+
+    nar_object_t (*make_transient_string)(nar_runtime_t rt, nar_cstring_t value);
+
+    nar_object_t (*make_transient_string_len)(
+            nar_runtime_t rt, nar_cstring_t value, nar_size_t length);
+
+    nar_cstring_t (*to_string_len)(nar_runtime_t rt, nar_object_t obj, nar_size_t *length);
+
+    nar_bool_t (*string_is_ascii)(nar_runtime_t rt, nar_object_t obj);
+
+    nar_object_t (*make_string_concat)(nar_runtime_t rt, nar_object_t left, nar_object_t right);
+
+    void (*string_stream)(nar_runtime_t rt, nar_object_t obj, nar_stdout_fn_t write);
+
+    nar_bool_t (*string_write_fd)(nar_runtime_t rt, nar_object_t obj, int fd);
+
+    nar_serialized_object_t (*new_serialized_object_v2)(
+            nar_runtime_t rt, nar_object_t obj, nar_serialize_flags_t flags);
+
+    nar_size_t (*serialized_object_size)(nar_serialized_object_t obj);
+
+    nar_object_t (*deserialize_object_v2)(
+            nar_runtime_t rt, nar_serialized_object_t obj, nar_size_t size);
+
+    nar_bool_t (*serialize_to_writer)(nar_runtime_t rt, nar_object_t obj,
+            nar_serialize_flags_t flags, nar_serialize_write_fn_t write, nar_ptr_t ctx);
+
+    nar_bool_t (*serialize_to_fd)(
+            nar_runtime_t rt, nar_object_t obj, nar_serialize_flags_t flags, int fd);
+
+    nar_deserializer_t (*deserializer_new)(nar_runtime_t rt);
+
+    nar_bool_t (*deserializer_feed)(nar_deserializer_t d, nar_cptr_t data, nar_size_t size);
+
+    nar_object_t (*deserializer_finish)(nar_deserializer_t d);
+
+    nar_object_t (*deserialize_from_fd)(nar_runtime_t rt, int fd);
 } nar_t;
 
 typedef nar_int_t (*init_fn_t)(const nar_t *, nar_runtime_t);
@@ -11,13 +11,80 @@ nar_ptr_t nar_realloc(nar_ptr_t mem, nar_size_t size);
 
 void nar_free(nar_ptr_t mem);
 
+// allocator over nar_alloc, nar_realloc and nar_free
+extern const nar_allocator_t nar_default_allocator;
+
+void nar_print_memory(void);
+
+void nar_print_memory_sites(void);
+
 nar_ptr_t nar_frame_alloc(nar_runtime_t rt, nar_size_t size);
 
 void nar_frame_free(nar_runtime_t rt);
 
+nar_size_t nar_frame_mark(nar_runtime_t rt);
+
+void nar_frame_release_to(nar_runtime_t rt, nar_size_t mark);
+
+nar_object_t nar_persist(nar_runtime_t rt, nar_object_t obj);
+
+void nar_persistent_clear(nar_runtime_t rt);
+
+// writes object graph to a snapshot file that can be attached without deserialization
+nar_bool_t nar_snapshot_write(nar_runtime_t rt, nar_object_t obj, nar_cstring_t path);
+
+// maps snapshot file read-only and returns its root object, one snapshot can be attached at a time
+nar_object_t nar_snapshot_attach(nar_runtime_t rt, nar_cstring_t path);
+
+// unmaps attached snapshot, its objects must not be used afterwards
+void nar_snapshot_detach(nar_runtime_t rt);
+
+// deep copies object into the frame of `dst` runtime, shared structure stays shared
+nar_object_t nar_copy_object(nar_runtime_t dst, nar_runtime_t src, nar_object_t obj);
+
+nar_heap_t nar_heap_new(nar_runtime_t rt);
+
+void nar_heap_free(nar_runtime_t rt, nar_heap_t heap);
+
+nar_heap_t nar_heap_select(nar_runtime_t rt, nar_heap_t heap);
+
+void nar_set_unified_heap(nar_runtime_t rt, nar_bool_t enabled);
+
+// limits arena bytes of all heaps together, frame bytes (frame memory and string data)
+// and live objects of the frame, 0 - unlimited; exceeding a limit fails the evaluation,
+// the object that would cross it is NAR_INVALID_OBJECT and frame memory is NULL
+void nar_set_memory_limits(
+        nar_runtime_t rt, nar_size_t arena_bytes, nar_size_t frame_bytes, nar_size_t num_objects);
+
+// Garbage collector API
+
+void nar_set_gc_threshold(nar_runtime_t rt, nar_size_t num_objects);
+
+// collection requested by a running native is deferred until it returns
+void nar_gc_collect(nar_runtime_t rt);
+
+void nar_set_nursery_size(nar_runtime_t rt, nar_size_t num_objects);
+
+void nar_set_refcounting(nar_runtime_t rt, nar_bool_t enabled);
+
+nar_size_t nar_pin(nar_runtime_t rt, nar_object_t obj);
+
+nar_object_t nar_pinned_get(nar_runtime_t rt, nar_size_t pin);
+
+void nar_unpin(nar_runtime_t rt, nar_size_t pin);
+
 // Bytecode API
 nar_bytecode_t nar_bytecode_new(nar_size_t size, const nar_byte_t *data);
 
+nar_bytecode_t nar_bytecode_new_with_allocator(
+        nar_size_t size, const nar_byte_t *data, const nar_allocator_t *allocator);
+
+// maps bytecode file, aligned v2 bytecode is used in place and v1 bytecode is copied
+nar_bytecode_t nar_bytecode_open_mmap(nar_cstring_t path);
+
+// writes bytecode in aligned v2 format that can be used in place by nar_bytecode_open_mmap
+nar_bool_t nar_bytecode_write_v2(nar_bytecode_t btc, nar_cstring_t path);
+
 nar_cstring_t nar_bytecode_get_entry(nar_bytecode_t btc);
 
 void nar_bytecode_free(nar_bytecode_t bc);
@@ -26,6 +93,9 @@ void nar_bytecode_free(nar_bytecode_t bc);
 
 nar_runtime_t nar_runtime_new(nar_bytecode_t btc);
 
+// allocator is copied, all memory of the runtime is allocated with it
+nar_runtime_t nar_runtime_new_with_allocator(nar_bytecode_t btc, const nar_allocator_t *allocator);
+
 void nar_runtime_replace_program(nar_runtime_t rt, nar_bytecode_t btc);
 
 void nar_runtime_free(nar_runtime_t rt);
@@ -54,8 +124,20 @@ void nar_fail(nar_runtime_t rt, nar_cstring_t message);
 
 nar_cstring_t nar_get_error(nar_runtime_t rt);
 
+// code of the first error since the last nar_clear_error
+nar_error_code_t nar_get_error_code(nar_runtime_t rt);
+
 void nar_clear_error(nar_runtime_t rt);
 
+// sets number of instructions the runtime can execute before evaluation fails, 0 - unlimited
+void nar_set_fuel(nar_runtime_t rt, nar_size_t instructions);
+
+nar_size_t nar_get_fuel(nar_runtime_t rt);
+
+// stops running evaluation (or the next one) with NAR_ERROR_INTERRUPTED,
+// safe to call from another thread or a signal handler
+void nar_runtime_interrupt(nar_runtime_t rt);
+
 // Object API
 
 nar_object_kind_t nar_object_get_kind(__attribute__((unused)) nar_runtime_t rt, nar_object_t obj);
@@ -82,8 +164,23 @@ nar_float_t nar_to_float(nar_runtime_t rt, nar_object_t obj);
 
 nar_object_t nar_make_string(nar_runtime_t rt, nar_cstring_t value);
 
+nar_object_t nar_make_transient_string(nar_runtime_t rt, nar_cstring_t value);
+
+nar_object_t nar_make_transient_string_len(
+        nar_runtime_t rt, nar_cstring_t value, nar_size_t length);
+
 nar_cstring_t nar_to_string(nar_runtime_t rt, nar_object_t obj);
 
+nar_cstring_t nar_to_string_len(nar_runtime_t rt, nar_object_t obj, nar_size_t *length);
+
+nar_bool_t nar_string_is_ascii(nar_runtime_t rt, nar_object_t obj);
+
+nar_object_t nar_make_string_concat(nar_runtime_t rt, nar_object_t left, nar_object_t right);
+
+void nar_string_stream(nar_runtime_t rt, nar_object_t obj, nar_stdout_fn_t write);
+
+nar_bool_t nar_string_write_fd(nar_runtime_t rt, nar_object_t obj, int fd);
+
 nar_object_t nar_make_record(
         nar_runtime_t rt, nar_size_t size, const nar_cstring_t *keys, const nar_object_t *values);
 
@@ -145,6 +242,38 @@ nar_serialized_object_t nar_new_serialized_object(nar_runtime_t rt, nar_object_t
 
 nar_object_t nar_deserialize_object(nar_runtime_t rt, nar_serialized_object_t obj);
 
+// serializes object to the portable format, returns NULL if object cannot be serialized
+nar_serialized_object_t nar_new_serialized_object_v2(
+        nar_runtime_t rt, nar_object_t obj, nar_serialize_flags_t flags);
+
+// size in bytes of object serialized by nar_new_serialized_object_v2, 0 for other data
+nar_size_t nar_serialized_object_size(nar_serialized_object_t obj);
+
+nar_object_t nar_deserialize_object_v2(
+        nar_runtime_t rt, nar_serialized_object_t obj, nar_size_t size);
+
+// Streaming serialization writes the portable format in chunks of bounded size,
+// nar_deserialize_object_v2 also accepts streamed objects collected into one buffer.
+
+nar_bool_t nar_serialize_to_writer(nar_runtime_t rt, nar_object_t obj,
+        nar_serialize_flags_t flags, nar_serialize_write_fn_t write, nar_ptr_t ctx);
+
+nar_bool_t nar_serialize_to_fd(
+        nar_runtime_t rt, nar_object_t obj, nar_serialize_flags_t flags, int fd);
+
+// Incremental deserializer builds the object in the current frame while chunks arrive,
+// garbage collection and frame release must not happen before it is finished.
+nar_deserializer_t nar_deserializer_new(nar_runtime_t rt);
+
+// consumes next chunk of any size, returns false if data is corrupted
+nar_bool_t nar_deserializer_feed(nar_deserializer_t d, nar_cptr_t data, nar_size_t size);
+
+// frees deserializer and returns the object, fails if the stream is incomplete
+nar_object_t nar_deserializer_finish(nar_deserializer_t d);
+
+// reads streamed object until end of file
+nar_object_t nar_deserialize_from_fd(nar_runtime_t rt, int fd);
+
 // various helpers
 
 nar_bool_t nar_to_enum_option_s(nar_runtime_t rt, nar_object_t opt, nar_int_t *value);
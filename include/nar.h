@@ -9,6 +9,7 @@
 #endif
 
 typedef void *nar_runtime_t;
+typedef void *nar_heap_t;
 
 typedef size_t nar_size_t;
 
@@ -26,14 +27,43 @@ typedef void *nar_ptr_t;
 typedef void *nar_cptr_t;
 typedef nar_int_t (*nar_cmp_native_fn_t)(nar_runtime_t rt, nar_cptr_t a, nar_cptr_t b);
 typedef void (*nar_stdout_fn_t)(nar_runtime_t rt, nar_cstring_t message);
+
+typedef enum {
+    NAR_ERROR_NONE = 0,
+    NAR_ERROR_FAILED = 1, // nar_fail called by the runtime or a package
+    NAR_ERROR_MEMORY_LIMIT = 2,
+    NAR_ERROR_OUT_OF_FUEL = 3,
+    NAR_ERROR_INTERRUPTED = 4,
+} nar_error_code_t;
+
 typedef uint64_t nar_object_t;
 typedef void *nar_serialized_object_t;
 
+typedef enum {
+    NAR_SERIALIZE_DEFAULT = 0,
+    NAR_SERIALIZE_SHARED = 1, // objects reachable by several paths are written once
+} nar_serialize_flags_t;
+
+// receives next chunk of streamed serialized object, returns false to stop serialization
+typedef nar_bool_t (*nar_serialize_write_fn_t)(nar_ptr_t ctx, nar_cptr_t data, nar_size_t size);
+
+typedef void *nar_deserializer_t;
+
 typedef struct {
     nar_cptr_t ptr;
     nar_cmp_native_fn_t cmp;
 } nar_native_t;
 
+// Allocator used by a runtime for all its memory, `ctx` is passed to every call.
+// alloc and realloc are never called with zero size, realloc can be called with NULL memory
+// and free is never called with NULL. Allocation failures are handled by the allocator.
+typedef struct {
+    nar_ptr_t ctx;
+    nar_ptr_t (*alloc)(nar_ptr_t ctx, nar_size_t size);
+    nar_ptr_t (*realloc)(nar_ptr_t ctx, nar_ptr_t mem, nar_size_t size);
+    void (*free)(nar_ptr_t ctx, nar_ptr_t mem);
+} nar_allocator_t;
+
 typedef struct {
     nar_size_t size;
     nar_cstring_t *keys;
@@ -6,24 +6,25 @@
 #include "nar.h"
 #include "nar-runtime.h"
 
-typedef nar_ptr_t (*realloc_fn_t)(nar_ptr_t mem, nar_size_t size);
-typedef void (*free_fn_t)(nar_ptr_t mem);
 typedef void (*fail_fn_t)(nar_runtime_t rt, nar_cstring_t msg);
 
 #define nvector_new(item_size, capacity, nar) \
-    vector_new(item_size, capacity, nar->realloc, nar->free, nar->fail)
+    vector_new(item_size, capacity, nar->allocator, nar->fail)
 
 #define rvector_new(item_size, capacity) \
-    vector_new(item_size, capacity, \
-    (realloc_fn_t)nar_realloc, (free_fn_t)nar_free, (fail_fn_t)nar_fail)
+    vector_new(item_size, capacity, &nar_default_allocator, (fail_fn_t)nar_fail)
 
+#define avector_new(item_size, capacity, allocator) \
+    vector_new(item_size, capacity, allocator, (fail_fn_t)nar_fail)
+
+// Layout changed in package ABI 2 (NAR_PACKAGE_ABI_VERSION), vectors must not be passed between
+// a package and the runtime.
 typedef struct {
     void *data;
     size_t size;
     size_t capacity;
     size_t item_size;
-    realloc_fn_t realloc;
-    free_fn_t free;
+    const nar_allocator_t *allocator;
     fail_fn_t fail;
 } vector_t;
 
@@ -49,20 +50,20 @@ static void __ensure_capacity(vector_t *v, size_t new_len) {
         }
         v->capacity = new_cap;
         if (v->capacity > 0) {
-            v->data = v->realloc(v->data, v->capacity * v->item_size);
+            v->data = v->allocator->realloc(
+                    v->allocator->ctx, v->data, v->capacity * v->item_size);
         }
     }
 }
 
 static vector_t *vector_new(
-        size_t item_size, size_t capacity, realloc_fn_t realloc, free_fn_t free, fail_fn_t fail) {
-    vector_t *v = realloc(NULL, sizeof(vector_t));
+        size_t item_size, size_t capacity, const nar_allocator_t *allocator, fail_fn_t fail) {
+    vector_t *v = allocator->alloc(allocator->ctx, sizeof(vector_t));
     v->data = NULL;
     v->size = 0;
     v->capacity = 0;
     v->item_size = item_size;
-    v->realloc = realloc;
-    v->free = free;
+    v->allocator = allocator;
     v->fail = fail;
     __ensure_capacity(v, capacity);
     return v;
@@ -72,8 +73,10 @@ static void vector_free(vector_t *v) {
     if (v == NULL) {
         return;
     }
-    v->free(v->data);
-    v->free(v);
+    if (v->data != NULL) {
+        v->allocator->free(v->allocator->ctx, v->data);
+    }
+    v->allocator->free(v->allocator->ctx, v);
 }
 
 static void vector_push(vector_t *v, size_t n, const void *items) {
@@ -74,21 +74,7 @@ int main(int argc, char *argv[]) {
         setenv("NAR_LIBS_PATH", libs_path, true);
     }
 
-    FILE *file = fopen(getenv(ENV_NAR_PROGRAM_PATH), "rb");
-    if (file == NULL) {
-        printf("Error: could not open file %s\n", argv[1]);
-        errno = -3;
-        goto cleanup;
-    }
-    fseek(file, 0, SEEK_END);
-    size_t file_size = ftell(file);
-    fseek(file, 0, SEEK_SET);
-    nar_byte_t *binary = nar_alloc(file_size);
-    fread(binary, 1, file_size, file);
-    fclose(file);
-
-    nar_bytecode_t btc = nar_bytecode_new(file_size, binary);
-    nar_free(binary);
+    nar_bytecode_t btc = nar_bytecode_open_mmap(getenv(ENV_NAR_PROGRAM_PATH));
     if (btc == 0 || nar_get_error(NULL) != NULL) {
         printf("Error: could not load bytecode from file %s (%s)\n", argv[1],
                 nar_get_error(NULL));
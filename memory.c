@@ -1,121 +1,505 @@
 #include <stdlib.h>
 #include <assert.h>
-#include <printf.h>
+#include <stdio.h>
 #include "include/nar-runtime.h"
 #include "runtime.h"
 
-#define MEMORY_DEBUG
+#ifdef NAR_MEMORY_DEBUG
+#include <stdatomic.h>
 
-#ifdef MEMORY_DEBUG
-vector_t *memory_indices;
-size_t memory_index = 0;
+// Debug tracker registers every live block. Block header keeps its registry slot, so free
+// is O(1): the last registered block is moved to the freed slot. Statistics are collected
+// per allocation site, that is the return address of the caller of nar_alloc, nar_realloc
+// or of the default allocator.
+
+#if defined(__GNUC__) || defined(__clang__)
+#define ALLOC_SITE() __builtin_return_address(0)
+#else
+#define ALLOC_SITE() NULL
 #endif
 
-nar_ptr_t nar_alloc(nar_size_t size) {
-    if (size == 0) {
-        return NULL;
+#define ALLOC_MAGIC 0x4e41524d454d4f52
+
+typedef struct {
+    size_t slot;
+    size_t size;
+    const void *site;
+    size_t magic;
+} alloc_header_t;
+
+typedef struct {
+    const void *site;
+    size_t num_allocs;
+    size_t total_bytes;
+    size_t num_live;
+    size_t live_bytes;
+} alloc_site_t;
+
+atomic_flag memory_lock = ATOMIC_FLAG_INIT;
+vector_t *memory_blocks; // of alloc_header_t*
+hashmap_t *memory_sites; // of alloc_site_t
+
+int alloc_site_compare(const void *a, const void *b, __attribute__((unused)) void *data) {
+    const alloc_site_t *ia = a;
+    const alloc_site_t *ib = b;
+    return ia->site == ib->site ? 0 : (ia->site < ib->site ? -1 : 1);
+}
+
+uint64_t alloc_site_hash(const void *item, uint64_t seed0, uint64_t seed1) {
+    const alloc_site_t *i = item;
+    return hashmap_sip(&i->site, sizeof(i->site), seed0, seed1);
+}
+
+nar_ptr_t libc_alloc(__attribute__((unused)) nar_ptr_t ctx, nar_size_t size) {
+    return malloc(size);
+}
+
+nar_ptr_t libc_realloc(__attribute__((unused)) nar_ptr_t ctx, nar_ptr_t mem, nar_size_t size) {
+    return realloc(mem, size);
+}
+
+void libc_free(__attribute__((unused)) nar_ptr_t ctx, nar_ptr_t mem) {
+    free(mem);
+}
+
+// tracker memory itself is not tracked
+const nar_allocator_t libc_allocator = {
+        .alloc = &libc_alloc,
+        .realloc = &libc_realloc,
+        .free = &libc_free,
+};
+
+void memory_lock_acquire(void) {
+    while (atomic_flag_test_and_set_explicit(&memory_lock, memory_order_acquire)) {
     }
+    if (memory_blocks == NULL) {
+        memory_blocks = vector_new(sizeof(alloc_header_t *), 0, &libc_allocator, &nar_fail);
+        memory_sites = hashmap_new_with_allocator(malloc, realloc, free, sizeof(alloc_site_t), 0,
+                0, 0, &alloc_site_hash, &alloc_site_compare, NULL, NULL);
+    }
+}
 
-#ifdef MEMORY_DEBUG
-    if (memory_indices == NULL) {
-        memory_indices = vector_new(sizeof(size_t), 0, realloc, free, &nar_fail);
+void memory_lock_release(void) {
+    atomic_flag_clear_explicit(&memory_lock, memory_order_release);
+}
+
+alloc_site_t *memory_site(const void *site) {
+    alloc_site_t key = {.site = site};
+    alloc_site_t *found = (alloc_site_t *) hashmap_get(memory_sites, &key);
+    if (found == NULL) {
+        hashmap_set(memory_sites, &key);
+        found = (alloc_site_t *) hashmap_get(memory_sites, &key);
     }
-    size_t index = memory_index++;
-    vector_push(memory_indices, 1, &index);
-    nar_ptr_t mem = malloc(size + sizeof(size_t));
-    assert(mem && "Out of memory");
-    *((size_t *) mem) = index;
-    mem += sizeof(size_t);
+    return found;
+}
+
+// expects memory lock to be held
+void memory_track(alloc_header_t *header, size_t size, const void *site) {
+    *header = (alloc_header_t) {
+            .slot = vector_size(memory_blocks),
+            .size = size,
+            .site = site,
+            .magic = ALLOC_MAGIC,
+    };
+    vector_push(memory_blocks, 1, &header);
+    alloc_site_t *stats = memory_site(site);
+    stats->num_allocs++;
+    stats->total_bytes += size;
+    stats->num_live++;
+    stats->live_bytes += size;
+}
+
+// expects memory lock to be held
+void memory_untrack(alloc_header_t *header) {
+    assert(header->magic == ALLOC_MAGIC && "trying to free memory that was not allocated");
+    size_t last = vector_size(memory_blocks) - 1;
+    alloc_header_t *moved = *(alloc_header_t **) vector_at(memory_blocks, last);
+    *(alloc_header_t **) vector_at(memory_blocks, header->slot) = moved;
+    moved->slot = header->slot;
+    vector_pop(memory_blocks, 1, NULL);
+    alloc_site_t *stats = memory_site(header->site);
+    stats->num_live--;
+    stats->live_bytes -= header->size;
+    header->magic = 0;
+}
 #else
-    nar_ptr_t mem = malloc(size + sizeof(size_t));
-    assert(mem && "Out of memory");
+#define ALLOC_SITE() NULL
 #endif
 
+nar_ptr_t memory_alloc(nar_size_t size, __attribute__((unused)) const void *site) {
+    if (size == 0) {
+        return NULL;
+    }
+
+#ifdef NAR_MEMORY_DEBUG
+    alloc_header_t *header = malloc(sizeof(alloc_header_t) + size);
+    assert(header && "Out of memory");
+    memory_lock_acquire();
+    memory_track(header, size, site);
+    memory_lock_release();
+    return header + 1;
+#else
+    nar_ptr_t mem = malloc(size);
+    assert(mem && "Out of memory");
     return mem;
+#endif
 }
 
-nar_ptr_t nar_realloc(nar_ptr_t mem, nar_size_t size) {
+nar_ptr_t memory_realloc(nar_ptr_t mem, nar_size_t size, __attribute__((unused)) const void *site) {
     if (size == 0) {
         nar_free(mem);
         return NULL;
     }
-    if (mem == NULL) {
-        return nar_alloc(size);
+#ifdef NAR_MEMORY_DEBUG
+    alloc_header_t *header = NULL;
+    memory_lock_acquire();
+    if (mem != NULL) {
+        header = (alloc_header_t *) mem - 1;
+        site = header->site;
+        memory_untrack(header);
     }
-#ifdef MEMORY_DEBUG
-    nar_ptr_t new_mem = realloc(mem - sizeof(size_t), size + sizeof(size_t));
-    assert(new_mem && "Out of memory");
-    new_mem += sizeof(size_t);
+    header = realloc(header, sizeof(alloc_header_t) + size);
+    assert(header && "Out of memory");
+    memory_track(header, size, site);
+    memory_lock_release();
+    return header + 1;
 #else
-    nar_ptr_t new_mem = realloc(mem, size + sizeof(size_t));
+    nar_ptr_t new_mem = realloc(mem, size);
     assert(new_mem && "Out of memory");
-#endif
     return new_mem;
+#endif
 }
 
 void nar_free(nar_ptr_t mem) {
     if (mem == NULL) {
         return;
     }
-#ifdef MEMORY_DEBUG
-    mem -= sizeof(size_t);
-    bool found = false;
-    size_t index = *((size_t *) mem);
-    for (size_t i = 0; i < vector_size(memory_indices); i++) {
-        size_t *it = vector_at(memory_indices, i);
-        if (*it == index) {
-            vector_remove_fast_loosing_order(memory_indices, i);
-            found = true;
-            break;
-        }
+#ifdef NAR_MEMORY_DEBUG
+    alloc_header_t *header = (alloc_header_t *) mem - 1;
+    memory_lock_acquire();
+    memory_untrack(header);
+    memory_lock_release();
+    free(header);
+#else
+    free(mem);
+#endif
+}
+
+nar_ptr_t nar_alloc(nar_size_t size) {
+    return memory_alloc(size, ALLOC_SITE());
+}
+
+nar_ptr_t nar_realloc(nar_ptr_t mem, nar_size_t size) {
+    return memory_realloc(mem, size, ALLOC_SITE());
+}
+
+nar_ptr_t default_alloc(__attribute__((unused)) nar_ptr_t ctx, nar_size_t size) {
+    return memory_alloc(size, ALLOC_SITE());
+}
+
+nar_ptr_t default_realloc(__attribute__((unused)) nar_ptr_t ctx, nar_ptr_t mem, nar_size_t size) {
+    return memory_realloc(mem, size, ALLOC_SITE());
+}
+
+void default_free(__attribute__((unused)) nar_ptr_t ctx, nar_ptr_t mem) {
+    nar_free(mem);
+}
+
+const nar_allocator_t nar_default_allocator = {
+        .alloc = &default_alloc,
+        .realloc = &default_realloc,
+        .free = &default_free,
+};
+
+void *allocator_hashmap_malloc(void *ctx, size_t size) {
+    return allocator_alloc(ctx, size);
+}
+
+void allocator_hashmap_free(void *ctx, void *mem) {
+    allocator_free(ctx, mem);
+}
+
+hashmap_t *allocator_hashmap_new(
+        const nar_allocator_t *allocator, size_t elsize, size_t cap,
+        uint64_t (*hash)(const void *item, uint64_t seed0, uint64_t seed1),
+        int (*compare)(const void *a, const void *b, void *udata),
+        void *udata) {
+    return hashmap_new_with_context_allocator(
+            &allocator_hashmap_malloc, &allocator_hashmap_free, (void *) allocator,
+            elsize, cap, 0, 0, hash, compare, NULL, udata);
+}
+
+void nar_print_memory(void) {
+#ifdef NAR_MEMORY_DEBUG
+    memory_lock_acquire();
+    for (size_t i = 0; i < vector_size(memory_blocks); i++) {
+        alloc_header_t *it = *(alloc_header_t **) vector_at(memory_blocks, i);
+        printf("memory leak: %zu bytes allocated at %p\n", it->size, it->site);
     }
-    assert(found && "trying to free memory that was not allocated");
+    memory_lock_release();
 #endif
-    free(mem);
 }
 
-void nar_print_memory() {
-#ifdef MEMORY_DEBUG
-    for (size_t i = 0; i < vector_size(memory_indices); i++) {
-        size_t *it = vector_at(memory_indices, i);
-        printf("memory leak index: %d\n", (int) *((size_t *) it));
+void nar_print_memory_sites(void) {
+#ifdef NAR_MEMORY_DEBUG
+    memory_lock_acquire();
+    size_t iter = 0;
+    void *item;
+    printf("%-18s %12s %14s %10s %12s\n", "site", "allocations", "bytes", "live", "live bytes");
+    while (hashmap_iter(memory_sites, &iter, &item)) {
+        alloc_site_t *it = item;
+        printf("%-18p %12zu %14zu %10zu %12zu\n",
+                it->site, it->num_allocs, it->total_bytes, it->num_live, it->live_bytes);
     }
+    memory_lock_release();
 #endif
 }
 
+// Memory limits fail evaluation with NAR_ERROR_MEMORY_LIMIT. The allocation that crosses a limit
+// fails too: objects are NAR_INVALID_OBJECT and frame memory is NULL, execution stops at
+// the next instruction. Frame bytes include data of frame strings and rope nodes.
+
+void limit_fail(runtime_t *rt, nar_cstring_t msg) {
+    if (rt->last_error == NULL) {
+        runtime_fail(rt, NAR_ERROR_MEMORY_LIMIT, msg);
+    }
+}
+
+size_t heap_arena_bytes(arena_t **arenas, bump_t *unified) {
+    size_t used = 0;
+    for (size_t i = 0; i < NAR_OBJECT_KIND__COUNT; i++) {
+        arena_t *arena = arenas[i];
+        if (arena != NULL) {
+            used += arena->num_chunks * (arena->item_size << arena->chunk_shift);
+        }
+    }
+    if (unified != NULL) {
+        used += unified->num_chunks * ARENA_CHUNK_SIZE;
+    }
+    return used;
+}
+
+// arena limit is shared by all heaps, fields of the active one live in runtime
+nar_bool_t limit_arena_grow(runtime_t *rt, nar_object_kind_t kind, size_t chunk_bytes) {
+    size_t used = heap_arena_bytes(rt->arenas, rt->unified);
+    for (heap_t **it = vector_begin(rt->heaps); it != vector_end(rt->heaps); it++) {
+        if (*it != rt->heap) {
+            used += heap_arena_bytes((*it)->arenas, (*it)->unified);
+        }
+    }
+    if (used + chunk_bytes > rt->arena_byte_limit) {
+        char err[128];
+        snprintf(err, sizeof(err), "memory limit exceeded: %zu arena bytes, allocating %s objects",
+                rt->arena_byte_limit, kind_to_string(kind));
+        limit_fail(rt, err);
+        return false;
+    }
+    return true;
+}
+
+void limit_objects(runtime_t *rt, nar_object_kind_t kind) {
+    char err[128];
+    snprintf(err, sizeof(err), "object limit exceeded: %zu objects, allocating %s objects",
+            rt->object_limit, kind_to_string(kind));
+    limit_fail(rt, err);
+}
+
+// charges frame memory limit, it is counted only when it is set
+nar_bool_t limit_frame_bytes(runtime_t *rt, size_t size) {
+    if (rt->frame_byte_limit != 0 && (rt->frame_bytes += size) > rt->frame_byte_limit) {
+        char err[128];
+        snprintf(err, sizeof(err), "frame memory limit exceeded: %zu bytes", rt->frame_byte_limit);
+        limit_fail(rt, err);
+        rt->frame_bytes -= size;
+        return false;
+    }
+    return true;
+}
+
+// returns bytes of frame memory freed before the end of the frame
+void limit_release_frame_bytes(runtime_t *rt, size_t size) {
+    rt->frame_bytes -= size < rt->frame_bytes ? size : rt->frame_bytes;
+}
+
+void nar_set_memory_limits(
+        nar_runtime_t rt, nar_size_t arena_bytes, nar_size_t frame_bytes, nar_size_t num_objects) {
+    runtime_t *r = (runtime_t *) rt;
+    r->arena_byte_limit = arena_bytes;
+    r->frame_byte_limit = frame_bytes;
+    r->object_limit = num_objects;
+}
+
+// small blocks are bumped in slab chunks that are kept for the next frame,
+// large ones are allocated separately
 nar_ptr_t nar_frame_alloc(nar_runtime_t rt, nar_size_t size) {
-    nar_ptr_t ptr = nar_alloc(size);
-    vector_push(((runtime_t *) rt)->frame_memory, 1, &ptr);
+    runtime_t *r = (runtime_t *) rt;
+    if (size == 0) {
+        return NULL;
+    }
+    if (!limit_frame_bytes(r, size)) {
+        return NULL;
+    }
+    if (size <= FRAME_SLAB_MAX_BLOCK) {
+        size_t offset = bump_alloc(r->frame_slab, size);
+        if (offset != BUMP_FAILED) {
+            return bump_at(r->frame_slab, offset);
+        }
+    }
+    nar_ptr_t ptr = rt_alloc(r, size);
+    vector_push(r->frame_memory, 1, &ptr);
     return ptr;
 }
 
-void frame_free(runtime_t *rt, bool create_defaults) {
+void frame_free(runtime_t *rt) {
+    arena_t *strings = rt->arenas[NAR_OBJECT_KIND_STRING];
+    for (size_t i = 0; i < arena_size(strings); i++) {
+        string_free_data(rt, arena_at(strings, i));
+    }
+    if (rt->unified != NULL) {
+        for (size_t *it = vector_begin(rt->unified_strings); it != vector_end(rt->unified_strings); it++) {
+            string_free_data(rt, bump_at(rt->unified, *it));
+        }
+        vector_clear(rt->unified_strings);
+        bump_truncate(rt->unified, 0);
+        bump_adapt(rt->unified);
+    }
+
     vector_t *mem = rt->frame_memory;
     for (nar_ptr_t *it = vector_begin(mem); it != vector_end(mem); it++) {
-        nar_free(*it);
+        rt_free(rt, *it);
     }
     vector_clear(mem);
+    bump_truncate(rt->frame_slab, 0);
+    bump_adapt(rt->frame_slab);
 
     for (size_t i = 0; i < NAR_OBJECT_KIND__COUNT; i++) {
-        vector_t *arena = rt->arenas[i];
+        arena_t *arena = rt->arenas[i];
         if (arena != NULL) {
-            vector_clear(arena);
+            arena_clear(arena);
+            arena_adapt(arena);
+        }
+        if (rt->nurseries[i] != NULL) {
+            vector_clear(rt->nurseries[i]);
         }
+        rt->nursery_scan[i] = 0;
     }
 
     vector_clear(rt->locals);
     vector_clear(rt->call_stack);
+    vector_clear(rt->pinned);
+    vector_clear(rt->checkpoints);
+    rc_clear(rt);
     hashmap_clear(rt->string_hashes, false);
-
-    if (create_defaults) {
-        nar_make_string(rt, "");
-        nar_make_option(rt, OPTION_NAME_FALSE, 0, NULL);
-        nar_make_option(rt, OPTION_NAME_TRUE, 0, NULL);
-    }
+    rt->gc_allocated = 0;
+    rt->gc_requested = false;
+    rt->nursery_requested = false;
+    rt->frame_bytes = 0;
+    rt->frame_objects = 0;
 }
 
 void nar_frame_free(nar_runtime_t rt) {
     if (rt != NULL) {
-        frame_free((runtime_t *) rt, true);
+        frame_free((runtime_t *) rt);
+    }
+}
+
+nar_size_t nar_frame_mark(nar_runtime_t rt) {
+    runtime_t *r = (runtime_t *) rt;
+    frame_checkpoint_t checkpoint = {
+            .frame_memory_size = vector_size(r->frame_memory),
+            .frame_slab_size = r->frame_slab->size,
+            .pinned_size = vector_size(r->pinned),
+            .unified_size = r->unified == NULL ? 0 : r->unified->size,
+            .unified_strings_size = r->unified == NULL ? 0 : vector_size(r->unified_strings),
+            .frame_bytes = r->frame_bytes,
+            .frame_objects = r->frame_objects,
+    };
+    for (size_t i = 0; i < NAR_OBJECT_KIND__COUNT; i++) {
+        if (r->arenas[i] != NULL) {
+            checkpoint.arena_sizes[i] = arena_size(r->arenas[i]);
+        }
+        if (r->nurseries[i] != NULL) {
+            checkpoint.nursery_sizes[i] = vector_size(r->nurseries[i]);
+        }
+    }
+    vector_push(r->checkpoints, 1, &checkpoint);
+    return vector_size(r->checkpoints) - 1;
+}
+
+void release_strings(runtime_t *rt, size_t size) {
+    arena_t *strings = rt->arenas[NAR_OBJECT_KIND_STRING];
+    for (size_t i = size; i < arena_size(strings); i++) {
+        string_header_t *header = arena_at(strings, i);
+        if (!(header->flags & STRING_FLAG_TRANSIENT)) {
+            hashmap_delete_with_hash(rt->string_hashes, &(string_hast_t) {
+                    .string = header->data,
+                    .length = header->length
+            }, string_header_hash(header));
+        }
+        string_free_data(rt, header);
+    }
+}
+
+void nar_frame_release_to(nar_runtime_t rt, nar_size_t mark) {
+    runtime_t *r = (runtime_t *) rt;
+    if (mark >= vector_size(r->checkpoints)) {
+        nar_fail(rt, "invalid frame mark");
+        return;
+    }
+    if (vector_size(r->call_stack) > 0) {
+        nar_fail(rt, "frame cannot be released during execution");
+        return;
+    }
+    frame_checkpoint_t checkpoint = *(frame_checkpoint_t *) vector_at(r->checkpoints, mark);
+    vector_pop(r->checkpoints, vector_size(r->checkpoints) - mark, NULL);
+
+    release_strings(r, checkpoint.arena_sizes[NAR_OBJECT_KIND_STRING]);
+    if (r->unified != NULL) {
+        unified_release_strings(r, checkpoint.unified_strings_size);
+        bump_truncate(r->unified, checkpoint.unified_size);
+    }
+    for (size_t i = 0; i < NAR_OBJECT_KIND__COUNT; i++) {
+        arena_t *arena = r->arenas[i];
+        if (arena != NULL) {
+            arena_pop(arena, arena_size(arena) - checkpoint.arena_sizes[i]);
+            if (r->refcounts != NULL) {
+                vector_pop(r->refcounts[i], vector_size(r->refcounts[i]) - checkpoint.arena_sizes[i],
+                        NULL);
+            }
+        }
+        vector_t *nursery = r->nurseries[i];
+        if (nursery != NULL) {
+            vector_pop(nursery, vector_size(nursery) - checkpoint.nursery_sizes[i], NULL);
+        }
+        if (r->nursery_scan[i] > checkpoint.arena_sizes[i]) {
+            r->nursery_scan[i] = checkpoint.arena_sizes[i];
+        }
+    }
+    rc_clear_free_slots(r);
+
+    vector_t *mem = r->frame_memory;
+    for (size_t i = checkpoint.frame_memory_size; i < vector_size(mem); i++) {
+        rt_free(r, *(nar_ptr_t *) vector_at(mem, i));
+    }
+    vector_pop(mem, vector_size(mem) - checkpoint.frame_memory_size, NULL);
+    bump_truncate(r->frame_slab, checkpoint.frame_slab_size);
+    vector_pop(r->pinned, vector_size(r->pinned) - checkpoint.pinned_size, NULL);
+    r->frame_bytes = checkpoint.frame_bytes;
+    r->frame_objects = checkpoint.frame_objects;
+}
+
+void frame_checkpoints_compacted(
+        runtime_t *rt, nar_object_kind_t kind, const size_t *forward, size_t num_live) {
+    size_t size = arena_size(rt->arenas[kind]);
+    for (frame_checkpoint_t *it = vector_begin(rt->checkpoints);
+            it != vector_end(rt->checkpoints); it++) {
+        size_t mark = it->arena_sizes[kind];
+        it->arena_sizes[kind] = num_live;
+        for (size_t i = mark; i < size; i++) {
+            if (forward[i] != GC_UNREACHABLE) {
+                it->arena_sizes[kind] = forward[i];
+                break;
+            }
+        }
     }
 }
\ No newline at end of file
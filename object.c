@@ -1,16 +1,60 @@
 #include <string.h>
 #include <stdio.h>
+#if defined (_WIN32) || defined (_WIN64)
+#include <io.h>
+#define write _write
+#else
+#include <unistd.h>
+#endif
 #include "include/nar.h"
 #include "runtime.h"
 #include "include/nar-runtime.h"
 
-#define object_get_index(obj) (obj & 0x00FFFFFFFFFFFFFF)
 #define UNIT_OBJECT build_object(NAR_OBJECT_KIND_UNIT, 0)
+#define FALSE_OBJECT build_object(NAR_OBJECT_KIND_OPTION, \
+        INDEX_FLAG_IMMEDIATE | INDEX_FLAG_PERMANENT | STRING_INDEX_FALSE)
+#define TRUE_OBJECT build_object(NAR_OBJECT_KIND_OPTION, \
+        INDEX_FLAG_IMMEDIATE | INDEX_FLAG_PERMANENT | STRING_INDEX_TRUE)
 
 nar_object_t insert(nar_runtime_t rt, nar_object_kind_t kind, void *value) {
-    vector_t *arena = ((runtime_t *) rt)->arenas[kind];
-    size_t index = vector_size(arena);
-    vector_push(arena, 1, value);
+    runtime_t *r = (runtime_t *) rt;
+    if (r->unified == NULL && r->refcounts != NULL) {
+        nar_object_t reused = rc_insert(r, kind, value);
+        if (reused != NAR_INVALID_OBJECT) {
+            return reused; // reused slot does not add a live object
+        }
+    }
+    if (r->object_limit != 0 && ++r->frame_objects > r->object_limit) {
+        r->frame_objects--;
+        limit_objects(r, kind);
+        return NAR_INVALID_OBJECT;
+    }
+    if (r->unified != NULL) {
+        return unified_insert(r, kind, value);
+    }
+    vector_t *nursery = r->nurseries[kind];
+    if (nursery != NULL) {
+        size_t index = vector_size(nursery);
+        if (index < r->nursery_capacity) {
+            vector_push(nursery, 1, value);
+            return build_object(kind, INDEX_FLAG_NURSERY | index);
+        }
+        // nursery is full: the object is tenured directly until next minor collection
+        r->nursery_requested = true;
+    }
+    arena_t *arena = r->arenas[kind];
+    size_t index = arena_size(arena);
+    if (r->arena_byte_limit != 0 && index == arena->num_chunks << arena->chunk_shift &&
+            !limit_arena_grow(r, kind, arena->item_size << arena->chunk_shift)) {
+        return NAR_INVALID_OBJECT;
+    }
+    arena_push(arena, value);
+    if (r->refcounts != NULL) {
+        rc_track(r, kind);
+    }
+    if (r->gc_threshold != 0 && ++r->gc_allocated >= r->gc_trigger) {
+        r->gc_requested = true;
+    }
     return build_object(kind, index);
 }
 
@@ -64,25 +108,47 @@ void *find(nar_runtime_t rt, nar_object_kind_t kind, nar_object_t obj) {
         return NULL;
     }
 
-    vector_t *arena = ((runtime_t *) rt)->arenas[kind];
     size_t index = object_get_index(obj);
-    return vector_at(arena, index);
+    if (index & INDEX_FLAG_NURSERY) {
+        return vector_at(((runtime_t *) rt)->nurseries[kind], index & ~INDEX_FLAG_NURSERY);
+    }
+    if (index & INDEX_FLAG_PERSISTENT) {
+        return arena_at(((runtime_t *) rt)->persistent_arenas[kind], index & ~INDEX_FLAG_PERSISTENT);
+    }
+    if (index & INDEX_FLAG_SNAPSHOT) {
+        return snapshot_at((runtime_t *) rt, kind, index & ~INDEX_FLAG_SNAPSHOT);
+    }
+    if (((runtime_t *) rt)->unified != NULL) {
+        return bump_at(((runtime_t *) rt)->unified, index);
+    }
+    return arena_at(((runtime_t *) rt)->arenas[kind], index);
 }
 
 typedef struct {
-    nar_cstring_t key;
+    nar_object_t key;
     nar_object_t value;
 } key_value_t;
 
-int key_value_compare(const void *a, const void *b, __attribute__((unused)) void *data) {
+// keys are interned per domain, keys from different domains are compared by content
+nar_bool_t record_key_equals(runtime_t *rt, nar_object_t a, nar_object_t b) {
+    if (a == b) {
+        return true;
+    }
+    return ((a ^ b) & INDEX_DOMAIN_FLAGS) && string_equals(rt, a, b);
+}
+
+int key_value_compare(const void *a, const void *b, void *data) {
     const key_value_t *ia = a;
     const key_value_t *ib = b;
-    return strcmp(ia->key, ib->key);
+    if (record_key_equals(data, ia->key, ib->key)) {
+        return 0;
+    }
+    return ia->key < ib->key ? -1 : 1;
 }
 
 uint64_t key_value_hash(const void *item, uint64_t seed0, uint64_t seed1) {
     const key_value_t *i = item;
-    return hashmap_sip(i->key, strlen(i->key), seed0, seed1);
+    return hashmap_sip(&i->key, sizeof(nar_object_t), seed0, seed1);
 }
 
 nar_object_kind_t nar_object_get_kind(__attribute__((unused)) nar_runtime_t rt, nar_object_t obj) {
@@ -110,7 +176,8 @@ nar_object_t nar_make_char(nar_runtime_t rt, nar_char_t value) {
 }
 
 nar_char_t nar_to_char(nar_runtime_t rt, nar_object_t obj) {
-    return *(nar_char_t *) find(rt, NAR_OBJECT_KIND_CHAR, obj);
+    const nar_char_t *value = find(rt, NAR_OBJECT_KIND_CHAR, obj);
+    return value == NULL ? 0 : *value;
 }
 
 nar_object_t nar_make_int(nar_runtime_t rt, nar_int_t value) {
@@ -118,7 +185,8 @@ nar_object_t nar_make_int(nar_runtime_t rt, nar_int_t value) {
 }
 
 nar_int_t nar_to_int(nar_runtime_t rt, nar_object_t obj) {
-    return *(nar_int_t *) find(rt, NAR_OBJECT_KIND_INT, obj);
+    const nar_int_t *value = find(rt, NAR_OBJECT_KIND_INT, obj);
+    return value == NULL ? 0 : *value;
 }
 
 nar_object_t nar_make_float(nar_runtime_t rt, nar_float_t value) {
@@ -126,28 +194,330 @@ nar_object_t nar_make_float(nar_runtime_t rt, nar_float_t value) {
 }
 
 nar_float_t nar_to_float(nar_runtime_t rt, nar_object_t obj) {
-    return *(nar_float_t *) find(rt, NAR_OBJECT_KIND_FLOAT, obj);
+    const nar_float_t *value = find(rt, NAR_OBJECT_KIND_FLOAT, obj);
+    return value == NULL ? 0 : *value;
+}
+
+uint64_t string_hash(nar_cstring_t data, nar_size_t length) {
+    return hashmap_sip(data, length, 0, 0);
+}
+
+uint8_t ascii_flag(nar_cstring_t data, nar_size_t length) {
+    uint8_t acc = 0;
+    for (size_t i = 0; i < length; i++) {
+        acc |= (uint8_t) data[i];
+    }
+    return acc < 0x80 ? STRING_FLAG_ASCII : 0;
+}
+
+nar_object_t find_string_with_hash(
+        runtime_t *rt, nar_cstring_t value, nar_size_t length, uint64_t hash) {
+    string_hast_t key = {.string = value, .length = length};
+    const string_hast_t *found = hashmap_get_with_hash(rt->permanent_string_hashes, &key, hash);
+    if (found == NULL) {
+        found = hashmap_get_with_hash(rt->string_hashes, &key, hash);
+    }
+    if (found == NULL && rt->persistent_string_hashes != NULL) {
+        found = hashmap_get_with_hash(rt->persistent_string_hashes, &key, hash);
+    }
+    if (found == NULL && rt->snapshot != NULL) {
+        found = hashmap_get_with_hash(rt->snapshot->string_hashes, &key, hash);
+    }
+    return found == NULL ? NAR_INVALID_OBJECT : found->index;
+}
+
+nar_object_t find_string(runtime_t *rt, nar_cstring_t value) {
+    nar_size_t length = strlen(value);
+    return find_string_with_hash(rt, value, length, string_hash(value, length));
+}
+
+nar_object_t make_permanent_string(runtime_t *rt, nar_cstring_t value) {
+    string_header_t header = {.data = value, .length = strlen(value)};
+    header.hash = string_hash(value, header.length);
+    string_hast_t item = {.string = value, .length = header.length};
+    const string_hast_t *found = hashmap_get_with_hash(
+            rt->permanent_string_hashes, &item, header.hash);
+    if (found != NULL) {
+        return found->index;
+    }
+    header.flags = STRING_FLAG_HASHED | ascii_flag(value, header.length);
+    item.index = build_object(NAR_OBJECT_KIND_STRING,
+            INDEX_FLAG_PERMANENT | vector_size(rt->permanent_strings));
+    vector_push(rt->permanent_strings, 1, &header);
+    hashmap_set_with_hash(rt->permanent_string_hashes, &item, header.hash);
+    return item.index;
+}
+
+void intern_program_strings(runtime_t *rt) {
+    vector_clear(rt->permanent_strings);
+    hashmap_clear(rt->permanent_string_hashes, false);
+    make_permanent_string(rt, "");
+    make_permanent_string(rt, OPTION_NAME_FALSE);
+    make_permanent_string(rt, OPTION_NAME_TRUE);
+
+    bytecode_t *program = rt->program;
+    rt_free(rt, rt->program_strings);
+    rt->program_strings = rt_alloc(rt, program->num_strings * sizeof(nar_object_t));
+    for (size_t i = 0; i < program->num_strings; i++) {
+        rt->program_strings[i] = make_permanent_string(rt, program->strings[i]);
+    }
 }
 
 nar_object_t nar_make_string(nar_runtime_t rt, nar_cstring_t value) {
     runtime_t *r = (runtime_t *) rt;
-    const string_hast_t *hash = hashmap_get(r->string_hashes, &(string_hast_t) {.string = value});
-
-    if (hash == NULL) {
-        size_t index = vector_size(r->arenas[NAR_OBJECT_KIND_STRING]);
-        nar_string_t dup = frame_string_dup(rt, value);
-        vector_push(r->arenas[NAR_OBJECT_KIND_STRING], 1, &dup);
-        hash = &(string_hast_t) {
-                .string = dup,
-                .index = build_object(NAR_OBJECT_KIND_STRING, index)
-        };
-        hashmap_set(r->string_hashes, hash);
+    string_header_t header = {.length = strlen(value)};
+    header.hash = string_hash(value, header.length);
+    nar_object_t found = find_string_with_hash(r, value, header.length, header.hash);
+    if (found != NAR_INVALID_OBJECT) {
+        return found;
+    }
+
+    if (!limit_frame_bytes(r, header.length + 1)) {
+        return NAR_INVALID_OBJECT;
+    }
+    header.data = string_dup_len(r, value, header.length);
+    header.flags = STRING_FLAG_HASHED | ascii_flag(value, header.length);
+    string_hast_t item = {
+            .string = header.data,
+            .length = header.length,
+            .index = insert(rt, NAR_OBJECT_KIND_STRING, &header)
+    };
+    if (item.index == NAR_INVALID_OBJECT) {
+        string_release_data(r, &header);
+        return NAR_INVALID_OBJECT;
+    }
+    hashmap_set_with_hash(r->string_hashes, &item, header.hash);
+    return item.index;
+}
+
+nar_object_t nar_make_transient_string_len(
+        nar_runtime_t rt, nar_cstring_t value, nar_size_t length) {
+    if (!limit_frame_bytes((runtime_t *) rt, length + 1)) {
+        return NAR_INVALID_OBJECT;
+    }
+    string_header_t header = {
+            .data = string_dup_len((runtime_t *) rt, value, length),
+            .length = length,
+            .flags = STRING_FLAG_TRANSIENT | ascii_flag(value, length),
+    };
+    nar_object_t obj = insert(rt, NAR_OBJECT_KIND_STRING, &header);
+    if (obj == NAR_INVALID_OBJECT) {
+        string_release_data((runtime_t *) rt, &header);
+    }
+    return obj;
+}
+
+nar_object_t nar_make_transient_string(nar_runtime_t rt, nar_cstring_t value) {
+    return nar_make_transient_string_len(rt, value, strlen(value));
+}
+
+nar_object_t nar_make_string_concat(nar_runtime_t rt, nar_object_t left, nar_object_t right) {
+    const string_header_t *l = find_string_header(rt, left);
+    const string_header_t *r = find_string_header(rt, right);
+    if (l == NULL || r == NULL) {
+        return NAR_INVALID_OBJECT;
+    }
+    if (l->length == 0) {
+        return right;
+    }
+    if (r->length == 0) {
+        return left;
+    }
+    if (l->length >= SIZE_MAX - r->length) {
+        nar_fail(rt, "string is too long");
+        return NAR_INVALID_OBJECT;
+    }
+    if (!limit_frame_bytes((runtime_t *) rt, sizeof(string_rope_t))) {
+        return NAR_INVALID_OBJECT;
+    }
+    string_rope_t *rope = rt_alloc((runtime_t *) rt, sizeof(string_rope_t));
+    *rope = (string_rope_t) {.left = left, .right = right};
+    string_header_t header = {
+            .rope = rope,
+            .length = l->length + r->length,
+            .flags = STRING_FLAG_ROPE | STRING_FLAG_TRANSIENT | (l->flags & r->flags & STRING_FLAG_ASCII),
+    };
+    nar_object_t obj = insert(rt, NAR_OBJECT_KIND_STRING, &header);
+    if (obj == NAR_INVALID_OBJECT) {
+        string_release_data((runtime_t *) rt, &header);
+    }
+    return obj;
+}
+
+typedef void (*string_chunk_fn_t)(
+        runtime_t *rt, const string_header_t *chunk, void *ctx);
+
+// walks leaves of a rope from left to right without recursion
+void string_iterate(runtime_t *rt, nar_object_t obj, void *ctx, string_chunk_fn_t fn) {
+    vector_t *stack = rt_vector_new(rt, sizeof(nar_object_t), 16);
+    vector_push(stack, 1, &obj);
+    while (vector_size(stack) > 0) {
+        nar_object_t it;
+        vector_pop(stack, 1, &it);
+        const string_header_t *header = find_string_header(rt, it);
+        if (header == NULL) {
+            break;
+        }
+        if (header->flags & STRING_FLAG_ROPE) {
+            vector_push(stack, 1, &header->rope->right);
+            vector_push(stack, 1, &header->rope->left);
+        } else {
+            fn(rt, header, ctx);
+        }
+    }
+    vector_free(stack);
+}
+
+void string_flatten_chunk(__attribute__((unused)) runtime_t *rt,
+        const string_header_t *chunk, void *ctx) {
+    char **cursor = ctx;
+    memcpy(*cursor, chunk->data, chunk->length);
+    *cursor += chunk->length;
+}
+
+nar_bool_t string_flatten(runtime_t *rt, nar_object_t obj, string_header_t *header) {
+    if (!limit_frame_bytes(rt, header->length + 1)) {
+        return false;
+    }
+    nar_string_t data = rt_alloc(rt, header->length + 1);
+    char *cursor = data;
+    string_iterate(rt, obj, &cursor, &string_flatten_chunk);
+    *cursor = 0;
+    string_release_data(rt, header);
+    header->data = data;
+    header->flags &= ~STRING_FLAG_ROPE;
+    return true;
+}
+
+void string_free_data(runtime_t *rt, string_header_t *header) {
+    if (header->flags & STRING_FLAG_ROPE) {
+        rt_free(rt, header->rope);
+    } else {
+        rt_free(rt, (nar_string_t) header->data);
     }
-    return hash->index;
+}
+
+// frees data of frame string before the end of the frame
+void string_release_data(runtime_t *rt, string_header_t *header) {
+    limit_release_frame_bytes(rt,
+            header->flags & STRING_FLAG_ROPE ? sizeof(string_rope_t) : header->length + 1);
+    string_free_data(rt, header);
+}
+
+string_header_t *find_string_header(runtime_t *rt, nar_object_t obj) {
+    if ((obj & INDEX_FLAG_PERMANENT) && nar_object_get_kind(rt, obj) == NAR_OBJECT_KIND_STRING) {
+        return vector_at(rt->permanent_strings, object_get_index(obj) & ~INDEX_FLAG_PERMANENT);
+    }
+    return find(rt, NAR_OBJECT_KIND_STRING, obj);
+}
+
+string_header_t *string_header(runtime_t *rt, nar_object_t obj) {
+    string_header_t *header = find_string_header(rt, obj);
+    if (header != NULL && (header->flags & STRING_FLAG_ROPE) && !string_flatten(rt, obj, header)) {
+        return NULL; // frame memory limit is exceeded
+    }
+    return header;
+}
+
+void string_stream_chunk(runtime_t *rt, const string_header_t *chunk, void *ctx) {
+    (*(nar_stdout_fn_t *) ctx)(rt, chunk->data);
+}
+
+void nar_string_stream(nar_runtime_t rt, nar_object_t obj, nar_stdout_fn_t write_fn) {
+    string_iterate(rt, obj, &write_fn, &string_stream_chunk);
+}
+
+typedef struct {
+    int fd;
+    nar_bool_t ok;
+} fd_writer_t;
+
+void string_write_fd_chunk(__attribute__((unused)) runtime_t *rt,
+        const string_header_t *chunk, void *ctx) {
+    fd_writer_t *writer = ctx;
+    nar_size_t offset = 0;
+    while (writer->ok && offset < chunk->length) {
+        ssize_t written = write(writer->fd, chunk->data + offset, chunk->length - offset);
+        if (written < 0) {
+            writer->ok = false;
+        } else {
+            offset += written;
+        }
+    }
+}
+
+nar_bool_t nar_string_write_fd(nar_runtime_t rt, nar_object_t obj, int fd) {
+    fd_writer_t writer = {.fd = fd, .ok = true};
+    string_iterate(rt, obj, &writer, &string_write_fd_chunk);
+    return writer.ok;
+}
+
+uint64_t string_header_hash(string_header_t *header) {
+    if (!(header->flags & STRING_FLAG_HASHED)) {
+        header->hash = string_hash(header->data, header->length);
+        header->flags |= STRING_FLAG_HASHED;
+    }
+    return header->hash;
+}
+
+nar_object_t string_intern(runtime_t *rt, nar_object_t obj) {
+    if (nar_object_get_kind(rt, obj) != NAR_OBJECT_KIND_STRING || (obj & INDEX_FLAG_PERMANENT)) {
+        return obj;
+    }
+    string_header_t *header = string_header(rt, obj);
+    if (header == NULL) {
+        return NAR_INVALID_OBJECT;
+    }
+    if (!(header->flags & STRING_FLAG_TRANSIENT)) {
+        return obj;
+    }
+    uint64_t hash = string_header_hash(header);
+    nar_object_t found = find_string_with_hash(rt, header->data, header->length, hash);
+    if (found != NAR_INVALID_OBJECT) {
+        return found;
+    }
+    header->flags &= ~STRING_FLAG_TRANSIENT;
+    hashmap_set_with_hash(rt->string_hashes, &(string_hast_t) {
+            .string = header->data,
+            .length = header->length,
+            .index = obj
+    }, hash);
+    return obj;
+}
+
+nar_bool_t string_equals(runtime_t *rt, nar_object_t x, nar_object_t y) {
+    if (x == y) {
+        return true;
+    }
+    const string_header_t *a = string_header(rt, x);
+    const string_header_t *b = string_header(rt, y);
+    if (a == NULL || b == NULL || a->length != b->length) {
+        return false;
+    }
+    if (!((a->flags | b->flags) & STRING_FLAG_TRANSIENT) && !((x ^ y) & INDEX_DOMAIN_FLAGS)) {
+        return false; // both are interned in one domain, so different objects differ in content
+    }
+    if ((a->flags & b->flags & STRING_FLAG_HASHED) && a->hash != b->hash) {
+        return false;
+    }
+    return memcmp(a->data, b->data, a->length) == 0;
 }
 
 nar_cstring_t nar_to_string(nar_runtime_t rt, nar_object_t obj) {
-    return *(nar_string_t *) find(rt, NAR_OBJECT_KIND_STRING, obj);
+    const string_header_t *header = string_header(rt, obj);
+    return header == NULL ? "" : header->data;
+}
+
+nar_cstring_t nar_to_string_len(nar_runtime_t rt, nar_object_t obj, nar_size_t *length) {
+    const string_header_t *header = string_header(rt, obj);
+    if (length != NULL) {
+        *length = header == NULL ? 0 : header->length;
+    }
+    return header == NULL ? "" : header->data;
+}
+
+nar_bool_t nar_string_is_ascii(nar_runtime_t rt, nar_object_t obj) {
+    return (find_string_header(rt, obj)->flags & STRING_FLAG_ASCII) != 0;
 }
 
 nar_object_t nar_make_record(
@@ -170,8 +540,11 @@ nar_object_t nar_make_record_field_obj(
         return NAR_INVALID_OBJECT;
     }
 
-    return insert(rt, NAR_OBJECT_KIND_RECORD,
-            &(nar_record_item_t) {.key=key, .value = value, .parent = record});
+    return insert(rt, NAR_OBJECT_KIND_RECORD, &(nar_record_item_t) {
+            .key = string_intern(rt, key),
+            .value = value,
+            .parent = record
+    });
 }
 
 nar_object_t nar_make_record_raw(nar_runtime_t rt, size_t num_fields, const nar_object_t *stack) {
@@ -188,12 +561,15 @@ nar_record_t nar_to_record(nar_runtime_t rt, nar_object_t obj) {
         return (nar_record_t) {0};
     }
 
-    hashmap_t *map = hashmap_new(sizeof(key_value_t), 0, 0, 0,
-            &key_value_hash, &key_value_compare, NULL, NULL);
+    hashmap_t *map = allocator_hashmap_new(
+            &((runtime_t *) rt)->allocator, sizeof(key_value_t), 0,
+            &key_value_hash, &key_value_compare, rt);
     while (nar_index_is_valid(rt, obj)) {
         nar_record_item_t f = nar_to_record_item(rt, obj);
-        nar_cstring_t key = nar_to_string(rt, f.key);
-        hashmap_set(map, &(key_value_t) {.key = key, .value = f.value});
+        uint64_t hash = string_header(rt, f.key)->hash;
+        if (NULL == hashmap_get_with_hash(map, &(key_value_t) {.key = f.key}, hash)) {
+            hashmap_set_with_hash(map, &(key_value_t) {.key = f.key, .value = f.value}, hash);
+        }
         obj = f.parent;
     }
 
@@ -207,13 +583,16 @@ nar_record_t nar_to_record(nar_runtime_t rt, nar_object_t obj) {
                 .keys = nar_frame_alloc(rt, sz * sizeof(nar_string_t)),
                 .values = nar_frame_alloc(rt, sz * sizeof(nar_object_t))
         };
+        if (record.keys == NULL || record.values == NULL) {
+            record = (nar_record_t) {0}; // frame memory limit is exceeded
+        }
 
         size_t index = 0;
         size_t it = 0;
         void *item;
-        while (hashmap_iter(map, &it, &item)) {
+        while (record.size > 0 && hashmap_iter(map, &it, &item)) {
             const key_value_t *kv = item;
-            record.keys[index] = kv->key;
+            record.keys[index] = nar_to_string(rt, kv->key);
             record.values[index] = kv->value;
             index++;
         }
@@ -227,13 +606,14 @@ void nar_map_record(nar_runtime_t rt, nar_object_t obj, void* result, nar_map_re
         return;
     }
 
-    hashmap_t *set_keys = hashmap_new(sizeof(key_value_t), 0, 0, 0,
-            &key_value_hash, &key_value_compare, NULL, NULL);
+    hashmap_t *set_keys = allocator_hashmap_new(
+            &((runtime_t *) rt)->allocator, sizeof(key_value_t), 0,
+            &key_value_hash, &key_value_compare, rt);
     while (nar_index_is_valid(rt, obj)) {
         nar_record_item_t f = nar_to_record_item(rt, obj);
-        nar_cstring_t key = nar_to_string(rt, f.key);
-        if (NULL == hashmap_set(set_keys, &(key_value_t) {.key = key})) {
-            map(rt, key, f.value, result);
+        const string_header_t *key = string_header(rt, f.key);
+        if (NULL == hashmap_set_with_hash(set_keys, &(key_value_t) {.key = f.key}, key->hash)) {
+            map(rt, key->data, f.value, result);
         }
         obj = f.parent;
     }
@@ -241,15 +621,16 @@ void nar_map_record(nar_runtime_t rt, nar_object_t obj, void* result, nar_map_re
     hashmap_free(set_keys);
 }
 
-nar_object_t nar_to_record_field(nar_runtime_t rt, nar_object_t obj, nar_cstring_t key) {
+nar_object_t nar_to_record_field_obj(nar_runtime_t rt, nar_object_t obj, nar_object_t key) {
     if (!check_type(rt, obj, NAR_OBJECT_KIND_RECORD)) {
         return NAR_INVALID_OBJECT;
     }
 
+    // record keys are interned, so equal keys are the same object
+    key = string_intern(rt, key);
     while (nar_index_is_valid(rt, obj)) {
         nar_record_item_t f = nar_to_record_item(rt, obj);
-        nar_cstring_t it_key = nar_to_string(rt, f.key);
-        if (strcmp(it_key, key) == 0) {
+        if (record_key_equals(rt, f.key, key)) {
             return f.value;
         }
         obj = f.parent;
@@ -257,8 +638,18 @@ nar_object_t nar_to_record_field(nar_runtime_t rt, nar_object_t obj, nar_cstring
     return NAR_INVALID_OBJECT;
 }
 
+nar_object_t nar_to_record_field(nar_runtime_t rt, nar_object_t obj, nar_cstring_t key) {
+    nar_object_t key_obj = find_string(rt, key);
+    if (!nar_object_is_valid(rt, key_obj)) {
+        check_type(rt, obj, NAR_OBJECT_KIND_RECORD);
+        return NAR_INVALID_OBJECT;
+    }
+    return nar_to_record_field_obj(rt, obj, key_obj);
+}
+
 nar_record_item_t nar_to_record_item(nar_runtime_t rt, nar_object_t obj) {
-    return *(nar_record_item_t *) find(rt, NAR_OBJECT_KIND_RECORD, obj);
+    const nar_record_item_t *item = find(rt, NAR_OBJECT_KIND_RECORD, obj);
+    return item == NULL ? (nar_record_item_t) {0} : *item;
 }
 
 nar_object_t nar_make_list_cons(nar_runtime_t rt, nar_object_t head, nar_object_t tail) {
@@ -275,11 +666,11 @@ nar_object_t nar_make_list(nar_runtime_t rt, nar_size_t size, const nar_object_t
 }
 
 nar_list_t nar_to_list(nar_runtime_t rt, nar_object_t obj) {
-    if (!check_type(rt, obj, NAR_OBJECT_KIND_LIST)) {
+    if (!check_type(rt, obj, NAR_OBJECT_KIND_LIST) || !nar_index_is_valid(rt, obj)) {
         return (nar_list_t) {0};
     }
 
-    vector_t *vec = rvector_new(sizeof(nar_object_t), 0);
+    vector_t *vec = rt_vector_new((runtime_t *) rt, sizeof(nar_object_t), 0);
 
     while (nar_index_is_valid(rt, obj)) {
         nar_list_item_t item = nar_to_list_item(rt, obj);
@@ -295,13 +686,40 @@ nar_list_t nar_to_list(nar_runtime_t rt, nar_object_t obj) {
         size_t mem_size = sz * sizeof(nar_object_t);
         list = (nar_list_t) {.size = sz, .items = nar_frame_alloc(rt, mem_size)};
         vector_pop(vec, sz, list.items);
+        if (list.items == NULL) {
+            list.size = 0; // frame memory limit is exceeded
+        }
     }
     vector_free(vec);
     return list;
 }
 
 nar_list_item_t nar_to_list_item(nar_runtime_t rt, nar_object_t obj) {
-    return *(nar_list_item_t *) find(rt, NAR_OBJECT_KIND_LIST, obj);
+    const nar_list_item_t *item = find(rt, NAR_OBJECT_KIND_LIST, obj);
+    return item == NULL ? (nar_list_item_t) {0} : *item;
+}
+
+nar_size_t list_size(runtime_t *rt, nar_object_t list) {
+    nar_size_t size = 0;
+    if (!check_type(rt, list, NAR_OBJECT_KIND_LIST)) {
+        return size;
+    }
+    while (nar_index_is_valid(rt, list)) {
+        list = nar_to_list_item(rt, list).next;
+        size++;
+    }
+    return size;
+}
+
+void list_push_items(runtime_t *rt, nar_object_t list, vector_t *items) {
+    if (!check_type(rt, list, NAR_OBJECT_KIND_LIST)) {
+        return;
+    }
+    while (nar_index_is_valid(rt, list)) {
+        nar_list_item_t item = nar_to_list_item(rt, list);
+        vector_push(items, 1, &item.value);
+        list = item.next;
+    }
 }
 
 nar_object_t nar_make_tuple_item(nar_runtime_t rt, nar_object_t value, nar_object_t next) {
@@ -318,11 +736,11 @@ nar_object_t nar_make_tuple(nar_runtime_t rt, nar_size_t size, const nar_object_
 }
 
 nar_tuple_t nar_to_tuple(nar_runtime_t rt, nar_object_t obj) {
-    if (!check_type(rt, obj, NAR_OBJECT_KIND_TUPLE)) {
+    if (!check_type(rt, obj, NAR_OBJECT_KIND_TUPLE) || !nar_index_is_valid(rt, obj)) {
         return (nar_tuple_t) {0};
     }
 
-    vector_t *vec = rvector_new(sizeof(nar_object_t), 0);
+    vector_t *vec = rt_vector_new((runtime_t *) rt, sizeof(nar_object_t), 0);
 
     while (nar_index_is_valid(rt, obj)) {
         nar_tuple_item_t item = nar_to_tuple_item(rt, obj);
@@ -338,31 +756,50 @@ nar_tuple_t nar_to_tuple(nar_runtime_t rt, nar_object_t obj) {
         size_t mem_size = sz * sizeof(nar_object_t);
         tuple = (nar_tuple_t) {.size = sz, .values = nar_frame_alloc(rt, mem_size)};
         vector_pop(vec, sz, tuple.values);
+        if (tuple.values == NULL) {
+            tuple.size = 0; // frame memory limit is exceeded
+        }
     }
     vector_free(vec);
     return tuple;
 }
 
 nar_tuple_item_t nar_to_tuple_item(nar_runtime_t rt, nar_object_t obj) {
-    return *(nar_tuple_item_t *) find(rt, NAR_OBJECT_KIND_TUPLE, obj);
+    const nar_tuple_item_t *item = find(rt, NAR_OBJECT_KIND_TUPLE, obj);
+    return item == NULL ? (nar_tuple_item_t) {0} : *item;
 }
 
 nar_object_t nar_make_option_with_list(
-        nar_runtime_t rt, nar_cstring_t name, nar_object_t item_list) {
+        nar_runtime_t rt, nar_object_t name, nar_object_t item_list) {
+    if (!check_type(rt, name, NAR_OBJECT_KIND_STRING)) {
+        return NAR_INVALID_OBJECT;
+    }
+    name = string_intern(rt, name);
+    if (name == NAR_INVALID_OBJECT || item_list == NAR_INVALID_OBJECT) {
+        return NAR_INVALID_OBJECT; // memory limit is exceeded
+    }
+    if (!nar_index_is_valid(rt, item_list)) {
+        return build_object(NAR_OBJECT_KIND_OPTION, INDEX_FLAG_IMMEDIATE | object_get_index(name));
+    }
     return insert(rt, NAR_OBJECT_KIND_OPTION,
-            &(nar_option_item_t) {
-                    .name = nar_make_string(rt, name),
-                    .values = item_list
-            });
+            &(nar_option_item_t) {.name = name, .values = item_list});
+}
+
+nar_object_t nar_make_option_obj(
+        nar_runtime_t rt, nar_object_t name, nar_size_t size, const nar_object_t *items) {
+    return nar_make_option_with_list(rt, name, nar_make_list(rt, size, items));
 }
 
 nar_object_t nar_make_option(
         nar_runtime_t rt, nar_cstring_t name, nar_size_t size, const nar_object_t *items) {
-    return nar_make_option_with_list(rt, name, nar_make_list(rt, size, items));
+    return nar_make_option_obj(rt, nar_make_string(rt, name), size, items);
 }
 
 nar_option_t nar_to_option(nar_runtime_t rt, nar_object_t obj) {
     nar_option_item_t opt = nar_to_option_item(rt, obj);
+    if (!nar_index_is_valid(rt, opt.values)) {
+        return (nar_option_t) {.name = nar_to_string(rt, opt.name)};
+    }
     nar_list_t list = nar_to_list(rt, opt.values);
     return (nar_option_t) {
             .name = nar_to_string(rt, opt.name),
@@ -372,26 +809,33 @@ nar_option_t nar_to_option(nar_runtime_t rt, nar_object_t obj) {
 }
 
 nar_option_item_t nar_to_option_item(nar_runtime_t rt, nar_object_t obj) {
-    return *(nar_option_item_t *) find(rt, NAR_OBJECT_KIND_OPTION, obj);
+    if (object_is_immediate(obj) && nar_object_get_kind(rt, obj) == NAR_OBJECT_KIND_OPTION) {
+        return (nar_option_item_t) {
+                .name = build_object(NAR_OBJECT_KIND_STRING,
+                        object_get_index(obj) & ~INDEX_FLAG_IMMEDIATE),
+                .values = build_object(NAR_OBJECT_KIND_LIST, NAR_INVALID_INDEX),
+        };
+    }
+    const nar_option_item_t *item = find(rt, NAR_OBJECT_KIND_OPTION, obj);
+    return item == NULL ? (nar_option_item_t) {0} : *item;
 }
 
 nar_object_t nar_make_bool(__attribute__((unused)) nar_runtime_t rt, nar_bool_t value) {
     if (value) {
-        return build_object(NAR_OBJECT_KIND_OPTION, 1);
+        return TRUE_OBJECT;
     }
-    return build_object(NAR_OBJECT_KIND_OPTION, 0);
+    return FALSE_OBJECT;
 }
 
 nar_bool_t nar_to_bool(nar_runtime_t rt, nar_object_t obj) {
-    if (!check_type(rt, obj, NAR_OBJECT_KIND_OPTION)) {
-        return 0;
+    if (obj == TRUE_OBJECT) {
+        return nar_true;
     }
-
-    if (object_get_index(obj) == 0) {
+    if (obj == FALSE_OBJECT) {
         return nar_false;
     }
-    if (object_get_index(obj) == 1) {
-        return nar_true;
+    if (!check_type(rt, obj, NAR_OBJECT_KIND_OPTION)) {
+        return 0;
     }
     nar_option_t opt = nar_to_option(rt, obj);
     if (strcmp(opt.name, OPTION_NAME_TRUE) == 0) {
@@ -413,7 +857,8 @@ nar_object_t nar_make_func(nar_runtime_t rt, nar_ptr_t fn, nar_size_t arity) {
 }
 
 nar_func_t nar_to_func(nar_runtime_t rt, nar_object_t obj) {
-    return *(nar_func_t *) find(rt, NAR_OBJECT_KIND_FUNCTION, obj);
+    const nar_func_t *item = find(rt, NAR_OBJECT_KIND_FUNCTION, obj);
+    return item == NULL ? (nar_func_t) {0} : *item;
 }
 
 nar_object_t nar_make_native(nar_runtime_t rt, nar_ptr_t ptr, nar_cmp_native_fn_t cmp) {
@@ -421,7 +866,8 @@ nar_object_t nar_make_native(nar_runtime_t rt, nar_ptr_t ptr, nar_cmp_native_fn_
 }
 
 nar_native_t nar_to_native(nar_runtime_t rt, nar_object_t obj) {
-    return *(nar_native_t *) find(rt, NAR_OBJECT_KIND_NATIVE, obj);
+    const nar_native_t *item = find(rt, NAR_OBJECT_KIND_NATIVE, obj);
+    return item == NULL ? (nar_native_t) {0} : *item;
 }
 
 nar_object_t nar_make_closure_with_list(
@@ -436,28 +882,30 @@ nar_object_t nar_make_closure(
 }
 
 nar_closure_t nar_to_closure(nar_runtime_t rt, nar_object_t obj) {
-    return *(nar_closure_t *) find(rt, NAR_OBJECT_KIND_CLOSURE, obj);
+    const nar_closure_t *item = find(rt, NAR_OBJECT_KIND_CLOSURE, obj);
+    return item == NULL ? (nar_closure_t) {0} : *item;
 }
 
 nar_object_t nar_make_pattern_with_list(
         nar_runtime_t rt, pattern_kind_t kind,
-        nar_cstring_t name, nar_object_t value_list) {
+        nar_object_t name, nar_object_t value_list) {
     return insert(rt, NAR_OBJECT_KIND_PATTERN,
             &(nar_pattern_t) {
                     .kind = kind,
-                    .name = name,
+                    .name = string_intern(rt, name),
                     .values = value_list,
             });
 }
 
 nar_object_t nar_make_pattern(
         nar_runtime_t rt, pattern_kind_t kind,
-        nar_cstring_t name, size_t num_items, nar_object_t *items) {
+        nar_object_t name, size_t num_items, nar_object_t *items) {
     return nar_make_pattern_with_list(rt, kind, name, nar_make_list(rt, num_items, items));
 }
 
 nar_pattern_t nar_to_pattern(nar_runtime_t rt, nar_object_t pattern) {
-    return *(nar_pattern_t *) find(rt, NAR_OBJECT_KIND_PATTERN, pattern);
+    const nar_pattern_t *item = find(rt, NAR_OBJECT_KIND_PATTERN, pattern);
+    return item == NULL ? (nar_pattern_t) {0} : *item;
 }
 
 void serialize_object(runtime_t *rt, nar_object_t obj, vector_t *mem) {
@@ -486,10 +934,10 @@ void serialize_object(runtime_t *rt, nar_object_t obj, vector_t *mem) {
             break;
         }
         case NAR_OBJECT_KIND_STRING: {
-            nar_cstring_t str = nar_to_string(rt, obj);
-            nar_size_t len = strlen(str) + 1;
+            const string_header_t *str = string_header(rt, obj);
+            nar_size_t len = str->length + 1;
             vector_push(mem, sizeof(nar_size_t), &len);
-            vector_push(mem, len, str);
+            vector_push(mem, len, str->data);
             break;
         }
         case NAR_OBJECT_KIND_RECORD: {
@@ -551,7 +999,7 @@ void serialize_object(runtime_t *rt, nar_object_t obj, vector_t *mem) {
         case NAR_OBJECT_KIND_PATTERN: {
             nar_pattern_t item = nar_to_pattern(rt, obj);
             vector_push(mem, sizeof(pattern_kind_t), &item.kind);
-            serialize_object(rt, nar_make_string(rt, item.name), mem);
+            serialize_object(rt, item.name, mem);
             serialize_object(rt, item.values, mem);
             break;
         }
@@ -622,7 +1070,8 @@ nar_object_t deserialize_object(runtime_t *rt, nar_byte_t **mem) {
             if (!has_next) {
                 return build_object(NAR_OBJECT_KIND_LIST, NAR_INVALID_INDEX);
             }
-            return nar_make_list_cons(rt, deserialize_object(rt, mem), deserialize_object(rt, mem));
+            nar_object_t value = deserialize_object(rt, mem);
+            return nar_make_list_cons(rt, value, deserialize_object(rt, mem));
         }
         case NAR_OBJECT_KIND_TUPLE: {
             nar_bool_t has_next = *(nar_bool_t *) (*mem);
@@ -630,13 +1079,13 @@ nar_object_t deserialize_object(runtime_t *rt, nar_byte_t **mem) {
             if (!has_next) {
                 return build_object(NAR_OBJECT_KIND_TUPLE, NAR_INVALID_INDEX);
             }
-            return nar_make_tuple_item(
-                    rt, deserialize_object(rt, mem), deserialize_object(rt, mem));
+            nar_object_t value = deserialize_object(rt, mem);
+            return nar_make_tuple_item(rt, value, deserialize_object(rt, mem));
         }
         case NAR_OBJECT_KIND_OPTION: {
             nar_object_t name = deserialize_object(rt, mem);
             nar_object_t values = deserialize_object(rt, mem);
-            return nar_make_option_with_list(rt, nar_to_string(rt, name), values);
+            return nar_make_option_with_list(rt, name, values);
         }
         case NAR_OBJECT_KIND_FUNCTION: {
             nar_cptr_t ptr = *(nar_cptr_t *) (*mem);
@@ -663,7 +1112,7 @@ nar_object_t deserialize_object(runtime_t *rt, nar_byte_t **mem) {
             (*mem) += sizeof(pattern_kind_t);
             nar_object_t name = deserialize_object(rt, mem);
             nar_object_t values = deserialize_object(rt, mem);
-            return nar_make_pattern_with_list(rt, pattern_kind, nar_to_string(rt, name), values);
+            return nar_make_pattern_with_list(rt, pattern_kind, name, values);
         }
         default:
             nar_fail(rt, "unknown object kind");
@@ -0,0 +1,95 @@
+#include <string.h>
+#include "include/nar-runtime.h"
+#include "runtime.h"
+
+// Persistent heap keeps deep copies of object graphs across frame resets.
+// Objects are copied children first, so persistent objects never point into frame arenas.
+// Program strings are shared, other strings are copied and interned in a separate table,
+// so lookups that mix frame and persistent strings compare them by content.
+
+nar_object_t persist_string(runtime_t *rt, nar_object_t obj) {
+    string_header_t *header = string_header(rt, obj);
+    if (header == NULL) {
+        return NAR_INVALID_OBJECT;
+    }
+    uint64_t hash = string_header_hash(header);
+    string_hast_t key = {.string = header->data, .length = header->length};
+    const string_hast_t *found = hashmap_get_with_hash(rt->permanent_string_hashes, &key, hash);
+    if (found == NULL) {
+        found = hashmap_get_with_hash(rt->persistent_string_hashes, &key, hash);
+    }
+    if (found != NULL) {
+        return found->index;
+    }
+
+    arena_t *strings = rt->persistent_arenas[NAR_OBJECT_KIND_STRING];
+    string_header_t copy = {
+            .data = string_dup_len(rt, header->data, header->length),
+            .length = header->length,
+            .hash = hash,
+            .flags = STRING_FLAG_HASHED | (header->flags & STRING_FLAG_ASCII),
+    };
+    string_hast_t item = {
+            .string = copy.data,
+            .length = copy.length,
+            .index = build_object(NAR_OBJECT_KIND_STRING,
+                    INDEX_FLAG_PERSISTENT | arena_size(strings)),
+    };
+    arena_push(strings, &copy);
+    hashmap_set_with_hash(rt->persistent_string_hashes, &item, hash);
+    return item.index;
+}
+
+copy_resolve_t persist_resolve(void *ctx, nar_object_t obj, nar_object_t *copy) {
+    runtime_t *rt = ctx;
+    nar_object_kind_t kind = nar_object_get_kind(rt, obj);
+    if ((obj & (INDEX_FLAG_PERMANENT | INDEX_FLAG_PERSISTENT)) ||
+            rt->persistent_arenas[kind] == NULL) {
+        *copy = obj;
+        return COPY_RESOLVED;
+    }
+    if (kind == NAR_OBJECT_KIND_STRING) {
+        *copy = persist_string(rt, obj);
+        return COPY_RESOLVED;
+    }
+    return COPY_ITEM;
+}
+
+nar_object_t persist_insert(void *ctx, nar_object_kind_t kind, void *item) {
+    arena_t *arena = ((runtime_t *) ctx)->persistent_arenas[kind];
+    nar_object_t copy = build_object(kind, INDEX_FLAG_PERSISTENT | arena_size(arena));
+    arena_push(arena, item);
+    return copy;
+}
+
+nar_object_t nar_persist(nar_runtime_t rt, nar_object_t obj) {
+    return copy_walk(&(copy_walk_t) {
+            .src = (runtime_t *) rt,
+            .ctx = rt,
+            .resolve = &persist_resolve,
+            .insert = &persist_insert,
+    }, obj);
+}
+
+void nar_persistent_clear(nar_runtime_t rt) {
+    runtime_t *r = (runtime_t *) rt;
+    arena_t *strings = r->persistent_arenas[NAR_OBJECT_KIND_STRING];
+    for (size_t i = 0; i < arena_size(strings); i++) {
+        string_free_data(r, arena_at(strings, i));
+    }
+    for (size_t i = 0; i < NAR_OBJECT_KIND__COUNT; i++) {
+        if (r->persistent_arenas[i] != NULL) {
+            arena_clear(r->persistent_arenas[i]);
+        }
+    }
+    hashmap_clear(r->persistent_string_hashes, false);
+}
+
+void persistent_free(runtime_t *rt) {
+    nar_persistent_clear(rt);
+    for (size_t i = 0; i < NAR_OBJECT_KIND__COUNT; i++) {
+        arena_free(rt->persistent_arenas[i]);
+    }
+    rt_free(rt, rt->persistent_arenas);
+    hashmap_free(rt->persistent_string_hashes);
+}
@@ -0,0 +1,249 @@
+#include <string.h>
+#include "include/nar-runtime.h"
+#include "runtime.h"
+
+// Reference counting mode turns consumption of uniquely referenced values into mutations.
+// Only references from heap objects are counted. References from value stacks and locals
+// are found by scanning the running function: an object allocated after the function entry
+// (frame mark) cannot be referenced by outer functions, so the scan stays local.
+// Counters are conservative (dead objects are not released), so they can only prevent reuse.
+
+typedef size_t frame_mark_t[NAR_OBJECT_KIND__COUNT];
+
+nar_bool_t rc_is_reusable_kind(nar_object_kind_t kind) {
+    switch (kind) {
+        case NAR_OBJECT_KIND_CHAR:
+        case NAR_OBJECT_KIND_INT:
+        case NAR_OBJECT_KIND_FLOAT:
+        case NAR_OBJECT_KIND_RECORD:
+        case NAR_OBJECT_KIND_LIST:
+        case NAR_OBJECT_KIND_TUPLE:
+        case NAR_OBJECT_KIND_OPTION:
+        case NAR_OBJECT_KIND_CLOSURE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// returns counter of main arena object or NULL for any other object
+uint32_t *rc_count(runtime_t *rt, nar_object_t obj) {
+    if (obj == NAR_INVALID_OBJECT || (obj & (NAR_INVALID_INDEX | INDEX_FLAG_IMMEDIATE |
+            INDEX_FLAG_PERMANENT | INDEX_FLAG_NURSERY | INDEX_DOMAIN_FLAGS))) {
+        return NULL;
+    }
+    vector_t *counts = rt->refcounts[nar_object_get_kind(rt, obj)];
+    size_t index = object_get_index(obj);
+    if (counts == NULL || index >= vector_size(counts)) {
+        return NULL;
+    }
+    return vector_at(counts, index);
+}
+
+void rc_retain(void *ctx, nar_object_t *slot) {
+    uint32_t *count = rc_count(ctx, *slot);
+    if (count != NULL) {
+        (*count)++;
+    }
+}
+
+void rc_release(void *ctx, nar_object_t *slot) {
+    uint32_t *count = rc_count(ctx, *slot);
+    if (count != NULL && *count > 0) {
+        (*count)--;
+    }
+}
+
+nar_object_t rc_insert(runtime_t *rt, nar_object_kind_t kind, void *value) {
+    object_visit_children(kind, value, rt, &rc_retain);
+    vector_t *free_slots = rt->free_slots[kind];
+    if (free_slots == NULL || vector_size(free_slots) == 0) {
+        return NAR_INVALID_OBJECT;
+    }
+    size_t index;
+    vector_pop(free_slots, 1, &index);
+    arena_t *arena = rt->arenas[kind];
+    memcpy(arena_at(arena, index), value, arena->item_size);
+    return build_object(kind, index);
+}
+
+void rc_track(runtime_t *rt, nar_object_kind_t kind) {
+    vector_t *counts = rt->refcounts[kind];
+    if (counts != NULL) {
+        uint32_t zero = 0;
+        vector_push(counts, 1, &zero);
+    }
+}
+
+void rc_enter(runtime_t *rt) {
+    frame_mark_t mark = {0};
+    for (size_t kind = 0; kind < NAR_OBJECT_KIND__COUNT; kind++) {
+        if (rt->arenas[kind] != NULL) {
+            mark[kind] = arena_size(rt->arenas[kind]);
+        }
+    }
+    vector_push(rt->frame_marks, 1, &mark);
+}
+
+void rc_leave(runtime_t *rt) {
+    vector_pop(rt->frame_marks, 1, NULL);
+}
+
+// after objects are moved nothing allocated before is considered owned by running functions
+void rc_reset_marks(runtime_t *rt) {
+    if (rt->refcounts == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < vector_size(rt->frame_marks); i++) {
+        size_t *mark = vector_at(rt->frame_marks, i);
+        for (size_t kind = 0; kind < NAR_OBJECT_KIND__COUNT; kind++) {
+            if (rt->arenas[kind] != NULL) {
+                mark[kind] = arena_size(rt->arenas[kind]);
+            }
+        }
+    }
+    rc_clear_free_slots(rt);
+}
+
+void rc_clear_free_slots(runtime_t *rt) {
+    if (rt->free_slots == NULL) {
+        return;
+    }
+    for (size_t kind = 0; kind < NAR_OBJECT_KIND__COUNT; kind++) {
+        if (rt->free_slots[kind] != NULL) {
+            vector_clear(rt->free_slots[kind]);
+        }
+    }
+}
+
+nar_bool_t rc_is_unique(runtime_t *rt, nar_object_t obj, uint32_t num_refs, size_t num_locals) {
+    const uint32_t *count = rc_count(rt, obj);
+    size_t num_marks = vector_size(rt->frame_marks);
+    if (count == NULL || *count != num_refs || num_marks == 0) {
+        return false;
+    }
+    const size_t *mark = vector_at(rt->frame_marks, num_marks - 1);
+    if (object_get_index(obj) < mark[nar_object_get_kind(rt, obj)]) {
+        return false;
+    }
+
+    // value stack and pattern stack of the running function are the last registered roots
+    size_t num_roots = vector_size(rt->roots);
+    for (size_t i = num_roots < 2 ? 0 : num_roots - 2; i < num_roots; i++) {
+        vector_t *stack = *(vector_t **) vector_at(rt->roots, i);
+        for (nar_object_t *it = vector_begin(stack); it != vector_end(stack); it++) {
+            if (*it == obj) {
+                return false;
+            }
+        }
+    }
+    local_t *locals = vector_end(rt->locals);
+    for (local_t *it = locals - num_locals; it != locals; it++) {
+        if (it->value == obj) {
+            return false;
+        }
+    }
+    for (nar_object_t *it = vector_begin(rt->pinned); it != vector_end(rt->pinned); it++) {
+        if (*it == obj) {
+            return false;
+        }
+    }
+    return true;
+}
+
+nar_object_t rc_update_record(
+        runtime_t *rt, nar_object_t record, nar_object_t key, nar_object_t value,
+        size_t num_locals) {
+    if (nar_object_get_kind(rt, record) != NAR_OBJECT_KIND_RECORD) {
+        return NAR_INVALID_OBJECT;
+    }
+    key = string_intern(rt, key);
+    // every node down to the updated one has to be referenced only by its child
+    uint32_t num_refs = 0;
+    for (nar_object_t it = record; rc_is_unique(rt, it, num_refs, num_locals); num_refs = 1) {
+        nar_record_item_t *field = arena_at(rt->arenas[NAR_OBJECT_KIND_RECORD],
+                object_get_index(it));
+        if (field->key == key) {
+            rc_release(rt, &field->value);
+            rc_retain(rt, &value);
+            field->value = value;
+            return record;
+        }
+        it = field->parent;
+    }
+    return NAR_INVALID_OBJECT;
+}
+
+void rc_free(runtime_t *rt, nar_object_t obj, size_t num_locals) {
+    nar_object_kind_t kind = nar_object_get_kind(rt, obj);
+    if (!rc_is_reusable_kind(kind) || !rc_is_unique(rt, obj, 0, num_locals)) {
+        return;
+    }
+    size_t index = object_get_index(obj);
+    object_visit_children(kind, arena_at(rt->arenas[kind], index), rt, &rc_release);
+    vector_push(rt->free_slots[kind], 1, &index);
+}
+
+void rc_clear(runtime_t *rt) {
+    if (rt->refcounts == NULL) {
+        return;
+    }
+    for (size_t kind = 0; kind < NAR_OBJECT_KIND__COUNT; kind++) {
+        if (rt->refcounts[kind] != NULL) {
+            vector_clear(rt->refcounts[kind]);
+            vector_clear(rt->free_slots[kind]);
+        }
+    }
+}
+
+void rc_free_state(runtime_t *rt) {
+    if (rt->refcounts == NULL) {
+        return;
+    }
+    for (size_t kind = 0; kind < NAR_OBJECT_KIND__COUNT; kind++) {
+        vector_free(rt->refcounts[kind]);
+        vector_free(rt->free_slots[kind]);
+    }
+    rt_free(rt, rt->refcounts);
+    rt_free(rt, rt->free_slots);
+    vector_free(rt->frame_marks);
+    rt->refcounts = NULL;
+    rt->free_slots = NULL;
+    rt->frame_marks = NULL;
+}
+
+void nar_set_refcounting(nar_runtime_t rt, nar_bool_t enabled) {
+    runtime_t *r = (runtime_t *) rt;
+    if (vector_size(r->call_stack) > 0) {
+        nar_fail(rt, "refcounting mode cannot be changed during execution");
+        return;
+    }
+    if (!enabled) {
+        rc_free_state(r);
+        return;
+    }
+    if (r->refcounts != NULL) {
+        return;
+    }
+    if (r->unified != NULL) {
+        nar_fail(rt, "refcounting cannot be used with unified heap");
+        return;
+    }
+
+    r->refcounts = rt_alloc(r, NAR_OBJECT_KIND__COUNT * sizeof(void *));
+    r->free_slots = rt_alloc(r, NAR_OBJECT_KIND__COUNT * sizeof(void *));
+    memset(r->refcounts, 0, NAR_OBJECT_KIND__COUNT * sizeof(void *));
+    memset(r->free_slots, 0, NAR_OBJECT_KIND__COUNT * sizeof(void *));
+    r->frame_marks = rt_vector_new(r, sizeof(frame_mark_t), 64);
+    for (size_t kind = 0; kind < NAR_OBJECT_KIND__COUNT; kind++) {
+        arena_t *arena = r->arenas[kind];
+        if (arena != NULL) {
+            // existing objects are older than any future frame mark, so their counts are unused
+            r->refcounts[kind] = rt_vector_new(r, sizeof(uint32_t), arena_size(arena));
+            for (size_t i = 0; i < arena_size(arena); i++) {
+                rc_track(r, kind);
+            }
+            r->free_slots[kind] = rt_vector_new(r, sizeof(size_t), 0);
+        }
+    }
+}
@@ -29,20 +29,27 @@ uint64_t native_def_item_hash(const void *item, uint64_t seed0, uint64_t seed1)
     return hashmap_sip(i->name, strlen(i->name), seed0, seed1);
 }
 
-void native_def_item_free(void *item) {
-    native_def_item_t *i = item;
-    nar_free((nar_string_t) i->name);
+void native_defs_free(runtime_t *rt) {
+    size_t it = 0;
+    void *item;
+    while (hashmap_iter(rt->native_defs, &it, &item)) {
+        rt_free(rt, (nar_string_t) ((native_def_item_t *) item)->name);
+    }
+    hashmap_free(rt->native_defs);
 }
 
 int string_hast_compare(const void *a, const void *b, __attribute__((unused)) void *data) {
     const string_hast_t *ia = a;
     const string_hast_t *ib = b;
-    return strcmp(ia->string, ib->string);
+    if (ia->length != ib->length) {
+        return ia->length < ib->length ? -1 : 1;
+    }
+    return memcmp(ia->string, ib->string, ia->length);
 }
 
 uint64_t string_hast_hash(const void *item, uint64_t seed0, uint64_t seed1) {
     const string_hast_t *i = item;
-    return hashmap_sip(i->string, strlen(i->string), seed0, seed1);
+    return hashmap_sip(i->string, i->length, seed0, seed1);
 }
 
 int metadata_item_compare(const void *a, const void *b, __attribute__((unused)) void *data) {
@@ -56,9 +63,13 @@ uint64_t metadata_item_hash(const void *item, uint64_t seed0, uint64_t seed1) {
     return hashmap_sip(i->name, strlen(i->name), seed0, seed1);
 }
 
-void metadata_item_free(void *item) {
-    metadata_item_t *i = item;
-    nar_free((nar_string_t) i->name);
+void metadata_free(runtime_t *rt) {
+    size_t it = 0;
+    void *item;
+    while (hashmap_iter(rt->metadata, &it, &item)) {
+        rt_free(rt, (nar_string_t) ((metadata_item_t *) item)->name);
+    }
+    hashmap_free(rt->metadata);
 }
 
 void default_stdout(__attribute__((unused)) nar_runtime_t rt, nar_cstring_t msg) {
@@ -66,15 +77,36 @@ void default_stdout(__attribute__((unused)) nar_runtime_t rt, nar_cstring_t msg)
 }
 
 nar_runtime_t nar_runtime_new(nar_bytecode_t btc) {
-    runtime_t *rt = nar_alloc(sizeof(runtime_t));
+    return nar_runtime_new_with_allocator(btc, &nar_default_allocator);
+}
+
+nar_runtime_t nar_runtime_new_with_allocator(nar_bytecode_t bc, const nar_allocator_t *allocator) {
+    bytecode_t *btc = (bytecode_t *) bc;
+    runtime_t *rt = allocator_alloc(allocator, sizeof(runtime_t));
     memset(rt, 0, sizeof(runtime_t));
+    rt->allocator = *allocator;
 
-    rt->package_pointers = nar_alloc(sizeof(nar_t));
+    rt->package_pointers = rt_alloc(rt, sizeof(nar_t));
     rt->package_pointers->alloc = &nar_alloc;
     rt->package_pointers->realloc = &nar_realloc;
     rt->package_pointers->free = &nar_free;
+    rt->package_pointers->abi_version = NAR_PACKAGE_ABI_VERSION;
+    rt->package_pointers->allocator = &rt->allocator;
     rt->package_pointers->frame_alloc = &nar_frame_alloc;
     rt->package_pointers->frame_free = &nar_frame_free;
+    rt->package_pointers->frame_mark = &nar_frame_mark;
+    rt->package_pointers->frame_release_to = &nar_frame_release_to;
+    rt->package_pointers->persist = &nar_persist;
+    rt->package_pointers->persistent_clear = &nar_persistent_clear;
+    rt->package_pointers->copy_object = &nar_copy_object;
+    rt->package_pointers->heap_new = &nar_heap_new;
+    rt->package_pointers->heap_free = &nar_heap_free;
+    rt->package_pointers->heap_select = &nar_heap_select;
+    rt->package_pointers->set_unified_heap = &nar_set_unified_heap;
+    rt->package_pointers->gc_collect = &nar_gc_collect;
+    rt->package_pointers->pin = &nar_pin;
+    rt->package_pointers->pinned_get = &nar_pinned_get;
+    rt->package_pointers->unpin = &nar_unpin;
     rt->package_pointers->set_metadata = &nar_set_metadata;
     rt->package_pointers->get_metadata = &nar_get_metadata;
     rt->package_pointers->register_def = &nar_register_def;
@@ -96,7 +128,14 @@ nar_runtime_t nar_runtime_new(nar_bytecode_t btc) {
     rt->package_pointers->make_float = &nar_make_float;
     rt->package_pointers->to_float = &nar_to_float;
     rt->package_pointers->make_string = &nar_make_string;
+    rt->package_pointers->make_transient_string = &nar_make_transient_string;
+    rt->package_pointers->make_transient_string_len = &nar_make_transient_string_len;
     rt->package_pointers->to_string = &nar_to_string;
+    rt->package_pointers->to_string_len = &nar_to_string_len;
+    rt->package_pointers->string_is_ascii = &nar_string_is_ascii;
+    rt->package_pointers->make_string_concat = &nar_make_string_concat;
+    rt->package_pointers->string_stream = &nar_string_stream;
+    rt->package_pointers->string_write_fd = &nar_string_write_fd;
     rt->package_pointers->make_record = &nar_make_record;
     rt->package_pointers->make_record_field = &nar_make_record_field;
     rt->package_pointers->make_record_field_obj = &nar_make_record_field_obj;
@@ -125,6 +164,15 @@ nar_runtime_t nar_runtime_new(nar_bytecode_t btc) {
     rt->package_pointers->to_closure = &nar_to_closure;
     rt->package_pointers->new_serialized_object = &nar_new_serialized_object;
     rt->package_pointers->deserialize_object = &nar_deserialize_object;
+    rt->package_pointers->new_serialized_object_v2 = &nar_new_serialized_object_v2;
+    rt->package_pointers->serialized_object_size = &nar_serialized_object_size;
+    rt->package_pointers->deserialize_object_v2 = &nar_deserialize_object_v2;
+    rt->package_pointers->serialize_to_writer = &nar_serialize_to_writer;
+    rt->package_pointers->serialize_to_fd = &nar_serialize_to_fd;
+    rt->package_pointers->deserializer_new = &nar_deserializer_new;
+    rt->package_pointers->deserializer_feed = &nar_deserializer_feed;
+    rt->package_pointers->deserializer_finish = &nar_deserializer_finish;
+    rt->package_pointers->deserialize_from_fd = &nar_deserialize_from_fd;
 
     rt->package_pointers->to_enum_option_s = &nar_to_enum_option_s;
     rt->package_pointers->to_enum_option = &nar_to_enum_option;
@@ -134,44 +182,49 @@ nar_runtime_t nar_runtime_new(nar_bytecode_t btc) {
     rt->package_pointers->enum_def = &nar_enum_def;
 
     rt->program = btc;
-    rt->native_defs = hashmap_new(sizeof(native_def_item_t), 128, 0, 0,
-            &native_def_item_hash, &native_def_item_compare, &native_def_item_free, NULL);
-    rt->string_hashes = hashmap_new(sizeof(string_hast_t), 128, 0, 0,
-            &string_hast_hash, &string_hast_compare, NULL, NULL);
-
-    rt->arenas = nar_alloc(NAR_OBJECT_KIND__COUNT * sizeof(void *));
-    memset(rt->arenas, 0, NAR_OBJECT_KIND__COUNT * sizeof(void *));
-    rt->arenas[NAR_OBJECT_KIND_CHAR] = rvector_new(sizeof(nar_char_t), 128);
-    rt->arenas[NAR_OBJECT_KIND_INT] = rvector_new(sizeof(nar_int_t), 128);
-    rt->arenas[NAR_OBJECT_KIND_FLOAT] = rvector_new(sizeof(nar_float_t), 128);
-    rt->arenas[NAR_OBJECT_KIND_STRING] = rvector_new(sizeof(nar_string_t), 128);
-    rt->arenas[NAR_OBJECT_KIND_RECORD] = rvector_new(sizeof(nar_record_t), 128);
-    rt->arenas[NAR_OBJECT_KIND_TUPLE] = rvector_new(sizeof(nar_tuple_t), 128);
-    rt->arenas[NAR_OBJECT_KIND_LIST] = rvector_new(sizeof(nar_list_t), 128);
-    rt->arenas[NAR_OBJECT_KIND_OPTION] = rvector_new(sizeof(nar_option_t), 128);
-    rt->arenas[NAR_OBJECT_KIND_FUNCTION] = rvector_new(sizeof(nar_func_t), 128);
-    rt->arenas[NAR_OBJECT_KIND_CLOSURE] = rvector_new(sizeof(nar_closure_t), 128);
-    rt->arenas[NAR_OBJECT_KIND_NATIVE] = rvector_new(sizeof(nar_native_t), 128);
-    rt->arenas[NAR_OBJECT_KIND_PATTERN] = rvector_new(sizeof(nar_pattern_t), 128);
-
-    rt->locals = rvector_new(sizeof(local_t), 64);
-    rt->frame_memory = rvector_new(sizeof(nar_ptr_t), 512);
-    rt->call_stack = rvector_new(sizeof(nar_string_t), 32);
-    rt->lib_handles = rvector_new(sizeof(nar_ptr_t), 0);
+    rt->native_defs = allocator_hashmap_new(&rt->allocator, sizeof(native_def_item_t), 128,
+            &native_def_item_hash, &native_def_item_compare, NULL);
+    rt->permanent_strings = rt_vector_new(rt, sizeof(string_header_t), btc->num_strings + 3);
+    rt->permanent_string_hashes = allocator_hashmap_new(
+            &rt->allocator, sizeof(string_hast_t), btc->num_strings + 3,
+            &string_hast_hash, &string_hast_compare, NULL);
+
+    rt->heaps = rt_vector_new(rt, sizeof(heap_t *), 1);
+    rt->heap = heap_new(rt);
+    vector_push(rt->heaps, 1, &rt->heap);
+    heap_load(rt, rt->heap);
+    rt->persistent_arenas = rt_alloc(rt, NAR_OBJECT_KIND__COUNT * sizeof(void *));
+    memset(rt->persistent_arenas, 0, NAR_OBJECT_KIND__COUNT * sizeof(void *));
+    for (size_t i = 0; i < NAR_OBJECT_KIND__COUNT; i++) {
+        if (rt->arenas[i] != NULL) {
+            rt->persistent_arenas[i] = arena_new(&rt->allocator, rt->arenas[i]->item_size);
+        }
+    }
+    rt->persistent_string_hashes = allocator_hashmap_new(&rt->allocator, sizeof(string_hast_t), 0,
+            &string_hast_hash, &string_hast_compare, NULL);
+
+    rt->locals = rt_vector_new(rt, sizeof(local_t), 64);
+    rt->call_stack = rt_vector_new(rt, sizeof(nar_string_t), 32);
+    rt->lib_handles = rt_vector_new(rt, sizeof(nar_ptr_t), 0);
+    rt->roots = rt_vector_new(rt, sizeof(vector_t *), 32);
     rt->last_error = NULL;
-    rt->metadata = hashmap_new(sizeof(metadata_item_t), 128, 0, 0,
-            &metadata_item_hash, &metadata_item_compare, &metadata_item_free, NULL);
+    rt->metadata = allocator_hashmap_new(&rt->allocator, sizeof(metadata_item_t), 128,
+            &metadata_item_hash, &metadata_item_compare, NULL);
 
     nar_set_stdout(rt, NULL);
 
+    intern_program_strings(rt);
     nar_frame_free(rt);
     return rt;
 }
 
 void nar_runtime_replace_program(nar_runtime_t rt, nar_bytecode_t btc) {
     runtime_t * r = ((runtime_t *) rt);
+    heaps_frame_free(r);
+    nar_persistent_clear(rt); // persistent objects can refer to program strings
     nar_bytecode_free(r->program);
     r->program = btc;
+    intern_program_strings(r);
 }
 
 void library_free(void *handle) {
@@ -185,38 +238,43 @@ void library_free(void *handle) {
 
 void nar_runtime_free(nar_runtime_t rt) {
     if (rt != NULL) {
-        frame_free(rt, false);
         runtime_t *r = (runtime_t *) rt;
-        hashmap_free(r->native_defs);
-        hashmap_free(r->string_hashes);
-        for (size_t i = 0; i < NAR_OBJECT_KIND__COUNT; i++) {
-            vector_free(r->arenas[i]);
-        }
-        nar_free(r->arenas);
+        heaps_free(r);
+        native_defs_free(r);
+        vector_free(r->permanent_strings);
+        hashmap_free(r->permanent_string_hashes);
+        rt_free(r, r->program_strings);
+        persistent_free(r);
+        nar_snapshot_detach(r);
         vector_free(r->locals);
-        vector_free(r->frame_memory);
         vector_free(r->call_stack);
-        nar_free(r->last_error);
+        vector_free(r->roots);
+        rt_free(r, r->last_error);
         for (nar_ptr_t *it = vector_begin(r->lib_handles); it != vector_end(r->lib_handles); it++) {
             library_free(*it);
         }
         vector_free(r->lib_handles);
-        nar_free(r->package_pointers);
-        hashmap_free(r->metadata);
+        rt_free(r, r->package_pointers);
+        metadata_free(r);
         nar_bytecode_free(r->program);
-        nar_free(rt);
+        nar_allocator_t allocator = r->allocator;
+        allocator_free(&allocator, rt);
     }
 }
 
 void nar_register_def(
         nar_runtime_t rt, nar_cstring_t module_name, nar_cstring_t def_name,
         nar_cptr_t fn, nar_size_t arity) {
-    nar_string_t key = nar_alloc((strlen(module_name) + strlen(def_name) + 2));
+    runtime_t *r = (runtime_t *) rt;
+    nar_string_t key = rt_alloc(r, strlen(module_name) + strlen(def_name) + 2);
     strcpy(key, module_name);
     strcat(key, ".");
     strcat(key, def_name);
-    hashmap_set(((runtime_t *) rt)->native_defs,
+    const native_def_item_t *old = hashmap_set(r->native_defs,
             &(native_def_item_t) {.name = key, .fn = fn, .arity = arity});
+    if (old != NULL) {
+        rt_free(r, (nar_string_t) old->name);
+    }
 }
 
 void nar_register_def_dynamic(
@@ -258,27 +316,32 @@ nar_object_t nar_apply(
 
 nar_object_t nar_apply_func( // NOLINT(*-no-recursion)
         nar_runtime_t rt, nar_object_t fn, nar_size_t num_args, const nar_object_t *args) {
+    runtime_t *r = (runtime_t *) rt;
+    if (!check_type(rt, fn, NAR_OBJECT_KIND_CLOSURE)) {
+        return NAR_INVALID_OBJECT; // memory limit can leave closure invalid
+    }
     nar_closure_t afn = nar_to_closure(rt, fn);
-    nar_list_t curried = nar_to_list(rt, afn.curried);
-    size_t num_all_args = (num_args + curried.size);
-    vector_t *all_args = rvector_new(sizeof(nar_object_t), num_all_args);
+    vector_t *all_args = rt_vector_new(r, sizeof(nar_object_t), num_args);
 
-    vector_push(all_args, curried.size, curried.items);
+    list_push_items(r, afn.curried, all_args);
     vector_push(all_args, num_args, args);
-    func_t *f = &((runtime_t *) rt)->program->functions[afn.fn_index];
+    size_t num_all_args = vector_size(all_args);
+    func_t *f = &r->program->functions[afn.fn_index];
     nar_object_t result;
 
-    if (vector_size(all_args) == f->num_args) {
+    if (num_all_args == f->num_args) {
         result = execute(rt, f, all_args);
     } else if (f->num_args < num_all_args) {
         size_t num_rest = num_all_args - f->num_args;
-        nar_object_t *rest = nar_alloc(sizeof(nar_object_t) * num_rest);
-        vector_pop(all_args, num_rest, rest);
+        vector_t *rest = rt_vector_new(r, sizeof(nar_object_t), num_rest);
+        vector_pop_vec(all_args, num_rest, rest);
+        gc_push_root(r, rest);
         result = execute(rt, f, all_args);
+        gc_pop_root(r);
         if (nar_object_is_valid(rt, result)) {
-            result = nar_apply_func(rt, result, num_rest, rest);
+            result = nar_apply_func(rt, result, num_rest, vector_data(rest));
         }
-        nar_free(rest);
+        vector_free(rest);
     } else {
         result = nar_make_closure(rt, afn.fn_index, vector_size(all_args), vector_data(all_args));
     }
@@ -299,6 +362,9 @@ void nar_fail(nar_runtime_t rt, nar_cstring_t message) {
         return;
     }
     runtime_t *r = (runtime_t *) rt;
+    if (r->last_error_code == NAR_ERROR_NONE) {
+        r->last_error_code = NAR_ERROR_FAILED;
+    }
 
     size_t len = strlen(message) + 1 + 1;
     vector_t *stack = ((runtime_t *) r)->call_stack;
@@ -306,8 +372,8 @@ void nar_fail(nar_runtime_t rt, nar_cstring_t message) {
         len += strlen(*(nar_string_t *) vector_at(stack, i - 1)) + 1;
     }
 
-    nar_string_t msg_with_stack = nar_alloc(len);
-    strcat(msg_with_stack, message);
+    nar_string_t msg_with_stack = rt_alloc(r, len);
+    strcpy(msg_with_stack, message);
     strcat(msg_with_stack, "\n");
     for (size_t i = vector_size(stack); i > 0; --i) {
         strcat(msg_with_stack, *(nar_string_t *) vector_at(stack, i - 1));
@@ -315,17 +381,24 @@ void nar_fail(nar_runtime_t rt, nar_cstring_t message) {
     }
 
     if (r->last_error != NULL) {
-        nar_string_t combined = nar_alloc(strlen(r->last_error) + strlen(msg_with_stack) + 21);
+        nar_string_t combined = rt_alloc(r, strlen(r->last_error) + strlen(msg_with_stack) + 21);
         strcpy(combined, r->last_error);
         strcat(combined, "\n----------------\n");
         strcat(combined, message);
-        nar_free(r->last_error);
+        rt_free(r, r->last_error);
         r->last_error = combined;
     } else {
-        r->last_error = string_dup(msg_with_stack);
+        r->last_error = string_dup(r, msg_with_stack);
     }
     printf("%s", msg_with_stack);
-    nar_free(msg_with_stack);
+    rt_free(r, msg_with_stack);
+}
+
+void runtime_fail(runtime_t *rt, nar_error_code_t code, nar_cstring_t message) {
+    if (rt->last_error_code == NAR_ERROR_NONE) {
+        rt->last_error_code = code;
+    }
+    nar_fail(rt, message);
 }
 
 nar_cstring_t nar_get_error(nar_runtime_t rt) {
@@ -345,18 +418,57 @@ void nar_clear_error(nar_runtime_t rt) {
 
     runtime_t *r = (runtime_t *) rt;
     if (r->last_error != NULL) {
-        nar_free(r->last_error);
+        rt_free(r, r->last_error);
         r->last_error = NULL;
     }
+    r->last_error_code = NAR_ERROR_NONE;
+}
+
+nar_error_code_t nar_get_error_code(nar_runtime_t rt) {
+    return ((runtime_t *) rt)->last_error_code;
+}
+
+// Fuel is charged with instructions executed since the previous charge before every call,
+// calls are the only way to repeat instructions since jumps go forward.
+// Interrupt requests are checked at the same points.
+nar_bool_t fuel_charge(runtime_t *rt, size_t num_ops) {
+    if (atomic_load_explicit(&rt->interrupted, memory_order_relaxed)) {
+        atomic_store_explicit(&rt->interrupted, false, memory_order_relaxed);
+        runtime_fail(rt, NAR_ERROR_INTERRUPTED, "evaluation interrupted");
+        return false;
+    }
+    if (rt->fuel_limited) {
+        if (rt->fuel < num_ops) {
+            rt->fuel = 0;
+            runtime_fail(rt, NAR_ERROR_OUT_OF_FUEL, "instruction budget exhausted");
+            return false;
+        }
+        rt->fuel -= num_ops;
+    }
+    return true;
+}
+
+void nar_set_fuel(nar_runtime_t rt, nar_size_t instructions) {
+    runtime_t *r = (runtime_t *) rt;
+    r->fuel = instructions;
+    r->fuel_limited = instructions != 0;
+}
+
+nar_size_t nar_get_fuel(nar_runtime_t rt) {
+    return ((runtime_t *) rt)->fuel;
+}
+
+void nar_runtime_interrupt(nar_runtime_t rt) {
+    atomic_store_explicit(&((runtime_t *) rt)->interrupted, true, memory_order_relaxed);
 }
 
 void nar_set_metadata(nar_runtime_t rt, nar_cstring_t key, nar_cptr_t value) {
     runtime_t *r = (runtime_t *) rt;
     metadata_item_t *old = (metadata_item_t *) hashmap_set(
             r->metadata,
-            &(metadata_item_t) {.name = (nar_string_t) string_dup(key), .value = value});
+            &(metadata_item_t) {.name = (nar_string_t) string_dup(r, key), .value = value});
     if (old != NULL) {
-        metadata_item_free(old);
+        rt_free(r, (nar_string_t) old->name);
     }
 }
 
@@ -440,16 +552,16 @@ nar_bool_t nar_register_libs(nar_runtime_t rt, nar_cstring_t libs_path) {
     return true;
 }
 
-nar_string_t frame_string_dup(runtime_t *rt, nar_cstring_t str) {
-    size_t sz = (strlen(str) + 1);
-    nar_string_t dup = nar_frame_alloc(rt, sz);
-    memcpy(dup, str, sz);
+nar_string_t string_dup_len(runtime_t *rt, nar_cstring_t str, nar_size_t length) {
+    nar_string_t dup = rt_alloc(rt, length + 1);
+    memcpy(dup, str, length);
+    dup[length] = 0;
     return dup;
 }
 
-nar_string_t string_dup(nar_cstring_t str) {
+nar_string_t string_dup(runtime_t *rt, nar_cstring_t str) {
     size_t sz = (strlen(str) + 1);
-    nar_string_t dup = nar_alloc(sz);
+    nar_string_t dup = rt_alloc(rt, sz);
     memcpy(dup, str, sz);
     return dup;
 }
\ No newline at end of file
@@ -5,13 +5,45 @@
 #include "include/hashmap/hashmap.h"
 #include "bytecode.h"
 #include "include/vector.h"
+#include "arena.h"
+#include <stdatomic.h>
 
-#define build_object(kind, index)  (((nar_object_t)kind << 56) | (nar_object_t)index)
+#define build_object(kind, index)  (((nar_object_t)(kind) << 56) | (nar_object_t)(index))
+#define object_get_index(obj) ((obj) & 0x00FFFFFFFFFFFFFF)
 #define OPTION_NAME_TRUE "Nar.Base.Basics.Bool#True"
 #define OPTION_NAME_FALSE "Nar.Base.Basics.Bool#False"
 
+// Immediate objects carry their payload in the index bits instead of pointing into an arena.
+// Options without values are immediates: the payload is the index of their name string.
+#define INDEX_FLAG_IMMEDIATE 0x0040000000000000
+#define object_is_immediate(obj) (((obj) & INDEX_FLAG_IMMEDIATE) != 0)
+
+// Permanent objects are created once per runtime and survive frame resets.
+#define INDEX_FLAG_PERMANENT 0x0020000000000000
+
+// Nursery objects live in small per-kind arenas until a minor collection promotes them.
+#define INDEX_FLAG_NURSERY 0x0010000000000000
+
+// Persistent objects are copied by `nar_persist` to a heap that survives frame resets.
+// Persistent strings are interned separately from frame strings.
+#define INDEX_FLAG_PERSISTENT 0x0008000000000000
+
+// Snapshot objects are items of an attached snapshot file used in place, see snapshot.c.
+// Snapshot strings are interned within the snapshot only.
+#define INDEX_FLAG_SNAPSHOT 0x0004000000000000
+
+// objects of different domains are interned separately, so equal strings can differ
+#define INDEX_DOMAIN_FLAGS (INDEX_FLAG_PERSISTENT | INDEX_FLAG_SNAPSHOT)
+
+// permanent string indices of the strings interned before any program string
+#define STRING_INDEX_EMPTY 0
+#define STRING_INDEX_FALSE 1
+#define STRING_INDEX_TRUE 2
+#define EMPTY_STRING_OBJECT \
+    build_object(NAR_OBJECT_KIND_STRING, INDEX_FLAG_PERMANENT | STRING_INDEX_EMPTY)
+
 typedef struct {
-    nar_cstring_t name;
+    nar_object_t name;
     nar_object_t value;
 } local_t;
 
@@ -28,41 +60,243 @@ typedef struct {
 
 typedef struct {
     pattern_kind_t kind;
-    nar_cstring_t name;
+    nar_object_t name;
     nar_object_t values;
 } nar_pattern_t;
 
+#define STRING_FLAG_ASCII 1 // all bytes are below 0x80
+#define STRING_FLAG_HASHED 2 // hash field is computed
+#define STRING_FLAG_TRANSIENT 4 // string is not registered in the intern table yet
+#define STRING_FLAG_ROPE 8 // string is a concatenation that is not flattened yet
+
+typedef struct {
+    nar_object_t left;
+    nar_object_t right;
+} string_rope_t;
+
+// Frame strings own their data (or rope node), it is freed with the string.
+typedef struct {
+    union {
+        nar_cstring_t data;
+        string_rope_t *rope; // when STRING_FLAG_ROPE is set
+    };
+    nar_size_t length; // in bytes, without terminating zero
+    uint64_t hash;
+    uint8_t flags;
+} string_header_t;
+
 typedef struct {
     nar_cstring_t string;
+    nar_size_t length;
     nar_object_t index;
 } string_hast_t;
 
 typedef struct {
+    nar_byte_t *data; // mapped file
+    size_t size;
+    nar_byte_t *items[NAR_OBJECT_KIND__COUNT]; // item section of every kind in the mapping
+    size_t counts[NAR_OBJECT_KIND__COUNT];
+    string_header_t *strings; // data points into the mapping
+    hashmap_t *string_hashes; // of string_hast_t
+} snapshot_t;
+
+// frame allocations above this size do not use the slab
+#define FRAME_SLAB_MAX_BLOCK (ARENA_CHUNK_SIZE / 4)
+
+// forward index of an object that did not survive collection
+#define GC_UNREACHABLE ((size_t) -1)
+
+typedef struct {
+    size_t arena_sizes[NAR_OBJECT_KIND__COUNT];
+    size_t nursery_sizes[NAR_OBJECT_KIND__COUNT];
+    size_t frame_memory_size;
+    size_t frame_slab_size;
+    size_t pinned_size;
+    size_t unified_size;
+    size_t unified_strings_size;
+    nar_size_t frame_bytes;
+    nar_size_t frame_objects;
+} frame_checkpoint_t;
+
+// Memory of one request context. Fields of the active heap live in runtime_t and are saved
+// back when another heap is selected.
+typedef struct {
+    hashmap_t *string_hashes;
+    arena_t **arenas;
+    vector_t *frame_memory;
+    bump_t *frame_slab;
+    vector_t *checkpoints;
+    vector_t *pinned;
+    nar_size_t gc_trigger;
+    nar_size_t gc_allocated;
+    nar_bool_t gc_requested;
+    vector_t **nurseries;
+    nar_size_t nursery_capacity;
+    nar_size_t *nursery_scan;
+    nar_bool_t nursery_requested;
+    vector_t **refcounts;
+    vector_t **free_slots;
+    vector_t *frame_marks;
+    bump_t *unified;
+    vector_t *unified_strings;
+    nar_size_t frame_bytes;
+    nar_size_t frame_objects;
+} heap_t;
+
+typedef struct {
+    nar_allocator_t allocator; // of all runtime memory
     bytecode_t *program;
     hashmap_t *native_defs; // of native_def_item_t
     hashmap_t *string_hashes; // of string_hast_t
-    vector_t **arenas; // vector_t of nar_object_t
+    vector_t *permanent_strings; // of string_header_t
+    hashmap_t *permanent_string_hashes; // of string_hast_t
+    nar_object_t *program_strings; // interned object for every string of the program
+    arena_t **arenas; // arena_t of items per object kind
     vector_t *locals; // of local_t
-    vector_t *frame_memory; // of nar_ptr_t
+    vector_t *frame_memory; // of nar_ptr_t, blocks too large for the slab
+    bump_t *frame_slab; // small blocks of frame memory
+    vector_t *checkpoints; // of frame_checkpoint_t
     vector_t *call_stack; // of nar_string_t
     vector_t *lib_handles; // of nar_ptr_t
     void* last_lib_handle;
     nar_t *package_pointers;
     nar_string_t last_error;
+    nar_error_code_t last_error_code;
     hashmap_t *metadata; // of metadata_item_t
     nar_stdout_fn_t stdout;
+    vector_t *roots; // of vector_t*, value stacks of running functions
+    vector_t *pinned; // of nar_object_t, objects held by the host
+    nar_size_t native_depth; // natives running, objects are not moved until they return
+    nar_size_t gc_threshold; // minimal number of allocations between collections, 0 - disabled
+    nar_size_t gc_trigger;
+    nar_size_t gc_allocated; // objects allocated since the last collection
+    nar_bool_t gc_requested;
+    vector_t **nurseries; // vector_t of nar_object_t, NULL when nursery is disabled
+    nar_size_t nursery_capacity; // objects per kind
+    nar_size_t *nursery_scan; // per kind arena size after the last minor collection
+    nar_bool_t nursery_requested;
+    vector_t **refcounts; // of uint32_t per kind, references from heap objects, NULL when disabled
+    vector_t **free_slots; // of size_t per kind, released arena slots to reuse
+    vector_t *frame_marks; // arena sizes at entry of every running function
+    bump_t *unified; // objects of all kinds in creation order, NULL when per-kind arenas are used
+    vector_t *unified_strings; // of size_t, offsets of string headers in unified region
+    arena_t **persistent_arenas; // arena_t of items per object kind
+    hashmap_t *persistent_string_hashes; // of string_hast_t
+    snapshot_t *snapshot; // attached snapshot or NULL
+    nar_size_t arena_byte_limit; // arena chunk bytes of all heaps, 0 - unlimited
+    nar_size_t frame_byte_limit; // frame memory and string bytes per frame, 0 - unlimited
+    nar_size_t object_limit; // objects created per frame, 0 - unlimited
+    nar_size_t frame_bytes; // frame memory allocated in the current frame
+    nar_size_t frame_objects; // live objects of the current frame, counted when limited
+    nar_size_t fuel; // instructions left when fuel_limited
+    nar_bool_t fuel_limited;
+    atomic_bool interrupted;
+    heap_t *heap; // active heap
+    vector_t *heaps; // of heap_t*, the first one is the default heap
     //TODO: vector_t stack; // of nar_object_t -- introduce single stack for objects
     //TODO: vector_t patterns; // of nar_object_t -- introduce single stack for patterns
 } runtime_t;
 
-void frame_free(runtime_t *rt, bool create_defaults);
+typedef enum {
+    COPY_RESOLVED, // copy is set, object has no item to copy or is already copied
+    COPY_ITEM, // object is copied item by item with its children
+    COPY_FAILED, // walk stops and returns NAR_INVALID_OBJECT
+} copy_resolve_t;
+
+// deep copy of object graph, see copy.c
+typedef struct {
+    runtime_t *src; // objects and items are read from
+    void *ctx;
+    // resolves object without copying its item, must resolve every string
+    copy_resolve_t (*resolve)(void *ctx, nar_object_t obj, nar_object_t *copy);
+    // stores item with copied children to destination, NAR_INVALID_OBJECT stops the walk
+    nar_object_t (*insert)(void *ctx, nar_object_kind_t kind, void *item);
+} copy_walk_t;
+
+#define rt_alloc(rt, size) allocator_alloc(&(rt)->allocator, size)
+#define rt_realloc(rt, mem, size) allocator_realloc(&(rt)->allocator, mem, size)
+#define rt_free(rt, mem) allocator_free(&(rt)->allocator, mem)
+#define rt_vector_new(rt, item_size, capacity) avector_new(item_size, capacity, &(rt)->allocator)
+
+hashmap_t *allocator_hashmap_new(
+        const nar_allocator_t *allocator, size_t elsize, size_t cap,
+        uint64_t (*hash)(const void *item, uint64_t seed0, uint64_t seed1),
+        int (*compare)(const void *a, const void *b, void *udata),
+        void *udata);
+
+void frame_free(runtime_t *rt);
+void runtime_fail(runtime_t *rt, nar_error_code_t code, nar_cstring_t message);
+nar_bool_t fuel_charge(runtime_t *rt, size_t num_ops);
+nar_bool_t limit_arena_grow(runtime_t *rt, nar_object_kind_t kind, size_t chunk_bytes);
+void limit_objects(runtime_t *rt, nar_object_kind_t kind);
+nar_bool_t limit_frame_bytes(runtime_t *rt, size_t size);
+void limit_release_frame_bytes(runtime_t *rt, size_t size);
+nar_cstring_t kind_to_string(nar_object_kind_t kind);
+heap_t *heap_new(runtime_t *rt);
+void heap_load(runtime_t *rt, heap_t *heap);
+void heaps_frame_free(runtime_t *rt);
+void heaps_free(runtime_t *rt);
+nar_object_t unified_insert(runtime_t *rt, nar_object_kind_t kind, const void *value);
+void unified_release_strings(runtime_t *rt, size_t num_strings);
+int string_hast_compare(const void *a, const void *b, void *data);
+uint64_t string_hast_hash(const void *item, uint64_t seed0, uint64_t seed1);
+void frame_checkpoints_compacted(
+        runtime_t *rt, nar_object_kind_t kind, const size_t *forward, size_t num_live);
+void intern_program_strings(runtime_t *rt);
+nar_object_t insert(nar_runtime_t rt, nar_object_kind_t kind, void *value);
+void *find(nar_runtime_t rt, nar_object_kind_t kind, nar_object_t obj);
+nar_object_t find_string(runtime_t *rt, nar_cstring_t value);
+nar_object_t find_string_with_hash(
+        runtime_t *rt, nar_cstring_t value, nar_size_t length, uint64_t hash);
+uint8_t ascii_flag(nar_cstring_t data, nar_size_t length);
+void persistent_free(runtime_t *rt);
+void *snapshot_at(runtime_t *rt, nar_object_kind_t kind, size_t index);
+bool check_type(nar_runtime_t rt, nar_object_t obj, nar_object_kind_t kind);
 nar_object_t execute(runtime_t *rt, const func_t *fn, vector_t *stack);
 nar_object_t nar_make_pattern(
         nar_runtime_t rt, pattern_kind_t kind,
-        nar_cstring_t name, size_t num_items, nar_object_t *items);
+        nar_object_t name, size_t num_items, nar_object_t *items);
 nar_pattern_t nar_to_pattern(nar_runtime_t rt, nar_object_t pattern);
-nar_string_t frame_string_dup(runtime_t *rt, nar_cstring_t str);
-nar_string_t string_dup(nar_cstring_t str);
+nar_object_t nar_to_record_field_obj(nar_runtime_t rt, nar_object_t obj, nar_object_t key);
+nar_object_t nar_make_option_obj(
+        nar_runtime_t rt, nar_object_t name, nar_size_t size, const nar_object_t *items);
+nar_object_t nar_make_option_with_list(nar_runtime_t rt, nar_object_t name, nar_object_t item_list);
+nar_object_t nar_make_tuple_item(nar_runtime_t rt, nar_object_t value, nar_object_t next);
+nar_object_t nar_make_closure_with_list(
+        nar_runtime_t rt, size_t fn_index, nar_object_t curried_list);
+nar_object_t nar_make_pattern_with_list(
+        nar_runtime_t rt, pattern_kind_t kind, nar_object_t name, nar_object_t value_list);
+uint64_t string_hash(nar_cstring_t data, nar_size_t length);
+string_header_t *find_string_header(runtime_t *rt, nar_object_t obj);
+string_header_t *string_header(runtime_t *rt, nar_object_t obj);
+uint64_t string_header_hash(string_header_t *header);
+nar_object_t string_intern(runtime_t *rt, nar_object_t obj);
+nar_bool_t string_equals(runtime_t *rt, nar_object_t x, nar_object_t y);
+void string_free_data(runtime_t *rt, string_header_t *header);
+void string_release_data(runtime_t *rt, string_header_t *header);
+nar_size_t list_size(runtime_t *rt, nar_object_t list);
+void list_push_items(runtime_t *rt, nar_object_t list, vector_t *items);
+typedef void (*object_visit_fn_t)(void *ctx, nar_object_t *slot);
+void object_visit_children(nar_object_kind_t kind, void *item, void *ctx, object_visit_fn_t visit);
+nar_object_t copy_walk(const copy_walk_t *walk, nar_object_t obj);
+void gc_push_root(runtime_t *rt, vector_t *stack);
+void gc_pop_root(runtime_t *rt);
+void gc_collect(runtime_t *rt);
+void gc_minor_collect(runtime_t *rt);
+nar_object_t rc_insert(runtime_t *rt, nar_object_kind_t kind, void *value);
+void rc_track(runtime_t *rt, nar_object_kind_t kind);
+void rc_enter(runtime_t *rt);
+void rc_leave(runtime_t *rt);
+void rc_reset_marks(runtime_t *rt);
+void rc_clear_free_slots(runtime_t *rt);
+nar_object_t rc_update_record(
+        runtime_t *rt, nar_object_t record, nar_object_t key, nar_object_t value,
+        size_t num_locals);
+void rc_free(runtime_t *rt, nar_object_t obj, size_t num_locals);
+void rc_clear(runtime_t *rt);
+void rc_free_state(runtime_t *rt);
+nar_string_t string_dup_len(runtime_t *rt, nar_cstring_t str, nar_size_t length);
+nar_string_t string_dup(runtime_t *rt, nar_cstring_t str);
 void nar_register_def_dynamic(
         nar_runtime_t rt, nar_cstring_t module_name, nar_cstring_t def_name,
         nar_cstring_t func_name, nar_size_t arity);
@@ -0,0 +1,911 @@
+#if defined (__unix__) || defined (__APPLE__)
+#define NAR_SERIAL_FD
+#include <errno.h>
+#include <unistd.h>
+#endif
+
+#include <string.h>
+#include "include/nar-runtime.h"
+#include "runtime.h"
+
+// Portable serialization format (v2), all numbers are little-endian:
+//
+//   header    "NARS", u16 version, u16 flags, u64 total size, u64 string table offset
+//   objects   postfix stream of tagged items, composite items follow their children
+//   strings   varint count, then varint length and bytes of every distinct string
+//
+// Integers and counts are varints (signed ones zigzag encoded), floats are 8 raw bytes.
+// Lists and tuples are counted sequences of items, records are counted sequences of
+// key-value pairs from the last added field to the first one. Strings refer to the table.
+// Both directions use explicit stacks, so nesting depth and list length are not limited
+// by the C stack. Function and native objects hold process addresses and are rejected.
+//
+// With NAR_SERIALIZE_SHARED every written list, tuple and record cell, option, closure and
+// pattern gets the next node number, and an object that is met again is written as a reference
+// to its number. A sequence stops at the first already written cell, which becomes its tail,
+// so the count of a sequence is shifted left by one with the low bit telling if a tail follows.
+//
+// Streamed objects have SERIAL_FLAG_STREAM set and zero sizes in the header. They have no
+// string table: a string is defined by its length and bytes where it is met first and gets
+// the next table index, the object stream ends with SERIAL_TAG_END. The writer hands out
+// chunks of about SERIAL_CHUNK_SIZE bytes and the reader consumes chunks as they arrive,
+// keeping only an incomplete item between them, so neither side holds the whole encoding.
+
+#define SERIAL_MAGIC "NARS"
+#define SERIAL_VERSION 2
+#define SERIAL_HEADER_SIZE 24
+#define SERIAL_FLAG_STREAM 0x8000
+#define SERIAL_CHUNK_SIZE (64 * 1024)
+
+typedef enum {
+    SERIAL_TAG_INVALID,
+    SERIAL_TAG_UNIT,
+    SERIAL_TAG_CHAR,
+    SERIAL_TAG_INT,
+    SERIAL_TAG_FLOAT,
+    SERIAL_TAG_STRING,
+    SERIAL_TAG_RECORD, // count of fields
+    SERIAL_TAG_LIST, // count of items
+    SERIAL_TAG_TUPLE, // count of items
+    SERIAL_TAG_OPTION, // name, value list
+    SERIAL_TAG_CLOSURE, // function index; curried list
+    SERIAL_TAG_PATTERN, // pattern kind; name, value list
+    SERIAL_TAG_REF, // node number
+    SERIAL_TAG_STRING_DEF, // length, bytes
+    SERIAL_TAG_END,
+} serial_tag_t;
+
+typedef struct {
+    nar_object_t obj;
+    nar_bool_t emit; // write tag of already visited composite object
+    serial_tag_t tag;
+    nar_size_t arg;
+    nar_size_t num_cells; // sequence cells that get node numbers
+} serial_entry_t;
+
+typedef struct {
+    nar_object_t obj;
+    nar_size_t node;
+} serial_memo_t;
+
+typedef struct {
+    runtime_t *rt;
+    vector_t *out; // of nar_byte_t
+    vector_t *stack; // of serial_entry_t
+    hashmap_t *string_index; // of string_hast_t, index is position in the table
+    vector_t *strings; // of string_hast_t
+    hashmap_t *memo; // of serial_memo_t, NULL if structure is not shared
+    nar_size_t num_nodes;
+    nar_serialize_write_fn_t write; // NULL if whole output is kept in `out`
+    nar_ptr_t write_ctx;
+} serial_writer_t;
+
+int serial_memo_compare(const void *a, const void *b, __attribute__((unused)) void *data) {
+    const serial_memo_t *ia = a;
+    const serial_memo_t *ib = b;
+    return ia->obj == ib->obj ? 0 : (ia->obj < ib->obj ? -1 : 1);
+}
+
+uint64_t serial_memo_hash(const void *item, uint64_t seed0, uint64_t seed1) {
+    const serial_memo_t *i = item;
+    return hashmap_sip(&i->obj, sizeof(nar_object_t), seed0, seed1);
+}
+
+// next cell of a record, list or tuple
+nar_object_t serial_next_cell(runtime_t *rt, nar_object_t cell) {
+    nar_object_kind_t kind = nar_object_get_kind(rt, cell);
+    if (kind == NAR_OBJECT_KIND_RECORD) {
+        return nar_to_record_item(rt, cell).parent;
+    }
+    // list and tuple items have the same layout
+    return ((nar_list_item_t *) find(rt, kind, cell))->next;
+}
+
+void serial_write_u64(vector_t *out, uint64_t value, size_t size) {
+    nar_byte_t bytes[8];
+    for (size_t i = 0; i < size; i++) {
+        bytes[i] = (nar_byte_t) (value >> (i * 8));
+    }
+    vector_push(out, size, bytes);
+}
+
+void serial_write_varint(vector_t *out, uint64_t value) {
+    nar_byte_t bytes[10];
+    size_t size = 0;
+    while (value >= 0x80) {
+        bytes[size++] = (nar_byte_t) (value | 0x80);
+        value >>= 7;
+    }
+    bytes[size++] = (nar_byte_t) value;
+    vector_push(out, size, bytes);
+}
+
+void serial_write_tag(vector_t *out, serial_tag_t tag) {
+    nar_byte_t byte = (nar_byte_t) tag;
+    vector_push(out, 1, &byte);
+}
+
+void serial_patch_u64(vector_t *out, size_t offset, uint64_t value) {
+    nar_byte_t *bytes = vector_at(out, offset);
+    for (size_t i = 0; i < 8; i++) {
+        bytes[i] = (nar_byte_t) (value >> (i * 8));
+    }
+}
+
+void serial_write_string(serial_writer_t *w, nar_object_t obj) {
+    string_hast_t key = {0};
+    key.string = nar_to_string_len(w->rt, obj, &key.length);
+    const string_hast_t *found = hashmap_get(w->string_index, &key);
+    if (found != NULL) {
+        serial_write_tag(w->out, SERIAL_TAG_STRING);
+        serial_write_varint(w->out, found->index);
+        return;
+    }
+    key.index = vector_size(w->strings);
+    vector_push(w->strings, 1, &key);
+    hashmap_set(w->string_index, &key);
+    if (w->write == NULL) {
+        serial_write_tag(w->out, SERIAL_TAG_STRING);
+        serial_write_varint(w->out, key.index);
+    } else {
+        serial_write_tag(w->out, SERIAL_TAG_STRING_DEF);
+        serial_write_varint(w->out, key.length);
+        vector_push(w->out, key.length, key.string);
+    }
+}
+
+// returns node of already written object or NULL
+const serial_memo_t *serial_written(serial_writer_t *w, nar_object_t obj) {
+    if (w->memo == NULL || !nar_index_is_valid(w->rt, obj)) {
+        return NULL;
+    }
+    return hashmap_get(w->memo, &(serial_memo_t) {.obj = obj});
+}
+
+void serial_push_child(serial_writer_t *w, nar_object_t obj) {
+    vector_push(w->stack, 1, &(serial_entry_t) {.obj = obj});
+}
+
+// children are pushed in stream order, reversing them puts the first one on top of the stack
+void serial_reverse_children(serial_writer_t *w, size_t from) {
+    serial_entry_t *first = vector_at(w->stack, from);
+    serial_entry_t *last = vector_at(w->stack, vector_size(w->stack) - 1);
+    for (; first < last; first++, last--) {
+        serial_entry_t tmp = *first;
+        *first = *last;
+        *last = tmp;
+    }
+}
+
+// sets count of the sequence scheduled at `from`, `tail` is the first already written cell
+void serial_sequence_end(serial_writer_t *w, size_t from, size_t per_cell, nar_object_t tail) {
+    serial_entry_t *emit = vector_at(w->stack, from - 1);
+    emit->num_cells = (vector_size(w->stack) - from) / per_cell;
+    emit->arg = emit->num_cells;
+    if (w->memo != NULL) {
+        nar_bool_t has_tail = nar_index_is_valid(w->rt, tail);
+        emit->arg = emit->arg << 1 | has_tail;
+        if (has_tail) {
+            serial_push_child(w, tail);
+        }
+    }
+}
+
+// writes scalar object or schedules children of composite one, returns false on failure
+nar_bool_t serial_visit(serial_writer_t *w, nar_object_t obj) {
+    runtime_t *rt = w->rt;
+    nar_object_kind_t kind = nar_object_get_kind(rt, obj);
+    serial_entry_t emit = {.obj = obj, .emit = true};
+    size_t from = vector_size(w->stack) + 1;
+    switch (kind) {
+        case NAR_OBJECT_KIND_UNKNOWN:
+            serial_write_tag(w->out, SERIAL_TAG_INVALID);
+            return true;
+        case NAR_OBJECT_KIND_UNIT:
+            serial_write_tag(w->out, SERIAL_TAG_UNIT);
+            return true;
+        case NAR_OBJECT_KIND_CHAR:
+            serial_write_tag(w->out, SERIAL_TAG_CHAR);
+            serial_write_varint(w->out, nar_to_char(rt, obj));
+            return true;
+        case NAR_OBJECT_KIND_INT: {
+            nar_int_t value = nar_to_int(rt, obj);
+            serial_write_tag(w->out, SERIAL_TAG_INT);
+            serial_write_varint(w->out, ((uint64_t) value << 1) ^ (uint64_t) (value >> 63));
+            return true;
+        }
+        case NAR_OBJECT_KIND_FLOAT: {
+            nar_float_t value = nar_to_float(rt, obj);
+            uint64_t bits;
+            memcpy(&bits, &value, sizeof(bits));
+            serial_write_tag(w->out, SERIAL_TAG_FLOAT);
+            serial_write_u64(w->out, bits, 8);
+            return true;
+        }
+        case NAR_OBJECT_KIND_STRING:
+            serial_write_string(w, obj);
+            return true;
+        case NAR_OBJECT_KIND_FUNCTION:
+        case NAR_OBJECT_KIND_NATIVE:
+            nar_fail(rt, "function and native objects cannot be serialized");
+            return false;
+        default:
+            break;
+    }
+
+    const serial_memo_t *written = serial_written(w, obj);
+    if (written != NULL) {
+        serial_write_tag(w->out, SERIAL_TAG_REF);
+        serial_write_varint(w->out, written->node);
+        return true;
+    }
+    switch (kind) {
+        case NAR_OBJECT_KIND_RECORD:
+            emit.tag = SERIAL_TAG_RECORD;
+            vector_push(w->stack, 1, &emit);
+            while (nar_index_is_valid(rt, obj) && serial_written(w, obj) == NULL) {
+                nar_record_item_t item = nar_to_record_item(rt, obj);
+                serial_push_child(w, item.key);
+                serial_push_child(w, item.value);
+                obj = item.parent;
+            }
+            serial_sequence_end(w, from, 2, obj);
+            break;
+        case NAR_OBJECT_KIND_LIST:
+        case NAR_OBJECT_KIND_TUPLE:
+            emit.tag = kind == NAR_OBJECT_KIND_LIST ? SERIAL_TAG_LIST : SERIAL_TAG_TUPLE;
+            vector_push(w->stack, 1, &emit);
+            while (nar_index_is_valid(rt, obj) && serial_written(w, obj) == NULL) {
+                nar_list_item_t item = *(nar_list_item_t *) find(rt, kind, obj);
+                serial_push_child(w, item.value);
+                obj = item.next;
+            }
+            serial_sequence_end(w, from, 1, obj);
+            break;
+        case NAR_OBJECT_KIND_OPTION: {
+            nar_option_item_t item = nar_to_option_item(rt, obj);
+            emit.tag = SERIAL_TAG_OPTION;
+            vector_push(w->stack, 1, &emit);
+            serial_push_child(w, item.name);
+            serial_push_child(w, item.values);
+            break;
+        }
+        case NAR_OBJECT_KIND_CLOSURE: {
+            nar_closure_t item = nar_to_closure(rt, obj);
+            emit.tag = SERIAL_TAG_CLOSURE;
+            emit.arg = item.fn_index;
+            vector_push(w->stack, 1, &emit);
+            serial_push_child(w, item.curried);
+            break;
+        }
+        case NAR_OBJECT_KIND_PATTERN: {
+            nar_pattern_t item = nar_to_pattern(rt, obj);
+            emit.tag = SERIAL_TAG_PATTERN;
+            emit.arg = item.kind;
+            vector_push(w->stack, 1, &emit);
+            serial_push_child(w, item.name);
+            serial_push_child(w, item.values);
+            break;
+        }
+        default:
+            nar_fail(rt, "unknown object kind");
+            return false;
+    }
+    if (vector_size(w->stack) > from) {
+        serial_reverse_children(w, from);
+    }
+    return true;
+}
+
+// writes tag of composite object after its children and numbers written nodes
+void serial_emit(serial_writer_t *w, const serial_entry_t *entry) {
+    serial_write_tag(w->out, entry->tag);
+    if (entry->tag != SERIAL_TAG_OPTION) {
+        serial_write_varint(w->out, entry->arg);
+    }
+    if (w->memo == NULL) {
+        return;
+    }
+    nar_object_t node = entry->obj;
+    size_t num_nodes = entry->num_cells;
+    if (entry->tag != SERIAL_TAG_RECORD && entry->tag != SERIAL_TAG_LIST &&
+            entry->tag != SERIAL_TAG_TUPLE) {
+        num_nodes = 1;
+    }
+    for (size_t i = 0; i < num_nodes; i++) {
+        hashmap_set(w->memo, &(serial_memo_t) {.obj = node, .node = w->num_nodes++});
+        if (i + 1 < num_nodes) {
+            node = serial_next_cell(w->rt, node);
+        }
+    }
+}
+
+// passes buffered output to the write callback, returns false if it fails
+nar_bool_t serial_flush(serial_writer_t *w) {
+    nar_bool_t ok = vector_size(w->out) == 0 ||
+            w->write(w->write_ctx, vector_data(w->out), vector_size(w->out));
+    vector_clear(w->out);
+    if (!ok) {
+        nar_fail(w->rt, "failed to write serialized object");
+    }
+    return ok;
+}
+
+nar_bool_t serial_write_object(serial_writer_t *w, nar_object_t obj, nar_size_t flags) {
+    runtime_t *r = w->rt;
+    w->stack = rt_vector_new(r, sizeof(serial_entry_t), 16);
+    w->string_index = allocator_hashmap_new(&r->allocator, sizeof(string_hast_t), 0,
+            &string_hast_hash, &string_hast_compare, NULL);
+    w->strings = rt_vector_new(r, sizeof(string_hast_t), 16);
+    if (flags & NAR_SERIALIZE_SHARED) {
+        w->memo = allocator_hashmap_new(&r->allocator, sizeof(serial_memo_t), 0,
+                &serial_memo_hash, &serial_memo_compare, NULL);
+    }
+    vector_push(w->out, 4, SERIAL_MAGIC);
+    serial_write_u64(w->out, SERIAL_VERSION, 2);
+    serial_write_u64(w->out, flags, 2);
+    serial_write_u64(w->out, 0, 8);
+    serial_write_u64(w->out, 0, 8);
+
+    nar_bool_t ok = true;
+    serial_push_child(w, obj);
+    while (ok && vector_size(w->stack) > 0) {
+        serial_entry_t entry;
+        vector_pop(w->stack, 1, &entry);
+        if (!entry.emit) {
+            ok = serial_visit(w, entry.obj);
+        } else {
+            serial_emit(w, &entry);
+        }
+        if (ok && w->write != NULL && vector_size(w->out) >= SERIAL_CHUNK_SIZE) {
+            ok = serial_flush(w);
+        }
+    }
+
+    if (ok && w->write != NULL) {
+        serial_write_tag(w->out, SERIAL_TAG_END);
+        ok = serial_flush(w);
+    } else if (ok) {
+        serial_patch_u64(w->out, 16, vector_size(w->out));
+        serial_write_varint(w->out, vector_size(w->strings));
+        for (string_hast_t *it = vector_begin(w->strings); it != vector_end(w->strings); it++) {
+            serial_write_varint(w->out, it->length);
+            vector_push(w->out, it->length, it->string);
+        }
+        serial_patch_u64(w->out, 8, vector_size(w->out));
+    }
+    vector_free(w->stack);
+    hashmap_free(w->string_index);
+    vector_free(w->strings);
+    if (w->memo != NULL) {
+        hashmap_free(w->memo);
+    }
+    return ok;
+}
+
+nar_serialized_object_t nar_new_serialized_object_v2(
+        nar_runtime_t rt, nar_object_t obj, nar_serialize_flags_t flags) {
+    serial_writer_t w = {.rt = (runtime_t *) rt, .out = rvector_new(sizeof(nar_byte_t), 256)};
+    nar_serialized_object_t data = NULL;
+    if (serial_write_object(&w, obj, flags)) {
+        data = w.out->data;
+        w.out->data = NULL;
+    }
+    vector_free(w.out);
+    return data;
+}
+
+nar_bool_t nar_serialize_to_writer(nar_runtime_t rt, nar_object_t obj,
+        nar_serialize_flags_t flags, nar_serialize_write_fn_t write, nar_ptr_t ctx) {
+    runtime_t *r = (runtime_t *) rt;
+    serial_writer_t w = {
+            .rt = r,
+            .out = rt_vector_new(r, sizeof(nar_byte_t), SERIAL_CHUNK_SIZE + 256),
+            .write = write,
+            .write_ctx = ctx,
+    };
+    nar_bool_t ok = serial_write_object(&w, obj, flags | SERIAL_FLAG_STREAM);
+    vector_free(w.out);
+    return ok;
+}
+
+nar_bool_t serial_fd_write(nar_ptr_t ctx, nar_cptr_t data, nar_size_t size) {
+#ifdef NAR_SERIAL_FD
+    int fd = *(int *) ctx;
+    const nar_byte_t *bytes = data;
+    while (size > 0) {
+        ssize_t written = write(fd, bytes, size);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return false;
+        }
+        bytes += written;
+        size -= written;
+    }
+    return true;
+#else
+    (void) ctx;
+    (void) data;
+    (void) size;
+    return false;
+#endif
+}
+
+nar_bool_t nar_serialize_to_fd(
+        nar_runtime_t rt, nar_object_t obj, nar_serialize_flags_t flags, int fd) {
+    return nar_serialize_to_writer(rt, obj, flags, &serial_fd_write, &fd);
+}
+
+typedef struct {
+    const nar_byte_t *data;
+    size_t offset;
+    size_t end;
+} serial_reader_t;
+
+typedef struct {
+    runtime_t *rt;
+    vector_t *stack; // of nar_object_t
+    vector_t *strings; // of nar_object_t
+    vector_t *nodes; // of nar_object_t, NULL if structure is not shared
+} serial_loader_t;
+
+nar_bool_t serial_read_varint(serial_reader_t *r, uint64_t *value) {
+    *value = 0;
+    for (size_t shift = 0; shift < 64 && r->offset < r->end; shift += 7) {
+        nar_byte_t byte = r->data[r->offset++];
+        *value |= (uint64_t) (byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+uint64_t serial_read_u64(const nar_byte_t *data, size_t size) {
+    uint64_t value = 0;
+    for (size_t i = 0; i < size; i++) {
+        value |= (uint64_t) data[i] << (i * 8);
+    }
+    return value;
+}
+
+nar_size_t nar_serialized_object_size(nar_serialized_object_t obj) {
+    const nar_byte_t *data = obj;
+    if (data == NULL || memcmp(data, SERIAL_MAGIC, 4) != 0 ||
+            serial_read_u64(data + 4, 2) != SERIAL_VERSION) {
+        return 0;
+    }
+    return serial_read_u64(data + 8, 8);
+}
+
+// reads string table into interned string objects
+nar_bool_t serial_read_strings(serial_loader_t *l, serial_reader_t *r) {
+    uint64_t count;
+    if (!serial_read_varint(r, &count)) {
+        return false;
+    }
+    for (uint64_t i = 0; i < count; i++) {
+        uint64_t length;
+        if (!serial_read_varint(r, &length) || length > r->end - r->offset) {
+            return false;
+        }
+        nar_object_t str = string_intern(l->rt, nar_make_transient_string_len(
+                l->rt, (nar_cstring_t) r->data + r->offset, length));
+        vector_push(l->strings, 1, &str);
+        r->offset += length;
+    }
+    return true;
+}
+
+// builds `num_cells` cells of a sequence on top of `tail`
+nar_object_t serial_build_sequence(
+        serial_loader_t *l, serial_tag_t tag, size_t num_cells, const nar_object_t *children,
+        nar_object_t tail) {
+    nar_object_t result = tail;
+    for (size_t i = num_cells; i > 0; i--) {
+        switch (tag) {
+            case SERIAL_TAG_RECORD:
+                result = nar_make_record_field_obj(
+                        l->rt, result, children[2 * i - 2], children[2 * i - 1]);
+                break;
+            case SERIAL_TAG_LIST:
+                result = nar_make_list_cons(l->rt, children[i - 1], result);
+                break;
+            default:
+                result = nar_make_tuple_item(l->rt, children[i - 1], result);
+                break;
+        }
+    }
+    if (l->nodes != NULL) {
+        nar_object_t cell = result;
+        for (size_t i = 0; i < num_cells; i++) {
+            vector_push(l->nodes, 1, &cell);
+            if (i + 1 < num_cells) {
+                cell = serial_next_cell(l->rt, cell);
+            }
+        }
+    }
+    return result;
+}
+
+// builds composite object from its children on top of the stack
+// value lists of options, closures and patterns may be empty
+nar_bool_t serial_is_list(nar_object_t obj) {
+    return obj == NAR_INVALID_OBJECT || nar_object_get_kind(NULL, obj) == NAR_OBJECT_KIND_LIST;
+}
+
+nar_bool_t serial_build(
+        serial_loader_t *l, serial_tag_t tag, uint64_t arg, nar_object_t *result) {
+    vector_t *stack = l->stack;
+    nar_bool_t has_tail = false;
+    size_t num_children;
+    switch (tag) {
+        case SERIAL_TAG_RECORD:
+        case SERIAL_TAG_LIST:
+        case SERIAL_TAG_TUPLE:
+            if (l->nodes != NULL) {
+                has_tail = arg & 1;
+                arg >>= 1;
+            }
+            if (arg > vector_size(stack)) {
+                return false;
+            }
+            num_children = (tag == SERIAL_TAG_RECORD ? arg * 2 : arg) + has_tail;
+            break;
+        case SERIAL_TAG_CLOSURE:
+            num_children = 1;
+            if (arg >= l->rt->program->num_functions) {
+                return false;
+            }
+            break;
+        case SERIAL_TAG_PATTERN:
+            num_children = 2;
+            if (arg == PATTERN_KIND_NONE || arg > PATTERN_KIND_TUPLE) {
+                return false;
+            }
+            break;
+        default:
+            num_children = 2;
+            break;
+    }
+    if (num_children > vector_size(stack)) {
+        return false;
+    }
+    nar_object_t *children = vector_data(stack);
+    children += vector_size(stack) - num_children;
+    switch (tag) {
+        case SERIAL_TAG_RECORD:
+        case SERIAL_TAG_LIST:
+        case SERIAL_TAG_TUPLE: {
+            nar_object_kind_t kind = tag == SERIAL_TAG_RECORD ? NAR_OBJECT_KIND_RECORD
+                    : tag == SERIAL_TAG_LIST ? NAR_OBJECT_KIND_LIST : NAR_OBJECT_KIND_TUPLE;
+            nar_object_t tail = build_object(kind, NAR_INVALID_INDEX);
+            if (has_tail) {
+                tail = children[num_children - 1];
+                if (nar_object_get_kind(l->rt, tail) != kind) {
+                    return false;
+                }
+            }
+            *result = serial_build_sequence(l, tag, arg, children, tail);
+            break;
+        }
+        case SERIAL_TAG_OPTION:
+            if (nar_object_get_kind(l->rt, children[0]) != NAR_OBJECT_KIND_STRING ||
+                    !nar_index_is_valid(l->rt, children[0]) || !serial_is_list(children[1])) {
+                return false;
+            }
+            *result = nar_make_option_with_list(l->rt, children[0], children[1]);
+            break;
+        case SERIAL_TAG_CLOSURE:
+            if (!serial_is_list(children[0])) {
+                return false;
+            }
+            *result = nar_make_closure_with_list(l->rt, arg, children[0]);
+            break;
+        case SERIAL_TAG_PATTERN:
+            if (!serial_is_list(children[1])) {
+                return false;
+            }
+            *result = nar_make_pattern_with_list(l->rt, arg, children[0], children[1]);
+            break;
+        default:
+            return false;
+    }
+    if (*result == NAR_INVALID_OBJECT) {
+        return false;
+    }
+    if (l->nodes != NULL && tag != SERIAL_TAG_RECORD && tag != SERIAL_TAG_LIST &&
+            tag != SERIAL_TAG_TUPLE) {
+        vector_push(l->nodes, 1, result);
+    }
+    vector_pop(stack, num_children, NULL);
+    return true;
+}
+
+// reads one item and pushes its value to the stack, string definitions also extend the table
+nar_bool_t serial_load_item(serial_loader_t *l, serial_reader_t *r) {
+    runtime_t *rt = l->rt;
+    serial_tag_t tag = r->data[r->offset++];
+    nar_object_t value;
+    uint64_t arg = 0;
+    nar_bool_t ok = true;
+    switch (tag) {
+        case SERIAL_TAG_INVALID:
+            value = NAR_INVALID_OBJECT;
+            break;
+        case SERIAL_TAG_UNIT:
+            value = nar_make_unit(rt);
+            break;
+        case SERIAL_TAG_CHAR:
+            ok = serial_read_varint(r, &arg) && arg == (uint64_t) (nar_char_t) arg;
+            value = nar_make_char(rt, (nar_char_t) arg);
+            break;
+        case SERIAL_TAG_INT:
+            ok = serial_read_varint(r, &arg);
+            value = nar_make_int(rt, (nar_int_t) ((arg >> 1) ^ (0 - (arg & 1))));
+            break;
+        case SERIAL_TAG_FLOAT: {
+            ok = r->end - r->offset >= 8;
+            uint64_t bits = ok ? serial_read_u64(r->data + r->offset, 8) : 0;
+            nar_float_t f;
+            memcpy(&f, &bits, sizeof(f));
+            r->offset += ok ? 8 : 0;
+            value = nar_make_float(rt, f);
+            break;
+        }
+        case SERIAL_TAG_STRING:
+            ok = serial_read_varint(r, &arg) && arg < vector_size(l->strings);
+            value = ok ? *(nar_object_t *) vector_at(l->strings, arg) : NAR_INVALID_OBJECT;
+            break;
+        case SERIAL_TAG_STRING_DEF:
+            ok = serial_read_varint(r, &arg) && arg <= r->end - r->offset;
+            value = NAR_INVALID_OBJECT;
+            if (ok) {
+                value = string_intern(rt, nar_make_transient_string_len(
+                        rt, (nar_cstring_t) r->data + r->offset, arg));
+                vector_push(l->strings, 1, &value);
+                r->offset += arg;
+            }
+            break;
+        case SERIAL_TAG_REF:
+            ok = l->nodes != NULL && serial_read_varint(r, &arg) && arg < vector_size(l->nodes);
+            value = ok ? *(nar_object_t *) vector_at(l->nodes, arg) : NAR_INVALID_OBJECT;
+            break;
+        case SERIAL_TAG_OPTION:
+            ok = serial_build(l, tag, 0, &value);
+            break;
+        case SERIAL_TAG_RECORD:
+        case SERIAL_TAG_LIST:
+        case SERIAL_TAG_TUPLE:
+        case SERIAL_TAG_CLOSURE:
+        case SERIAL_TAG_PATTERN:
+            ok = serial_read_varint(r, &arg) && serial_build(l, tag, arg, &value);
+            break;
+        default:
+            ok = false;
+            break;
+    }
+    if (ok) {
+        vector_push(l->stack, 1, &value);
+    }
+    return ok;
+}
+
+nar_object_t nar_deserialize_object_v2(
+        nar_runtime_t rt, nar_serialized_object_t obj, nar_size_t size) {
+    runtime_t *rtm = (runtime_t *) rt;
+    const nar_byte_t *data = obj;
+    if (size >= SERIAL_HEADER_SIZE && memcmp(data, SERIAL_MAGIC, 4) == 0 &&
+            (serial_read_u64(data + 6, 2) & SERIAL_FLAG_STREAM)) {
+        nar_deserializer_t d = nar_deserializer_new(rt);
+        nar_deserializer_feed(d, obj, size);
+        return nar_deserializer_finish(d);
+    }
+    nar_size_t total = size < SERIAL_HEADER_SIZE ? 0 : nar_serialized_object_size(obj);
+    nar_size_t flags = total == 0 ? 0 : serial_read_u64(data + 6, 2);
+    nar_size_t strings_offset = total == 0 ? 0 : serial_read_u64(data + 16, 8);
+    if (total == 0 || total > size || (flags & ~(nar_size_t) NAR_SERIALIZE_SHARED) ||
+            strings_offset < SERIAL_HEADER_SIZE || strings_offset > total) {
+        nar_fail(rt, "serialized object has invalid header");
+        return NAR_INVALID_OBJECT;
+    }
+
+    serial_loader_t l = {
+            .rt = rtm,
+            .stack = rt_vector_new(rtm, sizeof(nar_object_t), 16),
+            .strings = rt_vector_new(rtm, sizeof(nar_object_t), 0),
+            .nodes = (flags & NAR_SERIALIZE_SHARED)
+                    ? rt_vector_new(rtm, sizeof(nar_object_t), 0) : NULL,
+    };
+    serial_reader_t r = {.data = data, .offset = strings_offset, .end = total};
+    nar_bool_t ok = serial_read_strings(&l, &r);
+    r = (serial_reader_t) {.data = data, .offset = SERIAL_HEADER_SIZE, .end = strings_offset};
+    while (ok && r.offset < r.end) {
+        ok = serial_load_item(&l, &r);
+    }
+
+    nar_object_t result = NAR_INVALID_OBJECT;
+    if (ok && vector_size(l.stack) == 1) {
+        vector_pop(l.stack, 1, &result);
+    } else {
+        nar_fail(rt, "serialized object is corrupted");
+    }
+    vector_free(l.stack);
+    vector_free(l.strings);
+    vector_free(l.nodes);
+    return result;
+}
+
+typedef struct {
+    serial_loader_t l;
+    vector_t *pending; // of nar_byte_t, incomplete item left from previous chunks
+    nar_bool_t has_header;
+    nar_bool_t done; // end tag is read
+    nar_bool_t failed;
+} serial_stream_t;
+
+// size of the varint at `offset`, 0 if it is not complete yet
+size_t serial_varint_size(const serial_reader_t *r, size_t offset) {
+    for (size_t i = offset; i < r->end; i++) {
+        // overlong varint is left to the decoder to reject
+        if (!(r->data[i] & 0x80) || i - offset == 9) {
+            return i - offset + 1;
+        }
+    }
+    return 0;
+}
+
+// size of the next item if all its bytes are available, 0 otherwise
+size_t serial_item_size(const serial_reader_t *r) {
+    size_t offset = r->offset + 1;
+    switch (r->data[r->offset]) {
+        case SERIAL_TAG_INVALID:
+        case SERIAL_TAG_UNIT:
+        case SERIAL_TAG_OPTION:
+        case SERIAL_TAG_END:
+            return 1;
+        case SERIAL_TAG_FLOAT:
+            return r->end - offset >= 8 ? 9 : 0;
+        case SERIAL_TAG_STRING_DEF: {
+            size_t size = serial_varint_size(r, offset);
+            if (size == 0) {
+                return 0;
+            }
+            serial_reader_t length = {.data = r->data, .offset = offset, .end = r->end};
+            uint64_t value;
+            if (!serial_read_varint(&length, &value)) {
+                return size + 1;
+            }
+            return value <= r->end - offset - size ? size + 1 + value : 0;
+        }
+        default: {
+            size_t size = serial_varint_size(r, offset);
+            return size == 0 ? 0 : size + 1;
+        }
+    }
+}
+
+// validates stream header, returns false if it is not a streamed object
+nar_bool_t serial_stream_header(serial_stream_t *s, const nar_byte_t *data) {
+    nar_size_t flags = serial_read_u64(data + 6, 2);
+    if (memcmp(data, SERIAL_MAGIC, 4) != 0 || serial_read_u64(data + 4, 2) != SERIAL_VERSION ||
+            !(flags & SERIAL_FLAG_STREAM) ||
+            (flags & ~(nar_size_t) (NAR_SERIALIZE_SHARED | SERIAL_FLAG_STREAM))) {
+        return false;
+    }
+    if (flags & NAR_SERIALIZE_SHARED) {
+        s->l.nodes = rt_vector_new(s->l.rt, sizeof(nar_object_t), 0);
+    }
+    s->has_header = true;
+    return true;
+}
+
+nar_deserializer_t nar_deserializer_new(nar_runtime_t rt) {
+    runtime_t *r = (runtime_t *) rt;
+    serial_stream_t *s = rt_alloc(r, sizeof(serial_stream_t));
+    memset(s, 0, sizeof(serial_stream_t));
+    s->l.rt = r;
+    s->l.stack = rt_vector_new(r, sizeof(nar_object_t), 16);
+    s->l.strings = rt_vector_new(r, sizeof(nar_object_t), 0);
+    s->pending = rt_vector_new(r, sizeof(nar_byte_t), 0);
+    return s;
+}
+
+nar_bool_t nar_deserializer_feed(nar_deserializer_t d, nar_cptr_t data, nar_size_t size) {
+    serial_stream_t *s = d;
+    if (s->failed) {
+        return false;
+    }
+    serial_reader_t r = {.data = data, .offset = 0, .end = size};
+    nar_bool_t buffered = vector_size(s->pending) > 0;
+    if (buffered) {
+        vector_push(s->pending, size, data);
+        r = (serial_reader_t) {.data = vector_data(s->pending), .end = vector_size(s->pending)};
+    }
+    nar_bool_t ok = true;
+    if (!s->has_header && r.end >= SERIAL_HEADER_SIZE) {
+        ok = serial_stream_header(s, r.data);
+        r.offset = SERIAL_HEADER_SIZE;
+    }
+    while (ok && s->has_header && r.offset < r.end) {
+        if (s->done) {
+            ok = false;
+            break;
+        }
+        size_t item_size = serial_item_size(&r);
+        if (item_size == 0) {
+            break;
+        }
+        if (r.data[r.offset] == SERIAL_TAG_END) {
+            s->done = true;
+            r.offset++;
+            continue;
+        }
+        serial_reader_t item = {.data = r.data, .offset = r.offset, .end = r.offset + item_size};
+        ok = serial_load_item(&s->l, &item) && item.offset == item.end;
+        r.offset += item_size;
+    }
+    if (!ok) {
+        s->failed = true;
+        nar_fail(s->l.rt, "serialized object is corrupted");
+        return false;
+    }
+
+    size_t rest = r.end - r.offset;
+    if (buffered) {
+        memmove(vector_data(s->pending), r.data + r.offset, rest);
+        vector_pop(s->pending, r.offset, NULL);
+    } else {
+        vector_push(s->pending, rest, r.data + r.offset);
+    }
+    return true;
+}
+
+nar_object_t nar_deserializer_finish(nar_deserializer_t d) {
+    serial_stream_t *s = d;
+    nar_object_t result = NAR_INVALID_OBJECT;
+    if (!s->failed) {
+        if (s->done && vector_size(s->l.stack) == 1) {
+            vector_pop(s->l.stack, 1, &result);
+        } else {
+            nar_fail(s->l.rt, "serialized object is incomplete");
+        }
+    }
+    runtime_t *rt = s->l.rt;
+    vector_free(s->l.stack);
+    vector_free(s->l.strings);
+    vector_free(s->l.nodes);
+    vector_free(s->pending);
+    rt_free(rt, s);
+    return result;
+}
+
+nar_object_t nar_deserialize_from_fd(nar_runtime_t rt, int fd) {
+#ifdef NAR_SERIAL_FD
+    nar_byte_t *chunk = rt_alloc((runtime_t *) rt, SERIAL_CHUNK_SIZE);
+    nar_deserializer_t d = nar_deserializer_new(rt);
+    nar_bool_t ok = true;
+    while (ok) {
+        ssize_t size = read(fd, chunk, SERIAL_CHUNK_SIZE);
+        if (size < 0 && errno == EINTR) {
+            continue;
+        }
+        if (size < 0) {
+            nar_fail(rt, "failed to read serialized object");
+            ((serial_stream_t *) d)->failed = true;
+        }
+        if (size <= 0) {
+            break;
+        }
+        ok = nar_deserializer_feed(d, chunk, size);
+    }
+    rt_free((runtime_t *) rt, chunk);
+    return nar_deserializer_finish(d);
+#else
+    (void) fd;
+    nar_fail(rt, "file descriptors are not supported on this platform");
+    return NAR_INVALID_OBJECT;
+#endif
+}
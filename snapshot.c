@@ -0,0 +1,460 @@
+#if defined (__unix__) || defined (__APPLE__)
+#define NAR_SNAPSHOT_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include "include/nar-runtime.h"
+#include "runtime.h"
+
+// Snapshots keep an object graph in a file laid out as runtime items, so an attached snapshot
+// is used in place: objects carry INDEX_FLAG_SNAPSHOT and the index of their item in the section
+// of their kind, children refer to each other the same way, so sections need no relocation.
+// Strings are stored once with their hash; attaching only builds string headers pointing into
+// the mapping and the lookup table of snapshot strings.
+//
+// The file is in native byte order and item layout and is rejected by a runtime built otherwise.
+// Objects of the snapshot stay valid until it is detached.
+
+#define SNAPSHOT_MAGIC "NARM"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_BYTE_ORDER 0x01020304
+
+typedef struct {
+    uint64_t offset; // of string data in the string data section
+    uint64_t length;
+    uint64_t hash;
+    uint64_t flags;
+} snapshot_string_t;
+
+typedef struct {
+    uint64_t offset;
+    uint64_t count;
+    uint64_t item_size;
+} snapshot_section_t;
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t num_kinds;
+    uint64_t size;
+    nar_object_t root;
+    uint64_t string_data_offset;
+    uint64_t string_data_size;
+    snapshot_section_t sections[NAR_OBJECT_KIND__COUNT]; // string section of snapshot_string_t
+} snapshot_header_t;
+
+typedef struct {
+    runtime_t *rt;
+    vector_t *items[NAR_OBJECT_KIND__COUNT]; // of runtime items, strings of snapshot_string_t
+    hashmap_t *string_index; // of string_hast_t, data points to the source string
+    vector_t *string_data; // of char
+    nar_bool_t ok;
+} snapshot_writer_t;
+
+nar_object_t snapshot_object(nar_object_kind_t kind, size_t index) {
+    return build_object(kind, INDEX_FLAG_SNAPSHOT | index);
+}
+
+nar_object_t snapshot_copy_string(snapshot_writer_t *w, nar_object_t obj) {
+    size_t index = object_get_index(obj);
+    if ((index & INDEX_FLAG_PERMANENT) && (index & ~INDEX_FLAG_PERMANENT) <= STRING_INDEX_TRUE) {
+        return obj; // empty string and bool option names are the same in every runtime
+    }
+    string_header_t *header = string_header(w->rt, obj);
+    if (header == NULL) {
+        w->ok = false;
+        return NAR_INVALID_OBJECT;
+    }
+    uint64_t hash = string_header_hash(header);
+    string_hast_t key = {.string = header->data, .length = header->length};
+    const string_hast_t *found = hashmap_get_with_hash(w->string_index, &key, hash);
+    if (found != NULL) {
+        return found->index;
+    }
+    vector_t *strings = w->items[NAR_OBJECT_KIND_STRING];
+    snapshot_string_t item = {
+            .offset = vector_size(w->string_data),
+            .length = header->length,
+            .hash = hash,
+            .flags = STRING_FLAG_HASHED | (header->flags & STRING_FLAG_ASCII),
+    };
+    vector_push(w->string_data, header->length, header->data);
+    vector_push(w->string_data, 1, "");
+    key.index = snapshot_object(NAR_OBJECT_KIND_STRING, vector_size(strings));
+    vector_push(strings, 1, &item);
+    hashmap_set_with_hash(w->string_index, &key, hash);
+    return key.index;
+}
+
+copy_resolve_t snapshot_resolve(void *ctx, nar_object_t obj, nar_object_t *copy) {
+    snapshot_writer_t *w = ctx;
+    switch (nar_object_get_kind(w->rt, obj)) {
+        case NAR_OBJECT_KIND_UNIT:
+            *copy = obj;
+            return COPY_RESOLVED;
+        case NAR_OBJECT_KIND_FUNCTION:
+        case NAR_OBJECT_KIND_NATIVE:
+            nar_fail(w->rt, "function and native objects cannot be written to snapshot");
+            return COPY_FAILED;
+        case NAR_OBJECT_KIND_STRING:
+            *copy = snapshot_copy_string(w, obj);
+            return w->ok ? COPY_RESOLVED : COPY_FAILED;
+        default:
+            return COPY_ITEM;
+    }
+}
+
+nar_object_t snapshot_insert(void *ctx, nar_object_kind_t kind, void *item) {
+    vector_t *items = ((snapshot_writer_t *) ctx)->items[kind];
+    nar_object_t copy = snapshot_object(kind, vector_size(items));
+    vector_push(items, 1, item);
+    return copy;
+}
+
+size_t snapshot_align(size_t offset) {
+    return (offset + 7) & ~(size_t) 7;
+}
+
+nar_bool_t snapshot_write_at(FILE *f, size_t offset, const void *data, size_t size) {
+    return size == 0 || (fseek(f, (long) offset, SEEK_SET) == 0 && fwrite(data, size, 1, f) == 1);
+}
+
+nar_bool_t nar_snapshot_write(nar_runtime_t rt, nar_object_t obj, nar_cstring_t path) {
+    runtime_t *r = (runtime_t *) rt;
+    snapshot_writer_t w = {
+            .rt = r,
+            .string_index = allocator_hashmap_new(&r->allocator, sizeof(string_hast_t), 0,
+                    &string_hast_hash, &string_hast_compare, NULL),
+            .string_data = rt_vector_new(r, sizeof(char), 0),
+            .ok = true,
+    };
+    for (size_t i = 0; i < NAR_OBJECT_KIND__COUNT; i++) {
+        size_t item_size = i == NAR_OBJECT_KIND_STRING ? sizeof(snapshot_string_t)
+                : r->arenas[i] == NULL ? 0 : r->arenas[i]->item_size;
+        if (item_size != 0) {
+            w.items[i] = rt_vector_new(r, item_size, 0);
+        }
+    }
+    snapshot_header_t header = {
+            .magic = SNAPSHOT_MAGIC,
+            .version = SNAPSHOT_VERSION,
+            .byte_order = SNAPSHOT_BYTE_ORDER,
+            .num_kinds = NAR_OBJECT_KIND__COUNT,
+            .root = copy_walk(&(copy_walk_t) {
+                    .src = r,
+                    .ctx = &w,
+                    .resolve = &snapshot_resolve,
+                    .insert = &snapshot_insert,
+            }, obj),
+    };
+    w.ok = w.ok && (header.root != NAR_INVALID_OBJECT || obj == NAR_INVALID_OBJECT);
+
+    FILE *f = NULL;
+    if (w.ok) {
+        f = fopen(path, "wb");
+        w.ok = f != NULL;
+        if (!w.ok) {
+            nar_fail(rt, "failed to create snapshot file");
+        }
+    }
+    size_t offset = sizeof(snapshot_header_t);
+    for (size_t i = 0; w.ok && i < NAR_OBJECT_KIND__COUNT; i++) {
+        if (w.items[i] == NULL) {
+            continue;
+        }
+        offset = snapshot_align(offset);
+        header.sections[i] = (snapshot_section_t) {
+                .offset = offset,
+                .count = vector_size(w.items[i]),
+                .item_size = w.items[i]->item_size,
+        };
+        size_t size = vector_size(w.items[i]) * w.items[i]->item_size;
+        w.ok = snapshot_write_at(f, offset, vector_data(w.items[i]), size);
+        offset += size;
+    }
+    if (w.ok) {
+        header.string_data_offset = offset;
+        header.string_data_size = vector_size(w.string_data);
+        header.size = offset + header.string_data_size;
+        w.ok = snapshot_write_at(f, offset, vector_data(w.string_data), header.string_data_size) &&
+                snapshot_write_at(f, 0, &header, sizeof(header));
+        if (!w.ok) {
+            nar_fail(rt, "failed to write snapshot file");
+        }
+    }
+    if (f != NULL && fclose(f) != 0 && w.ok) {
+        w.ok = false;
+        nar_fail(rt, "failed to write snapshot file");
+    }
+
+    hashmap_free(w.string_index);
+    vector_free(w.string_data);
+    for (size_t i = 0; i < NAR_OBJECT_KIND__COUNT; i++) {
+        vector_free(w.items[i]);
+    }
+    return w.ok;
+}
+
+// maps (or reads where mmap is not available) the whole file, returns NULL on failure
+nar_byte_t *snapshot_map(runtime_t *rt, nar_cstring_t path, size_t *size) {
+#ifdef NAR_SNAPSHOT_MMAP
+    (void) rt;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    void *data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        *size = st.st_size;
+        data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    return data == MAP_FAILED ? NULL : data;
+#else
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        return NULL;
+    }
+    nar_byte_t *data = NULL;
+    if (fseek(f, 0, SEEK_END) == 0) {
+        long length = ftell(f);
+        if (length > 0 && fseek(f, 0, SEEK_SET) == 0) {
+            *size = length;
+            data = rt_alloc(rt, *size);
+            if (fread(data, *size, 1, f) != 1) {
+                rt_free(rt, data);
+                data = NULL;
+            }
+        }
+    }
+    fclose(f);
+    return data;
+#endif
+}
+
+void snapshot_unmap(runtime_t *rt, nar_byte_t *data, size_t size) {
+#ifdef NAR_SNAPSHOT_MMAP
+    (void) rt;
+    munmap(data, size);
+#else
+    (void) size;
+    rt_free(rt, data);
+#endif
+}
+
+nar_bool_t snapshot_check(runtime_t *rt, const nar_byte_t *data, size_t size) {
+    const snapshot_header_t *header = (const snapshot_header_t *) data;
+    if (size < sizeof(snapshot_header_t) || memcmp(header->magic, SNAPSHOT_MAGIC, 4) != 0 ||
+            header->version != SNAPSHOT_VERSION || header->byte_order != SNAPSHOT_BYTE_ORDER ||
+            header->num_kinds != NAR_OBJECT_KIND__COUNT || header->size != size ||
+            header->string_data_offset > size ||
+            header->string_data_size > size - header->string_data_offset) {
+        return false;
+    }
+    for (size_t i = 0; i < NAR_OBJECT_KIND__COUNT; i++) {
+        const snapshot_section_t *s = &header->sections[i];
+        size_t item_size = i == NAR_OBJECT_KIND_STRING ? sizeof(snapshot_string_t)
+                : rt->arenas[i] == NULL ? 0 : rt->arenas[i]->item_size;
+        if (s->count == 0) {
+            continue;
+        }
+        if (item_size == 0 || s->item_size != item_size || s->offset % 8 != 0 || s->offset > size ||
+                s->count > (size - s->offset) / item_size) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// checks that object stored in snapshot refers only to snapshot items, permanent bool and empty
+// strings or objects without items
+nar_bool_t snapshot_check_object(const snapshot_t *s, nar_object_t obj) {
+    if (obj == NAR_INVALID_OBJECT || (obj & NAR_INVALID_INDEX)) {
+        return true;
+    }
+    nar_object_kind_t kind = nar_object_get_kind(NULL, obj);
+    size_t index = object_get_index(obj);
+    if (kind == NAR_OBJECT_KIND_UNIT) {
+        return true;
+    }
+    if (kind >= NAR_OBJECT_KIND__COUNT || s->items[kind] == NULL) {
+        return false;
+    }
+    if (object_is_immediate(obj)) {
+        return kind == NAR_OBJECT_KIND_OPTION && snapshot_check_object(s,
+                build_object(NAR_OBJECT_KIND_STRING, (index & ~INDEX_FLAG_IMMEDIATE)));
+    }
+    if (kind == NAR_OBJECT_KIND_STRING && (index & INDEX_FLAG_PERMANENT)) {
+        return (index & ~INDEX_FLAG_PERMANENT) <= STRING_INDEX_TRUE;
+    }
+    return (index & INDEX_FLAG_SNAPSHOT) && (index & ~INDEX_FLAG_SNAPSHOT) < s->counts[kind];
+}
+
+typedef struct {
+    const snapshot_t *snapshot;
+    nar_bool_t ok;
+} snapshot_check_t;
+
+void snapshot_check_child(void *ctx, nar_object_t *slot) {
+    snapshot_check_t *c = ctx;
+    c->ok = c->ok && snapshot_check_object(c->snapshot, *slot);
+}
+
+nar_bool_t snapshot_is_kind(nar_object_t obj, nar_object_kind_t kind, nar_bool_t may_be_empty) {
+    if (may_be_empty && (obj == NAR_INVALID_OBJECT || (obj & NAR_INVALID_INDEX))) {
+        return obj == NAR_INVALID_OBJECT || nar_object_get_kind(NULL, obj) == kind;
+    }
+    return nar_object_get_kind(NULL, obj) == kind && !(obj & NAR_INVALID_INDEX);
+}
+
+// checks kinds of children that runtime reads without checking (keys, names and list links)
+nar_bool_t snapshot_check_item_kinds(runtime_t *rt, nar_object_kind_t kind, const void *item) {
+    switch (kind) {
+        case NAR_OBJECT_KIND_RECORD: {
+            const nar_record_item_t *field = item;
+            return snapshot_is_kind(field->key, NAR_OBJECT_KIND_STRING, false) &&
+                    snapshot_is_kind(field->parent, NAR_OBJECT_KIND_RECORD, true);
+        }
+        case NAR_OBJECT_KIND_LIST:
+            return snapshot_is_kind(((const nar_list_item_t *) item)->next,
+                    NAR_OBJECT_KIND_LIST, true);
+        case NAR_OBJECT_KIND_TUPLE:
+            return snapshot_is_kind(((const nar_tuple_item_t *) item)->next,
+                    NAR_OBJECT_KIND_TUPLE, true);
+        case NAR_OBJECT_KIND_OPTION: {
+            const nar_option_item_t *option = item;
+            return snapshot_is_kind(option->name, NAR_OBJECT_KIND_STRING, false) &&
+                    snapshot_is_kind(option->values, NAR_OBJECT_KIND_LIST, true);
+        }
+        case NAR_OBJECT_KIND_CLOSURE: {
+            const nar_closure_t *closure = item;
+            return rt->program != NULL && closure->fn_index < rt->program->num_functions &&
+                    snapshot_is_kind(closure->curried, NAR_OBJECT_KIND_LIST, true);
+        }
+        case NAR_OBJECT_KIND_PATTERN: {
+            const nar_pattern_t *pattern = item;
+            return snapshot_is_kind(pattern->name, NAR_OBJECT_KIND_STRING, true) &&
+                    snapshot_is_kind(pattern->values, NAR_OBJECT_KIND_LIST, true);
+        }
+        default:
+            return true;
+    }
+}
+
+// checks that every child of every item and the root are valid snapshot objects, so `find`
+// never meets an index out of the snapshot
+nar_bool_t snapshot_check_items(runtime_t *rt, const snapshot_t *s, nar_object_t root) {
+    snapshot_check_t c = {.snapshot = s, .ok = true};
+    for (size_t kind = 0; kind < NAR_OBJECT_KIND__COUNT; kind++) {
+        if (kind == NAR_OBJECT_KIND_STRING || s->items[kind] == NULL) {
+            continue;
+        }
+        size_t item_size = rt->arenas[kind]->item_size;
+        nar_byte_t item[64];
+        for (size_t i = 0; c.ok && i < s->counts[kind]; i++) {
+            memcpy(item, s->items[kind] + i * item_size, item_size);
+            object_visit_children(kind, item, &c, &snapshot_check_child);
+            c.ok = c.ok && snapshot_check_item_kinds(rt, kind, item);
+        }
+    }
+    return c.ok && snapshot_check_object(s, root);
+}
+
+nar_object_t nar_snapshot_attach(nar_runtime_t rt, nar_cstring_t path) {
+    runtime_t *r = (runtime_t *) rt;
+    if (r->snapshot != NULL) {
+        nar_fail(rt, "snapshot is already attached");
+        return NAR_INVALID_OBJECT;
+    }
+    size_t size = 0;
+    nar_byte_t *data = snapshot_map(r, path, &size);
+    if (data == NULL) {
+        nar_fail(rt, "failed to open snapshot file");
+        return NAR_INVALID_OBJECT;
+    }
+    if (!snapshot_check(r, data, size)) {
+        snapshot_unmap(r, data, size);
+        nar_fail(rt, "snapshot file is corrupted or was written by incompatible runtime");
+        return NAR_INVALID_OBJECT;
+    }
+
+    const snapshot_header_t *header = (const snapshot_header_t *) data;
+    snapshot_t *s = rt_alloc(r, sizeof(snapshot_t));
+    memset(s, 0, sizeof(snapshot_t));
+    s->data = data;
+    s->size = size;
+    for (size_t i = 0; i < NAR_OBJECT_KIND__COUNT; i++) {
+        if (header->sections[i].count != 0) {
+            s->items[i] = data + header->sections[i].offset;
+            s->counts[i] = header->sections[i].count;
+        }
+    }
+
+    size_t num_strings = s->counts[NAR_OBJECT_KIND_STRING];
+    const snapshot_string_t *strings = (const snapshot_string_t *) s->items[NAR_OBJECT_KIND_STRING];
+    const char *string_data = (const char *) data + header->string_data_offset;
+    s->strings = rt_alloc(r, num_strings * sizeof(string_header_t));
+    s->string_hashes = allocator_hashmap_new(&r->allocator, sizeof(string_hast_t), num_strings,
+            &string_hast_hash, &string_hast_compare, NULL);
+    for (size_t i = 0; i < num_strings; i++) {
+        const snapshot_string_t *str = &strings[i];
+        if (str->offset > header->string_data_size ||
+                str->length >= header->string_data_size - str->offset ||
+                string_data[str->offset + str->length] != 0) {
+            r->snapshot = s;
+            nar_snapshot_detach(rt);
+            nar_fail(rt, "snapshot file is corrupted or was written by incompatible runtime");
+            return NAR_INVALID_OBJECT;
+        }
+        s->strings[i] = (string_header_t) {
+                .data = string_data + str->offset,
+                .length = str->length,
+                .hash = str->hash,
+                .flags = (uint8_t) (str->flags & (STRING_FLAG_HASHED | STRING_FLAG_ASCII)),
+        };
+        hashmap_set_with_hash(s->string_hashes, &(string_hast_t) {
+                .string = s->strings[i].data,
+                .length = str->length,
+                .index = snapshot_object(NAR_OBJECT_KIND_STRING, i),
+        }, str->hash);
+    }
+    r->snapshot = s;
+    if (!snapshot_check_items(r, s, header->root)) {
+        nar_snapshot_detach(rt);
+        nar_fail(rt, "snapshot file is corrupted or was written by incompatible runtime");
+        return NAR_INVALID_OBJECT;
+    }
+    return header->root;
+}
+
+void nar_snapshot_detach(nar_runtime_t rt) {
+    runtime_t *r = (runtime_t *) rt;
+    snapshot_t *s = r->snapshot;
+    if (s == NULL) {
+        return;
+    }
+    snapshot_unmap(r, s->data, s->size);
+    rt_free(r, s->strings);
+    hashmap_free(s->string_hashes);
+    rt_free(r, s);
+    r->snapshot = NULL;
+}
+
+void *snapshot_at(runtime_t *rt, nar_object_kind_t kind, size_t index) {
+    snapshot_t *s = rt->snapshot;
+    if (s == NULL || index >= s->counts[kind]) {
+        nar_fail(rt, "snapshot object is not attached");
+        return NULL;
+    }
+    if (kind == NAR_OBJECT_KIND_STRING) {
+        return &s->strings[index];
+    }
+    return s->items[kind] + index * rt->arenas[kind]->item_size;
+}
@@ -0,0 +1,30 @@
+#include <stdio.h>
+#include "test.h"
+
+// Bytecode rewritten to the aligned v2 format and mapped in place.
+
+static void test_bytecode_v2(const char *dir) {
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/nar-test-program.v2", dir);
+    nar_bytecode_t btc = nar_bytecode_new(test_program_size, test_program);
+    CHECK(btc != NULL && nar_bytecode_write_v2(btc, path));
+    nar_bytecode_free(btc);
+
+    nar_runtime_t rt = test_runtime_new();
+    nar_runtime_t mapped = nar_runtime_new(nar_bytecode_open_mmap(path));
+    CHECK(mapped != NULL);
+    if (mapped != NULL) {
+        test_register_natives(mapped);
+        CHECK(nar_to_int(mapped, nar_apply(mapped, "main", 0, NULL)) == 55);
+        CHECK(test_same(rt, nar_apply(rt, "rec", 0, NULL), mapped, nar_apply(mapped, "rec", 0, NULL)));
+        nar_runtime_free(mapped);
+    }
+    remove(path);
+    nar_runtime_free(rt);
+}
+
+int main(int argc, char **argv) {
+    const char *dir = argc > 1 ? argv[1] : ".";
+    test_bytecode_v2(dir);
+    return test_finish();
+}
@@ -0,0 +1,28 @@
+#include "test.h"
+
+// Object transfer between runtimes.
+
+static void test_copy_object(void) {
+    nar_runtime_t rt = test_runtime_new();
+    nar_runtime_t other = test_runtime_new();
+    nar_object_t sample = test_make_sample(rt);
+
+    nar_object_t copy = nar_copy_object(other, rt, sample);
+    nar_frame_free(rt);
+    sample = test_make_sample(rt);
+    CHECK(test_same(rt, sample, other, copy));
+    nar_tuple_t tuple = nar_to_tuple(other, nar_to_record_field(other, copy, "tuple"));
+    nar_option_t just = nar_to_option(other, nar_to_record_field(other, copy, "just"));
+    CHECK(tuple.size == 2 && just.size == 1 && tuple.values[0] == just.values[0]);
+    nar_object_t arg = nar_make_int(other, 4);
+    CHECK(nar_to_int(other, nar_apply_func(other, nar_to_record_field(other, copy, "fn"), 1, &arg))
+            == 10);
+
+    nar_runtime_free(other);
+    nar_runtime_free(rt);
+}
+
+int main(void) {
+    test_copy_object();
+    return test_finish();
+}
@@ -0,0 +1,56 @@
+#include "test.h"
+
+// Evaluation budget and interruption.
+
+// evaluation fails when fuel runs out, zero fuel is unlimited
+static void test_fuel(void) {
+    nar_runtime_t rt = test_runtime_new();
+    nar_set_fuel(rt, 1000000);
+    CHECK(nar_to_int(rt, nar_apply(rt, "main", 0, NULL)) == 55);
+    nar_size_t used = 1000000 - nar_get_fuel(rt);
+    CHECK(used > 0);
+
+    nar_set_fuel(rt, used / 2); // fuel is checked before calls
+    CHECK(!nar_object_is_valid(rt, nar_apply(rt, "main", 0, NULL)));
+    CHECK(nar_get_error_code(rt) == NAR_ERROR_OUT_OF_FUEL);
+    CHECK(nar_get_fuel(rt) == 0);
+    nar_clear_error(rt);
+
+    nar_set_fuel(rt, used);
+    CHECK(nar_to_int(rt, nar_apply(rt, "main", 0, NULL)) == 55);
+    nar_set_fuel(rt, 0);
+    for (int i = 0; i < 10; i++) {
+        CHECK(nar_to_int(rt, nar_apply(rt, "main", 0, NULL)) == 55);
+    }
+    CHECK(nar_get_error(rt) == NULL);
+    nar_runtime_free(rt);
+}
+
+static nar_object_t interrupting_add(nar_runtime_t rt, nar_object_t a, nar_object_t b) {
+    if (nar_to_int(rt, a) == 5) {
+        nar_runtime_interrupt(rt);
+    }
+    return nar_make_int(rt, nar_to_int(rt, a) + nar_to_int(rt, b));
+}
+
+// interrupt stops the running or the next evaluation once
+static void test_interrupt(void) {
+    nar_runtime_t rt = test_runtime_new();
+    nar_runtime_interrupt(rt);
+    CHECK(!nar_object_is_valid(rt, nar_apply(rt, "main", 0, NULL)));
+    CHECK(nar_get_error_code(rt) == NAR_ERROR_INTERRUPTED);
+    nar_clear_error(rt);
+    CHECK(nar_to_int(rt, nar_apply(rt, "main", 0, NULL)) == 55);
+
+    nar_register_def(rt, "Test", "add", interrupting_add, 2);
+    CHECK(!nar_object_is_valid(rt, nar_apply(rt, "main", 0, NULL)));
+    CHECK(nar_get_error_code(rt) == NAR_ERROR_INTERRUPTED);
+    nar_clear_error(rt);
+    nar_runtime_free(rt);
+}
+
+int main(void) {
+    test_fuel();
+    test_interrupt();
+    return test_finish();
+}
@@ -0,0 +1,78 @@
+#include <stdint.h>
+#include <string.h>
+#include "test.h"
+
+// Checkpoints release objects, memory and pins made after them.
+
+// nested checkpoints release objects made after them in stack order
+static void test_checkpoints(void) {
+    nar_runtime_t rt = test_runtime_new();
+    nar_object_t kept = nar_make_string(rt, "kept");
+    nar_size_t num_strings = test_arena_size(rt, NAR_OBJECT_KIND_STRING);
+
+    nar_size_t outer = nar_frame_mark(rt);
+    nar_make_string(rt, "outer");
+    nar_size_t inner = nar_frame_mark(rt);
+    nar_make_string(rt, "inner");
+    CHECK(nar_frame_alloc(rt, 1 << 16) != NULL);
+    CHECK(test_arena_size(rt, NAR_OBJECT_KIND_STRING) == num_strings + 2);
+    nar_frame_release_to(rt, inner);
+    CHECK(test_arena_size(rt, NAR_OBJECT_KIND_STRING) == num_strings + 1);
+    nar_frame_release_to(rt, outer);
+    CHECK(test_arena_size(rt, NAR_OBJECT_KIND_STRING) == num_strings);
+
+    CHECK(strcmp(nar_to_string(rt, kept), "kept") == 0);
+    CHECK(nar_make_string(rt, "kept") == kept);
+    CHECK(strcmp(nar_to_string(rt, nar_make_string(rt, "inner")), "inner") == 0);
+    CHECK(test_arena_size(rt, NAR_OBJECT_KIND_STRING) == num_strings + 1); // made again
+    nar_runtime_free(rt);
+}
+
+// a pin made after a checkpoint does not outlive its release in a free slot below it
+static void test_checkpoint_pins(void) {
+    nar_runtime_t rt = test_runtime_new();
+    nar_size_t freed = nar_pin(rt, nar_make_string(rt, "freed"));
+    nar_size_t kept = nar_pin(rt, nar_make_string(rt, "kept"));
+    nar_unpin(rt, freed);
+
+    nar_size_t mark = nar_frame_mark(rt);
+    nar_size_t pin = nar_pin(rt, nar_make_string(rt, "released"));
+    CHECK(pin != freed);
+    nar_frame_release_to(rt, mark);
+
+    CHECK(!nar_object_is_valid(rt, nar_pinned_get(rt, pin)));
+    nar_clear_error(rt);
+    CHECK(strcmp(nar_to_string(rt, nar_pinned_get(rt, kept)), "kept") == 0);
+    CHECK(nar_pin(rt, nar_make_string(rt, "reused")) == freed);
+    nar_runtime_free(rt);
+}
+
+// small frame blocks are bumped from a slab that is reused by the next frame
+static void test_frame_alloc(void) {
+    nar_runtime_t rt = test_runtime_new();
+    static nar_byte_t *blocks[1000];
+    for (size_t i = 0; i < 1000; i++) {
+        blocks[i] = nar_frame_alloc(rt, i % 24 + 1);
+        memset(blocks[i], (int) i, i % 24 + 1);
+        CHECK((uintptr_t) blocks[i] % 8 == 0);
+    }
+    nar_byte_t *large = nar_frame_alloc(rt, 1 << 20);
+    memset(large, 0xff, 1 << 20);
+    for (size_t i = 0; i < 1000; i++) {
+        for (size_t j = 0; j < i % 24 + 1; j++) {
+            CHECK(blocks[i][j] == (nar_byte_t) i);
+        }
+    }
+    CHECK(nar_frame_alloc(rt, 0) == NULL);
+
+    nar_frame_free(rt);
+    CHECK(nar_frame_alloc(rt, 1) == blocks[0]);
+    nar_runtime_free(rt);
+}
+
+int main(void) {
+    test_frame_alloc();
+    test_checkpoints();
+    test_checkpoint_pins();
+    return test_finish();
+}
@@ -0,0 +1,100 @@
+#include "test.h"
+
+// Collectors must not change results of the program.
+
+// runs the program a few times with a sample pinned across a collection
+// and compares results with the plain run
+static void check_program(nar_runtime_t rt) {
+    nar_runtime_t plain = test_runtime_new();
+    nar_object_t main_result = nar_apply(plain, "main", 0, NULL);
+    nar_object_t rec_result = nar_apply(plain, "rec", 0, NULL);
+    CHECK(nar_to_int(plain, main_result) == 55);
+
+    for (int i = 0; i < 3; i++) {
+        CHECK(test_same(plain, main_result, rt, nar_apply(rt, "main", 0, NULL)));
+        CHECK(test_same(plain, rec_result, rt, nar_apply(rt, "rec", 0, NULL)));
+        nar_size_t pin = nar_pin(rt, test_make_sample(rt));
+        CHECK(test_same(plain, main_result, rt, nar_apply(rt, "main", 0, NULL)));
+        nar_gc_collect(rt);
+        CHECK(test_same(plain, test_make_sample(plain), rt, nar_pinned_get(rt, pin)));
+        nar_unpin(rt, pin);
+        nar_frame_free(rt);
+    }
+    CHECK(nar_get_error(rt) == NULL);
+    nar_runtime_free(plain);
+}
+
+static void test_gc(void) {
+    nar_runtime_t rt = test_runtime_new();
+    nar_set_gc_threshold(rt, 1);
+    check_program(rt);
+
+    nar_object_t keep = nar_make_tuple(rt, 2, (nar_object_t[]) {
+            nar_make_int(rt, 1), nar_make_string(rt, "kept")});
+    nar_size_t pin = nar_pin(rt, keep);
+    for (int i = 0; i < 1000; i++) {
+        nar_make_list(rt, 2, (nar_object_t[]) {nar_make_int(rt, i), nar_make_int(rt, -i)});
+    }
+    nar_gc_collect(rt);
+    nar_tuple_t tuple = nar_to_tuple(rt, nar_pinned_get(rt, pin));
+    CHECK(tuple.size == 2 && nar_to_int(rt, tuple.values[0]) == 1);
+    CHECK(tuple.size == 2 && nar_make_string(rt, "kept") == tuple.values[1]);
+    nar_unpin(rt, pin);
+
+    nar_runtime_free(rt);
+}
+
+// counts objects left in the main arena after running the program
+static nar_size_t tenured_after_program(nar_runtime_t rt) {
+    nar_apply(rt, "main", 0, NULL);
+    nar_apply(rt, "rec", 0, NULL);
+    nar_size_t num_objects = 0;
+    for (nar_object_kind_t kind = 0; kind < NAR_OBJECT_KIND__COUNT; kind++) {
+        num_objects += test_arena_size(rt, kind);
+    }
+    nar_frame_free(rt);
+    return num_objects;
+}
+
+static void test_nursery(void) {
+    nar_runtime_t rt = test_runtime_new();
+    nar_size_t plain = tenured_after_program(rt);
+    nar_set_nursery_size(rt, 4);
+    CHECK(tenured_after_program(rt) < plain);
+    check_program(rt);
+
+    nar_set_gc_threshold(rt, 1);
+    check_program(rt);
+    nar_runtime_free(rt);
+}
+
+static void test_refcounting(void) {
+    nar_runtime_t rt = test_runtime_new();
+    nar_apply(rt, "rec", 0, NULL);
+    nar_size_t records = test_arena_size(rt, NAR_OBJECT_KIND_RECORD);
+    nar_frame_free(rt);
+    nar_set_refcounting(rt, nar_true);
+    nar_apply(rt, "rec", 0, NULL);
+    CHECK(test_arena_size(rt, NAR_OBJECT_KIND_RECORD) < records); // update of unique record
+    nar_frame_free(rt);
+    check_program(rt);
+    nar_runtime_free(rt);
+}
+
+// all collectors together
+static void test_collectors(void) {
+    nar_runtime_t rt = test_runtime_new();
+    nar_set_gc_threshold(rt, 1);
+    nar_set_nursery_size(rt, 4);
+    nar_set_refcounting(rt, nar_true);
+    check_program(rt);
+    nar_runtime_free(rt);
+}
+
+int main(void) {
+    test_gc();
+    test_nursery();
+    test_refcounting();
+    test_collectors();
+    return test_finish();
+}
@@ -0,0 +1,127 @@
+#include <string.h>
+#include "test.h"
+
+// Heaps that hold objects apart from the frame.
+
+// persisted objects survive frame resets
+static void test_persist(void) {
+    nar_runtime_t rt = test_runtime_new();
+    nar_object_t persisted = nar_persist(rt, test_make_sample(rt));
+    nar_frame_free(rt);
+    nar_frame_free(rt);
+
+    CHECK(test_same(rt, test_make_sample(rt), rt, persisted));
+    nar_object_t arg = nar_make_int(rt, 4);
+    nar_object_t fn = nar_to_record_field(rt, persisted, "fn");
+    CHECK(nar_to_int(rt, nar_apply_func(rt, fn, 1, &arg)) == 10);
+    CHECK(nar_persist(rt, persisted) == persisted);
+
+    nar_persistent_clear(rt);
+    persisted = nar_persist(rt, nar_make_string(rt, "persisted"));
+    nar_frame_free(rt);
+    CHECK(nar_make_string(rt, "persisted") == persisted); // found in persistent strings
+    CHECK(strcmp(nar_to_string(rt, persisted), "persisted") == 0);
+    nar_runtime_free(rt);
+}
+
+// every heap has its own frame, freeing one keeps objects of the others
+static void test_heaps(void) {
+    nar_runtime_t rt = test_runtime_new();
+    nar_object_t main_str = nar_make_string(rt, "main heap");
+    nar_size_t num_strings = test_arena_size(rt, NAR_OBJECT_KIND_STRING);
+
+    nar_heap_t heap = nar_heap_new(rt);
+    nar_heap_t main_heap = nar_heap_select(rt, heap);
+    CHECK(test_arena_size(rt, NAR_OBJECT_KIND_STRING) == 0);
+    nar_object_t heap_str = nar_make_string(rt, "other heap");
+    CHECK(nar_to_int(rt, nar_apply(rt, "main", 0, NULL)) == 55);
+    nar_frame_free(rt);
+    heap_str = nar_make_string(rt, "other heap");
+
+    CHECK(nar_heap_select(rt, main_heap) == heap);
+    CHECK(test_arena_size(rt, NAR_OBJECT_KIND_STRING) == num_strings);
+    CHECK(strcmp(nar_to_string(rt, main_str), "main heap") == 0);
+    nar_heap_select(rt, heap);
+    CHECK(strcmp(nar_to_string(rt, heap_str), "other heap") == 0);
+
+    nar_heap_free(rt, heap); // selects the main heap
+    CHECK(nar_heap_select(rt, NULL) == main_heap);
+    CHECK(strcmp(nar_to_string(rt, main_str), "main heap") == 0);
+    nar_heap_free(rt, main_heap);
+    CHECK(nar_get_error(rt) != NULL);
+    nar_clear_error(rt);
+    nar_runtime_free(rt);
+}
+
+// arena items stay in place while the arena grows
+static void test_arena_growth(void) {
+    nar_runtime_t rt = test_runtime_new();
+    nar_object_t first = nar_make_int(rt, 42);
+    const nar_int_t *item = test_object_item(rt, first);
+    nar_object_t last = first;
+    for (nar_int_t i = 0; i < 100000; i++) {
+        last = nar_make_int(rt, i);
+    }
+    CHECK(test_object_item(rt, first) == item && *item == 42);
+    CHECK(nar_to_int(rt, last) == 99999);
+    nar_runtime_free(rt);
+}
+
+// chunks of a spike are kept for the next frames and released once it leaves the history
+static void test_arena_trim(void) {
+    nar_runtime_t rt = test_runtime_new();
+    for (nar_int_t i = 0; i < 1000000; i++) {
+        nar_make_int(rt, i);
+    }
+    nar_size_t spike = test_arena_chunks(rt, NAR_OBJECT_KIND_INT);
+    CHECK(spike > 3);
+    nar_frame_free(rt);
+    CHECK(test_arena_chunks(rt, NAR_OBJECT_KIND_INT) == spike);
+
+    for (int frame = 0; frame < 16; frame++) {
+        nar_make_int(rt, frame);
+        nar_frame_free(rt);
+    }
+    CHECK(test_arena_chunks(rt, NAR_OBJECT_KIND_INT) == 1);
+    CHECK(nar_to_int(rt, nar_make_int(rt, 5)) == 5);
+    nar_runtime_free(rt);
+}
+
+// unified heap keeps objects of all kinds together in creation order
+static void test_unified_heap(void) {
+    nar_runtime_t rt = test_runtime_new();
+    nar_runtime_t other = test_runtime_new();
+    nar_set_unified_heap(rt, nar_true);
+    CHECK(nar_get_error(rt) == NULL);
+
+    const nar_byte_t *i = test_object_item(rt, nar_make_int(rt, 1));
+    const nar_byte_t *f = test_object_item(rt, nar_make_float(rt, 2));
+    CHECK(f == i + sizeof(nar_int_t));
+    CHECK(nar_to_int(rt, nar_apply(rt, "main", 0, NULL)) == 55);
+    nar_option_t just = nar_to_option(rt, nar_apply(rt, "rec", 0, NULL));
+    CHECK(just.size == 1 && nar_to_int(rt, just.values[0]) == 10);
+
+    nar_size_t mark = nar_frame_mark(rt);
+    nar_object_t sample = test_make_sample(rt);
+    CHECK(test_same(rt, sample, other, test_make_sample(other)));
+    nar_frame_release_to(rt, mark);
+    nar_frame_free(rt);
+    CHECK(test_same(rt, test_make_sample(rt), other, test_make_sample(other)));
+
+    nar_set_nursery_size(rt, 16);
+    CHECK(nar_get_error(rt) != NULL);
+    nar_clear_error(rt);
+    nar_set_unified_heap(rt, nar_false);
+    CHECK(nar_to_int(rt, nar_apply(rt, "main", 0, NULL)) == 55);
+    nar_runtime_free(other);
+    nar_runtime_free(rt);
+}
+
+int main(void) {
+    test_persist();
+    test_heaps();
+    test_arena_growth();
+    test_arena_trim();
+    test_unified_heap();
+    return test_finish();
+}
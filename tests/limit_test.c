@@ -0,0 +1,147 @@
+#include "test.h"
+
+// Memory limits fail the allocation that crosses them and the evaluation.
+
+// doubles a string until the frame byte limit stops it
+static void test_string_bytes(void) {
+    nar_runtime_t rt = test_runtime_new();
+    nar_set_memory_limits(rt, 0, 64 * 1024, 0);
+    nar_object_t str = nar_make_string(rt, "ab");
+    int doublings = 0;
+    for (; doublings < 64 && nar_get_error(rt) == NULL; doublings++) {
+        str = nar_make_string_concat(rt, str, str);
+        nar_to_string(rt, str); // flattens the rope
+    }
+    CHECK(doublings < 16);
+    CHECK(nar_get_error_code(rt) == NAR_ERROR_MEMORY_LIMIT);
+    nar_clear_error(rt);
+    nar_frame_free(rt);
+
+    static char data[64 * 1024];
+    CHECK(!nar_object_is_valid(rt, nar_make_transient_string_len(rt, data, sizeof(data))));
+    CHECK(nar_get_error_code(rt) == NAR_ERROR_MEMORY_LIMIT);
+    nar_clear_error(rt);
+    nar_frame_free(rt);
+
+    str = nar_make_string(rt, "ab");
+    for (int i = 0; i < 10; i++) {
+        str = nar_make_string_concat(rt, str, str);
+    }
+    nar_set_memory_limits(rt, 0, 1024, 0);
+    CHECK(nar_to_string(rt, str)[0] == 0); // flattening 2 KB fails
+    CHECK(nar_get_error_code(rt) == NAR_ERROR_MEMORY_LIMIT);
+    nar_clear_error(rt);
+
+    nar_runtime_free(rt);
+}
+
+// arena byte limit covers chunks of all heaps, kept chunks included
+static void test_arena_bytes(void) {
+    nar_runtime_t rt = test_runtime_new();
+    nar_set_memory_limits(rt, 1 << 20, 0, 0);
+    nar_int_t num_ints = 0;
+    while (num_ints < (1 << 20) && nar_object_is_valid(rt, nar_make_int(rt, num_ints))) {
+        num_ints++;
+    }
+    CHECK(num_ints > 0 && num_ints <= (nar_int_t) ((1 << 20) / sizeof(nar_int_t)));
+    CHECK(nar_get_error_code(rt) == NAR_ERROR_MEMORY_LIMIT);
+    CHECK(!nar_object_is_valid(rt, nar_make_int(rt, 0)));
+    nar_clear_error(rt);
+    nar_frame_free(rt);
+
+    nar_heap_t heap = nar_heap_new(rt);
+    nar_heap_select(rt, heap);
+    for (nar_int_t i = 0; i < num_ints && nar_get_error(rt) == NULL; i++) {
+        nar_make_int(rt, i);
+    }
+    CHECK(nar_get_error_code(rt) == NAR_ERROR_MEMORY_LIMIT); // main heap keeps its chunks
+    nar_clear_error(rt);
+    nar_heap_free(rt, heap);
+    CHECK(nar_to_int(rt, nar_make_int(rt, 7)) == 7);
+    nar_runtime_free(rt);
+}
+
+static nar_size_t num_objects(nar_runtime_t rt) {
+    nar_size_t num_objects = 0;
+    for (nar_object_kind_t kind = 0; kind < NAR_OBJECT_KIND__COUNT; kind++) {
+        num_objects += test_arena_size(rt, kind);
+    }
+    return num_objects;
+}
+
+// object limit counts live objects, a loop with constant live set does not hit it
+static void test_live_objects(void) {
+    nar_runtime_t rt = test_runtime_new();
+    nar_apply(rt, "main", 0, NULL);
+    nar_size_t per_run = num_objects(rt);
+    nar_frame_free(rt);
+
+    nar_set_memory_limits(rt, 0, 0, per_run * 4);
+    nar_set_gc_threshold(rt, per_run);
+    for (int i = 0; i < 20; i++) {
+        CHECK(nar_to_int(rt, nar_apply(rt, "main", 0, NULL)) == 55);
+    }
+    nar_gc_collect(rt);
+    for (int i = 0; i < 20; i++) {
+        nar_make_int(rt, i);
+        nar_gc_collect(rt);
+    }
+    CHECK(nar_get_error(rt) == NULL);
+    nar_runtime_free(rt);
+
+    // slots reused by refcounting are not counted again
+    rt = test_runtime_new();
+    nar_set_refcounting(rt, nar_true);
+    nar_apply(rt, "rec", 0, NULL);
+    nar_size_t live = num_objects(rt);
+    nar_frame_free(rt);
+    nar_set_memory_limits(rt, 0, 0, live);
+    CHECK(nar_to_option(rt, nar_apply(rt, "rec", 0, NULL)).size == 1);
+    CHECK(nar_get_error(rt) == NULL);
+    nar_runtime_free(rt);
+}
+
+static nar_object_t make_pair(nar_runtime_t rt, nar_object_t a, nar_object_t b) {
+    return nar_make_tuple(rt, 2, (nar_object_t[]) {nar_make_int(rt, nar_to_int(rt, a)), b});
+}
+
+// objects that failed to allocate read as zero values
+static void test_failed_objects(void) {
+    nar_runtime_t rt = test_runtime_new();
+    nar_set_memory_limits(rt, 0, 0, 4);
+    nar_object_t pair = NAR_INVALID_OBJECT;
+    for (int i = 0; i < 8; i++) {
+        pair = make_pair(rt, nar_make_int(rt, i), pair);
+    }
+    CHECK(nar_get_error_code(rt) == NAR_ERROR_MEMORY_LIMIT);
+    CHECK(nar_to_int(rt, pair) == 0 && nar_to_float(rt, pair) == 0 && nar_to_char(rt, pair) == 0);
+    CHECK(nar_to_tuple(rt, pair).size == 0 && nar_to_list(rt, pair).size == 0);
+    CHECK(nar_to_option_item(rt, pair).values == NAR_INVALID_OBJECT);
+    CHECK(nar_to_closure(rt, pair).curried == NAR_INVALID_OBJECT);
+    CHECK(nar_to_string(rt, pair)[0] == 0);
+    nar_clear_error(rt);
+    nar_frame_free(rt);
+
+    nar_object_t value = nar_make_int(rt, 1);
+    nar_set_memory_limits(rt, 0, 0, 1);
+    CHECK(!nar_object_is_valid(rt, nar_make_option(rt, "Test#Just", 1, &value)));
+    CHECK(nar_get_error_code(rt) == NAR_ERROR_MEMORY_LIMIT);
+    nar_clear_error(rt);
+    nar_frame_free(rt);
+
+    nar_set_memory_limits(rt, 0, 0, 16);
+    for (int i = 0; i < 20 && nar_get_error(rt) == NULL; i++) {
+        nar_apply(rt, "main", 0, NULL);
+    }
+    CHECK(nar_get_error_code(rt) == NAR_ERROR_MEMORY_LIMIT);
+    nar_clear_error(rt);
+    nar_runtime_free(rt);
+}
+
+int main(void) {
+    test_arena_bytes();
+    test_string_bytes();
+    test_live_objects();
+    test_failed_objects();
+    return test_finish();
+}
@@ -0,0 +1,89 @@
+#include <stdlib.h>
+#include <string.h>
+#include "test.h"
+
+// Memory API and runtime allocators.
+
+// blocks keep their contents across reallocation and are freed in any order
+static void test_alloc(void) {
+    CHECK(nar_alloc(0) == NULL);
+    nar_free(NULL);
+
+    static nar_byte_t *blocks[64];
+    for (size_t i = 0; i < 64; i++) {
+        blocks[i] = nar_alloc(i + 1);
+        memset(blocks[i], (int) i, i + 1);
+    }
+    for (size_t i = 0; i < 64; i += 2) {
+        nar_free(blocks[i]);
+    }
+    for (size_t i = 1; i < 64; i += 2) {
+        blocks[i] = nar_realloc(blocks[i], 1 << 16);
+        CHECK(blocks[i][0] == (nar_byte_t) i && blocks[i][i] == (nar_byte_t) i);
+        blocks[i][(1 << 16) - 1] = 0;
+    }
+    for (size_t i = 1; i < 64; i += 2) {
+        CHECK(nar_realloc(blocks[i], 0) == NULL);
+    }
+
+    nar_byte_t *mem = nar_default_allocator.alloc(NULL, 8);
+    memset(mem, 1, 8);
+    mem = nar_default_allocator.realloc(NULL, mem, 16);
+    CHECK(mem[7] == 1);
+    nar_default_allocator.free(NULL, mem);
+}
+
+typedef struct {
+    size_t num_allocs;
+    size_t num_live;
+} counter_t;
+
+static nar_ptr_t counting_alloc(nar_ptr_t ctx, nar_size_t size) {
+    ((counter_t *) ctx)->num_allocs++;
+    ((counter_t *) ctx)->num_live++;
+    return malloc(size);
+}
+
+static nar_ptr_t counting_realloc(nar_ptr_t ctx, nar_ptr_t mem, nar_size_t size) {
+    if (mem == NULL) {
+        ((counter_t *) ctx)->num_allocs++;
+        ((counter_t *) ctx)->num_live++;
+    }
+    return realloc(mem, size);
+}
+
+static void counting_free(nar_ptr_t ctx, nar_ptr_t mem) {
+    ((counter_t *) ctx)->num_live--;
+    free(mem);
+}
+
+// all memory of the runtime goes through its allocator and is returned to it
+static void test_runtime_allocator(void) {
+    counter_t counter = {0};
+    const nar_allocator_t allocator = {
+            .ctx = &counter,
+            .alloc = &counting_alloc,
+            .realloc = &counting_realloc,
+            .free = &counting_free,
+    };
+    nar_bytecode_t btc = nar_bytecode_new_with_allocator(
+            test_program_size, test_program, &allocator);
+    nar_runtime_t rt = nar_runtime_new_with_allocator(btc, &allocator);
+    test_register_natives(rt);
+    size_t num_allocs = counter.num_allocs;
+    CHECK(num_allocs > 0);
+
+    CHECK(nar_to_int(rt, nar_apply(rt, "main", 0, NULL)) == 55);
+    CHECK(test_same(rt, test_make_sample(rt), rt, test_make_sample(rt)));
+    CHECK(nar_frame_alloc(rt, 1 << 20) != NULL);
+    CHECK(counter.num_allocs > num_allocs);
+    nar_frame_free(rt);
+    nar_runtime_free(rt);
+    CHECK(counter.num_live == 0);
+}
+
+int main(void) {
+    test_alloc();
+    test_runtime_allocator();
+    return test_finish();
+}
@@ -0,0 +1,36 @@
+#include <string.h>
+#include "test.h"
+
+// Object constructors and accessors.
+
+// options without values are immediates that take no arena slots
+static void test_nullary_option(void) {
+    nar_runtime_t rt = test_runtime_new();
+    nar_size_t num_options = test_arena_size(rt, NAR_OBJECT_KIND_OPTION);
+    nar_size_t num_lists = test_arena_size(rt, NAR_OBJECT_KIND_LIST);
+
+    nar_object_t nothing = nar_make_option(rt, "Test#Nothing", 0, NULL);
+    CHECK(nar_make_option(rt, "Test#Nothing", 0, NULL) == nothing);
+    CHECK(nar_make_option(rt, "Test#Other", 0, NULL) != nothing);
+    CHECK(nar_object_get_kind(rt, nothing) == NAR_OBJECT_KIND_OPTION);
+    CHECK(test_arena_size(rt, NAR_OBJECT_KIND_OPTION) == num_options);
+    CHECK(test_arena_size(rt, NAR_OBJECT_KIND_LIST) == num_lists);
+
+    nar_option_t opt = nar_to_option(rt, nothing);
+    CHECK(strcmp(opt.name, "Test#Nothing") == 0 && opt.size == 0);
+    CHECK(nar_to_bool(rt, nar_make_bool(rt, nar_true)));
+    CHECK(!nar_to_bool(rt, nar_make_bool(rt, nar_false)));
+
+    nar_object_t value = nar_make_int(rt, 1);
+    nar_object_t just = nar_make_option(rt, "Test#Just", 1, &value);
+    CHECK(test_arena_size(rt, NAR_OBJECT_KIND_OPTION) == num_options + 1);
+    opt = nar_to_option(rt, just);
+    CHECK(strcmp(opt.name, "Test#Just") == 0 && opt.size == 1);
+    CHECK(nar_to_int(rt, opt.values[0]) == 1);
+    nar_runtime_free(rt);
+}
+
+int main(void) {
+    test_nullary_option();
+    return test_finish();
+}
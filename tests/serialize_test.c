@@ -0,0 +1,96 @@
+#include <string.h>
+#include "test.h"
+
+// Serialization round trips through the portable format.
+
+static void test_serialize_v2(void) {
+    nar_runtime_t rt = test_runtime_new();
+    nar_runtime_t other = test_runtime_new();
+    nar_object_t sample = test_make_sample(rt);
+
+    nar_serialized_object_t flat = nar_new_serialized_object_v2(rt, sample, NAR_SERIALIZE_DEFAULT);
+    CHECK(flat != NULL);
+    nar_size_t size = nar_serialized_object_size(flat);
+    CHECK(test_same(rt, sample, other, nar_deserialize_object_v2(other, flat, size)));
+    CHECK(!nar_object_is_valid(other, nar_deserialize_object_v2(other, flat, size - 1)));
+    nar_clear_error(other);
+    nar_free(flat);
+
+    CHECK(nar_new_serialized_object_v2(rt, nar_make_native(rt, NULL, NULL), 0) == NULL);
+    nar_clear_error(rt);
+
+    nar_runtime_free(other);
+    nar_runtime_free(rt);
+}
+
+static void test_serialize_shared(void) {
+    nar_runtime_t rt = test_runtime_new();
+    nar_runtime_t other = test_runtime_new();
+    nar_object_t sample = test_make_sample(rt);
+
+    nar_serialized_object_t flat = nar_new_serialized_object_v2(rt, sample, NAR_SERIALIZE_DEFAULT);
+    nar_serialized_object_t shared = nar_new_serialized_object_v2(rt, sample, NAR_SERIALIZE_SHARED);
+    CHECK(flat != NULL && shared != NULL);
+    nar_size_t shared_size = nar_serialized_object_size(shared);
+    CHECK(shared_size < nar_serialized_object_size(flat));
+
+    nar_object_t copy = nar_deserialize_object_v2(other, shared, shared_size);
+    CHECK(test_same(rt, sample, other, copy));
+    nar_tuple_t tuple = nar_to_tuple(other, nar_to_record_field(other, copy, "tuple"));
+    nar_option_t just = nar_to_option(other, nar_to_record_field(other, copy, "just"));
+    CHECK(tuple.size == 2 && just.size == 1 && tuple.values[0] == just.values[0]);
+    CHECK(!nar_object_is_valid(other, nar_deserialize_object_v2(other, shared, shared_size - 1)));
+    nar_clear_error(other);
+    nar_free(flat);
+    nar_free(shared);
+
+    nar_runtime_free(other);
+    nar_runtime_free(rt);
+}
+
+typedef struct {
+    nar_byte_t *data;
+    nar_size_t size;
+} sink_t;
+
+static nar_bool_t sink_write(nar_ptr_t ctx, nar_cptr_t data, nar_size_t size) {
+    sink_t *sink = ctx;
+    sink->data = nar_realloc(sink->data, sink->size + size);
+    memcpy(sink->data + sink->size, data, size);
+    sink->size += size;
+    return nar_true;
+}
+
+static void test_serialize_stream(void) {
+    nar_runtime_t rt = test_runtime_new();
+    nar_runtime_t other = test_runtime_new();
+    nar_object_t sample = test_make_sample(rt);
+
+    for (int flags = NAR_SERIALIZE_DEFAULT; flags <= NAR_SERIALIZE_SHARED; flags++) {
+        sink_t sink = {0};
+        CHECK(nar_serialize_to_writer(rt, sample, flags, &sink_write, &sink));
+        nar_deserializer_t d = nar_deserializer_new(other);
+        for (nar_size_t offset = 0; offset < sink.size; offset += 7) {
+            nar_size_t size = sink.size - offset < 7 ? sink.size - offset : 7;
+            CHECK(nar_deserializer_feed(d, sink.data + offset, size));
+        }
+        CHECK(test_same(rt, sample, other, nar_deserializer_finish(d)));
+        CHECK(test_same(rt, sample, other, nar_deserialize_object_v2(other, sink.data, sink.size)));
+
+        d = nar_deserializer_new(other);
+        nar_deserializer_feed(d, sink.data, sink.size - 1);
+        CHECK(!nar_object_is_valid(other, nar_deserializer_finish(d)));
+        nar_clear_error(other);
+        nar_free(sink.data);
+    }
+
+    nar_runtime_free(other);
+    nar_runtime_free(rt);
+}
+
+int main(void) {
+    test_serialize_v2();
+    test_serialize_shared();
+    test_serialize_stream();
+    return test_finish();
+}
@@ -0,0 +1,30 @@
+#include <stdio.h>
+#include "test.h"
+
+// Snapshot files written by one runtime and attached to another.
+
+static void test_snapshot(const char *dir) {
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/nar-test-snapshot.bin", dir);
+    nar_runtime_t rt = test_runtime_new();
+    nar_object_t sample = test_make_sample(rt);
+    CHECK(nar_snapshot_write(rt, sample, path));
+
+    nar_runtime_t other = test_runtime_new();
+    nar_object_t root = nar_snapshot_attach(other, path);
+    CHECK(test_same(rt, sample, other, root));
+    nar_object_t fn = nar_to_record_field(other, root, "fn");
+    nar_object_t arg = nar_make_int(other, 4);
+    CHECK(nar_to_int(other, nar_apply_func(other, fn, 1, &arg)) == 10);
+    nar_snapshot_detach(other);
+    remove(path);
+
+    nar_runtime_free(other);
+    nar_runtime_free(rt);
+}
+
+int main(int argc, char **argv) {
+    const char *dir = argc > 1 ? argv[1] : ".";
+    test_snapshot(dir);
+    return test_finish();
+}
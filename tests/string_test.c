@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <string.h>
+#include "test.h"
+
+// String objects: interning, headers, transient and rope strings.
+
+// program strings are interned once and outlive the frame
+static void test_program_strings(void) {
+    nar_runtime_t rt = test_runtime_new();
+    nar_size_t num_strings = test_arena_size(rt, NAR_OBJECT_KIND_STRING);
+    nar_object_t just = nar_make_string(rt, "Test#Just");
+    CHECK(test_arena_size(rt, NAR_OBJECT_KIND_STRING) == num_strings);
+    CHECK(nar_to_option_item(rt, nar_apply(rt, "rec", 0, NULL)).name == just);
+
+    nar_object_t frame = nar_make_string(rt, "frame");
+    CHECK(frame != just && test_arena_size(rt, NAR_OBJECT_KIND_STRING) == num_strings + 1);
+    nar_frame_free(rt);
+    CHECK(test_arena_size(rt, NAR_OBJECT_KIND_STRING) == 0);
+    CHECK(nar_make_string(rt, "Test#Just") == just);
+    CHECK(strcmp(nar_to_string(rt, just), "Test#Just") == 0);
+    nar_runtime_free(rt);
+}
+
+// string headers keep length and ASCII flag, equal strings are one object
+static void test_string_header(void) {
+    nar_runtime_t rt = test_runtime_new();
+    nar_object_t ascii = nar_make_string(rt, "hello");
+    nar_object_t utf8 = nar_make_string(rt, "h\xc3\xa9llo");
+    nar_size_t length = 0;
+    CHECK(strcmp(nar_to_string_len(rt, ascii, &length), "hello") == 0 && length == 5);
+    nar_to_string_len(rt, utf8, &length);
+    CHECK(length == 6);
+    CHECK(nar_string_is_ascii(rt, ascii) && !nar_string_is_ascii(rt, utf8));
+    CHECK(nar_make_string(rt, "hello") == ascii && ascii != utf8);
+    nar_to_string_len(rt, nar_make_string(rt, ""), &length);
+    CHECK(length == 0);
+    nar_runtime_free(rt);
+}
+
+// transient strings are copied without interning until they are used as a key
+static void test_transient_string(void) {
+    nar_runtime_t rt = test_runtime_new();
+    nar_object_t a = nar_make_transient_string(rt, "key");
+    nar_object_t b = nar_make_transient_string(rt, "key");
+    CHECK(a != b && strcmp(nar_to_string(rt, a), nar_to_string(rt, b)) == 0);
+
+    nar_size_t length = 0;
+    nar_object_t zero = nar_make_transient_string_len(rt, "a\0b", 3);
+    nar_cstring_t data = nar_to_string_len(rt, zero, &length);
+    CHECK(length == 3 && memcmp(data, "a\0b", 3) == 0);
+
+    nar_object_t value = nar_make_int(rt, 7);
+    nar_object_t rec = nar_make_record(rt, 0, NULL, NULL);
+    rec = nar_make_record_field_obj(rt, rec, a, value);
+    CHECK(nar_to_int(rt, nar_to_record_field(rt, rec, "key")) == 7);
+    CHECK(nar_make_string(rt, "key") == a); // interned by the record
+    CHECK(nar_make_string(rt, "key") != b);
+    nar_runtime_free(rt);
+}
+
+static char streamed[64];
+static int num_chunks;
+
+static void stream_chunk(__attribute__((unused)) nar_runtime_t rt, nar_cstring_t chunk) {
+    strncat(streamed, chunk, sizeof(streamed) - strlen(streamed) - 1);
+    num_chunks++;
+}
+
+// concatenation builds a rope that is streamed by leaves and flattened on demand
+static void test_rope(void) {
+    nar_runtime_t rt = test_runtime_new();
+    nar_object_t rope = nar_make_string(rt, "ab");
+    rope = nar_make_string_concat(rt, rope, nar_make_transient_string(rt, "cd"));
+    rope = nar_make_string_concat(rt, rope, nar_make_string(rt, ""));
+    CHECK(nar_string_is_ascii(rt, rope));
+    rope = nar_make_string_concat(rt, rope, nar_make_string(rt, "\xc3\xa9"));
+    CHECK(!nar_string_is_ascii(rt, rope));
+
+    nar_string_stream(rt, rope, &stream_chunk);
+    CHECK(strcmp(streamed, "abcd\xc3\xa9") == 0 && num_chunks == 3);
+
+    FILE *file = tmpfile();
+    CHECK(nar_string_write_fd(rt, rope, fileno(file)));
+    char written[64] = {0};
+    rewind(file);
+    CHECK(fread(written, 1, sizeof(written), file) == 6 && strcmp(written, streamed) == 0);
+    fclose(file);
+
+    nar_size_t length = 0;
+    CHECK(strcmp(nar_to_string_len(rt, rope, &length), streamed) == 0 && length == 6);
+    CHECK(nar_make_string(rt, streamed) != rope); // flattened rope is not interned
+    nar_runtime_free(rt);
+}
+
+int main(void) {
+    test_program_strings();
+    test_string_header();
+    test_transient_string();
+    test_rope();
+    return test_finish();
+}
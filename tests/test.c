@@ -0,0 +1,229 @@
+#include <stdio.h>
+#include <string.h>
+#include "test.h"
+#include "../runtime.h"
+
+#define U32(x) (x) & 0xff, ((x) >> 8) & 0xff, ((x) >> 16) & 0xff, ((x) >> 24) & 0xff
+#define I64(x) U32((uint64_t) (x) & 0xffffffffu), U32((uint64_t) (x) >> 32)
+#define OP(kind, a, b, c) (kind), (b), (c), 0, U32(a)
+
+// f n = if n == 0 then 0 else n + f (n - 1)
+// main = f 10
+// rec = Test#Just ({a = 1, b = "x"} with a = 10).a
+const nar_byte_t test_program[] = {
+        0, 'N', 'A', 'R', // signature
+        U32(100), // format version
+        U32(1), // compiler version
+        0, // debug
+        U32(4), 'm', 'a', 'i', 'n', // entry
+        U32(12), // strings
+        U32(8), 'T', 'e', 's', 't', '.', 'a', 'd', 'd',
+        U32(8), 'T', 'e', 's', 't', '.', 's', 'u', 'b',
+        U32(1), 'n',
+        U32(1), 'a',
+        U32(1), 'x',
+        U32(1), 'b',
+        U32(9), 'T', 'e', 's', 't', '#', 'J', 'u', 's', 't',
+        U32(3), 'a', 'd', 'd',
+        U32(3), 's', 'u', 'b',
+        U32(1), 'f',
+        U32(4), 'm', 'a', 'i', 'n',
+        U32(3), 'r', 'e', 'c',
+        U32(3), // constants
+        HASHED_CONST_KIND_INT, I64(0),
+        HASHED_CONST_KIND_INT, I64(1),
+        HASHED_CONST_KIND_INT, I64(10),
+        U32(5), // functions
+        U32(7), U32(2), U32(1), // add, 2 args, 1 ops
+        OP(OP_KIND_CALL, 0, 0, 0), // "Test.add"
+        U32(8), U32(2), U32(1), // sub, 2 args, 1 ops
+        OP(OP_KIND_CALL, 1, 0, 0), // "Test.sub"
+        U32(9), U32(1), U32(17), // f, 1 args, 17 ops
+        OP(OP_KIND_LOAD_CONST, 0, STACK_KIND_PATTERN, CONST_KIND_INT), // 0
+        OP(OP_KIND_MAKE_PATTERN, 0, PATTERN_KIND_CONST, 0),
+        OP(OP_KIND_JUMP, 2, 1, 0), // n == 0
+        OP(OP_KIND_LOAD_CONST, 0, STACK_KIND_OBJECT, CONST_KIND_INT), // 0
+        OP(OP_KIND_JUMP, 11, 0, 0),
+        OP(OP_KIND_MAKE_PATTERN, 2, PATTERN_KIND_NAMED, 0), // "n"
+        OP(OP_KIND_JUMP, 0, 1, 0),
+        OP(OP_KIND_LOAD_LOCAL, 2, 0, 0), // "n"
+        OP(OP_KIND_LOAD_LOCAL, 2, 0, 0), // "n"
+        OP(OP_KIND_LOAD_CONST, 1, STACK_KIND_OBJECT, CONST_KIND_INT), // 1
+        OP(OP_KIND_LOAD_GLOBAL, 1, 0, 0), // sub
+        OP(OP_KIND_APPLY, 0, 2, 0),
+        OP(OP_KIND_LOAD_GLOBAL, 2, 0, 0), // f
+        OP(OP_KIND_APPLY, 0, 1, 0),
+        OP(OP_KIND_LOAD_GLOBAL, 0, 0, 0), // add
+        OP(OP_KIND_APPLY, 0, 2, 0),
+        OP(OP_KIND_SWAP_POP, 0, SWAP_POP_KIND_BOTH, 0),
+        U32(10), U32(0), U32(3), // main, 0 args, 3 ops
+        OP(OP_KIND_LOAD_CONST, 2, STACK_KIND_OBJECT, CONST_KIND_INT), // 10
+        OP(OP_KIND_LOAD_GLOBAL, 2, 0, 0), // f
+        OP(OP_KIND_APPLY, 0, 1, 0),
+        U32(11), U32(0), U32(10), // rec, 0 args, 10 ops
+        OP(OP_KIND_LOAD_CONST, 1, STACK_KIND_OBJECT, CONST_KIND_INT), // 1
+        OP(OP_KIND_LOAD_CONST, 3, STACK_KIND_OBJECT, CONST_KIND_STRING), // "a"
+        OP(OP_KIND_LOAD_CONST, 4, STACK_KIND_OBJECT, CONST_KIND_STRING), // "x"
+        OP(OP_KIND_LOAD_CONST, 5, STACK_KIND_OBJECT, CONST_KIND_STRING), // "b"
+        OP(OP_KIND_MAKE_OBJECT, 2, OBJECT_KIND_RECORD, 0),
+        OP(OP_KIND_LOAD_CONST, 2, STACK_KIND_OBJECT, CONST_KIND_INT), // 10
+        OP(OP_KIND_UPDATE, 3, 0, 0), // "a"
+        OP(OP_KIND_ACCESS, 3, 0, 0), // "a"
+        OP(OP_KIND_LOAD_CONST, 6, STACK_KIND_OBJECT, CONST_KIND_STRING), // "Test#Just"
+        OP(OP_KIND_MAKE_OBJECT, 1, OBJECT_KIND_OPTION, 0),
+        U32(2), // exports
+        U32(4), 'm', 'a', 'i', 'n', U32(3),
+        U32(3), 'r', 'e', 'c', U32(4),
+        U32(0), // packages
+};
+
+const nar_size_t test_program_size = sizeof(test_program);
+
+int test_failures = 0;
+
+void test_check(nar_bool_t ok, const char *expr, const char *func, int line) {
+    if (!ok) {
+        printf("%s:%d: check failed: %s\n", func, line, expr);
+        test_failures++;
+    }
+}
+
+int test_finish(void) {
+    if (test_failures > 0) {
+        printf("%d checks failed\n", test_failures);
+        return 1;
+    }
+    printf("all tests passed\n");
+    return 0;
+}
+
+static nar_object_t test_add(nar_runtime_t rt, nar_object_t a, nar_object_t b) {
+    return nar_make_int(rt, nar_to_int(rt, a) + nar_to_int(rt, b));
+}
+
+static nar_object_t test_sub(nar_runtime_t rt, nar_object_t a, nar_object_t b) {
+    return nar_make_int(rt, nar_to_int(rt, a) - nar_to_int(rt, b));
+}
+
+void test_register_natives(nar_runtime_t rt) {
+    nar_register_def(rt, "Test", "add", test_add, 2);
+    nar_register_def(rt, "Test", "sub", test_sub, 2);
+}
+
+nar_runtime_t test_runtime_new(void) {
+    nar_runtime_t rt = nar_runtime_new(nar_bytecode_new(test_program_size, test_program));
+    if (rt != NULL) {
+        test_register_natives(rt);
+    }
+    return rt;
+}
+
+nar_bool_t test_same(nar_runtime_t ra, nar_object_t a, nar_runtime_t rb, nar_object_t b) {
+    nar_object_kind_t kind = nar_object_get_kind(ra, a);
+    if (!nar_object_is_valid(ra, a) || !nar_object_is_valid(rb, b) ||
+            kind != nar_object_get_kind(rb, b)) {
+        return nar_false;
+    }
+    switch (kind) {
+        case NAR_OBJECT_KIND_UNIT:
+            return nar_true;
+        case NAR_OBJECT_KIND_CHAR:
+            return nar_to_char(ra, a) == nar_to_char(rb, b);
+        case NAR_OBJECT_KIND_INT:
+            return nar_to_int(ra, a) == nar_to_int(rb, b);
+        case NAR_OBJECT_KIND_FLOAT:
+            return nar_to_float(ra, a) == nar_to_float(rb, b);
+        case NAR_OBJECT_KIND_STRING:
+            return strcmp(nar_to_string(ra, a), nar_to_string(rb, b)) == 0;
+        case NAR_OBJECT_KIND_RECORD: {
+            nar_record_t x = nar_to_record(ra, a);
+            nar_record_t y = nar_to_record(rb, b);
+            if (x.size != y.size) {
+                return nar_false;
+            }
+            for (nar_size_t i = 0; i < x.size; i++) {
+                if (strcmp(x.keys[i], y.keys[i]) != 0 || !test_same(ra, x.values[i], rb, y.values[i])) {
+                    return nar_false;
+                }
+            }
+            return nar_true;
+        }
+        case NAR_OBJECT_KIND_TUPLE: {
+            nar_tuple_t x = nar_to_tuple(ra, a);
+            nar_tuple_t y = nar_to_tuple(rb, b);
+            if (x.size != y.size) {
+                return nar_false;
+            }
+            for (nar_size_t i = 0; i < x.size; i++) {
+                if (!test_same(ra, x.values[i], rb, y.values[i])) {
+                    return nar_false;
+                }
+            }
+            return nar_true;
+        }
+        case NAR_OBJECT_KIND_LIST: {
+            nar_list_t x = nar_to_list(ra, a);
+            nar_list_t y = nar_to_list(rb, b);
+            if (x.size != y.size) {
+                return nar_false;
+            }
+            for (nar_size_t i = 0; i < x.size; i++) {
+                if (!test_same(ra, x.items[i], rb, y.items[i])) {
+                    return nar_false;
+                }
+            }
+            return nar_true;
+        }
+        case NAR_OBJECT_KIND_OPTION: {
+            nar_option_t x = nar_to_option(ra, a);
+            nar_option_t y = nar_to_option(rb, b);
+            if (strcmp(x.name, y.name) != 0 || x.size != y.size) {
+                return nar_false;
+            }
+            for (nar_size_t i = 0; i < x.size; i++) {
+                if (!test_same(ra, x.values[i], rb, y.values[i])) {
+                    return nar_false;
+                }
+            }
+            return nar_true;
+        }
+        case NAR_OBJECT_KIND_CLOSURE: {
+            nar_closure_t x = nar_to_closure(ra, a);
+            nar_closure_t y = nar_to_closure(rb, b);
+            return x.fn_index == y.fn_index && test_same(ra, x.curried, rb, y.curried);
+        }
+        default:
+            return nar_false;
+    }
+}
+
+nar_object_t test_make_sample(nar_runtime_t rt) {
+    nar_object_t shared = nar_make_list(rt, 3, (nar_object_t[]) {
+            nar_make_int(rt, -7), nar_make_string(rt, "h\xc3\xa9llo"), nar_make_unit(rt)});
+    nar_object_t just = nar_make_option(rt, "Test#Just", 1, &shared);
+    nar_object_t values[] = {
+            nar_make_char(rt, 0x1F600),
+            nar_make_float(rt, 2.5),
+            nar_make_tuple(rt, 2, (nar_object_t[]) {shared, nar_make_int(rt, 1LL << 40)}),
+            just,
+            nar_make_option(rt, "Test#Nothing", 0, NULL),
+            nar_make_closure(rt, 2, 0, NULL),
+            nar_make_list(rt, 0, NULL),
+    };
+    static const nar_cstring_t keys[] = {"char", "float", "tuple", "just", "nothing", "fn", "empty"};
+    return nar_make_record(rt, sizeof(values) / sizeof(values[0]), keys, values);
+}
+
+nar_size_t test_arena_size(nar_runtime_t rt, nar_object_kind_t kind) {
+    arena_t *arena = ((runtime_t *) rt)->arenas[kind];
+    return arena == NULL ? 0 : arena_size(arena);
+}
+
+nar_size_t test_arena_chunks(nar_runtime_t rt, nar_object_kind_t kind) {
+    arena_t *arena = ((runtime_t *) rt)->arenas[kind];
+    return arena == NULL ? 0 : arena->num_chunks;
+}
+
+const void *test_object_item(nar_runtime_t rt, nar_object_t obj) {
+    return find(rt, nar_object_get_kind(rt, obj), obj);
+}
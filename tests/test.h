@@ -0,0 +1,44 @@
+#ifndef NAR_RUNTIME_TEST_H
+#define NAR_RUNTIME_TEST_H
+
+#include "../include/nar-runtime.h"
+
+// Every test executable checks one area of the runtime. Checks do not stop the test,
+// failed ones are printed and counted, test_finish gives the exit code.
+
+#define CHECK(cond) test_check((cond), #cond, __func__, __LINE__)
+
+// f n = if n == 0 then 0 else n + f (n - 1)
+// main = f 10
+// rec = Test#Just ({a = 1, b = "x"} with a = 10).a
+extern const nar_byte_t test_program[];
+extern const nar_size_t test_program_size;
+
+extern int test_failures;
+
+void test_check(nar_bool_t ok, const char *expr, const char *func, int line);
+
+int test_finish(void);
+
+// registers Test.add and Test.sub used by the test program
+void test_register_natives(nar_runtime_t rt);
+
+// runtime of the test program with natives registered
+nar_runtime_t test_runtime_new(void);
+
+// compares objects of two runtimes by content
+nar_bool_t test_same(nar_runtime_t ra, nar_object_t a, nar_runtime_t rb, nar_object_t b);
+
+// record with every serializable kind, one list is referenced from two fields
+nar_object_t test_make_sample(nar_runtime_t rt);
+
+// number of objects of the kind in the main arena of the active heap
+nar_size_t test_arena_size(nar_runtime_t rt, nar_object_kind_t kind);
+
+// number of chunks allocated by the main arena of the kind in the active heap
+nar_size_t test_arena_chunks(nar_runtime_t rt, nar_object_kind_t kind);
+
+// item of the object in its arena, NULL for objects without one
+const void *test_object_item(nar_runtime_t rt, nar_object_t obj);
+
+#endif //NAR_RUNTIME_TEST_H
@@ -0,0 +1,106 @@
+#include <string.h>
+#include "include/nar-runtime.h"
+#include "runtime.h"
+
+// Transfer copies object graphs between runtimes of one process without encoding them.
+// Objects are copied by copy walk into the frame of the destination runtime.
+// Strings and option names are interned by content in the destination. Function and native
+// objects keep their pointers, closures refer to the function of the same name and arity
+// when runtimes run different programs.
+
+typedef struct {
+    runtime_t *dst;
+    runtime_t *src;
+    size_t *fn_indices; // destination function index by source one, created on first closure
+} transfer_t;
+
+nar_object_t transfer_string(transfer_t *t, nar_object_t obj) {
+    string_header_t *header = string_header(t->src, obj);
+    if (header == NULL) {
+        return NAR_INVALID_OBJECT;
+    }
+    nar_object_t found = find_string_with_hash(
+            t->dst, header->data, header->length, string_header_hash(header));
+    if (found != NAR_INVALID_OBJECT) {
+        return found;
+    }
+    return string_intern(
+            t->dst, nar_make_transient_string_len(t->dst, header->data, header->length));
+}
+
+copy_resolve_t transfer_resolve(void *ctx, nar_object_t obj, nar_object_t *copy) {
+    transfer_t *t = ctx;
+    nar_object_kind_t kind = nar_object_get_kind(t->src, obj);
+    if (t->src->arenas[kind] == NULL) {
+        *copy = obj;
+        return COPY_RESOLVED;
+    }
+    if (kind == NAR_OBJECT_KIND_STRING) {
+        *copy = transfer_string(t, obj);
+        return COPY_RESOLVED;
+    }
+    return COPY_ITEM;
+}
+
+// finds function of source program in destination program by name and arity,
+// returns num_functions of destination program if it is missing
+size_t transfer_fn_index(transfer_t *t, size_t fn_index) {
+    const bytecode_t *sp = t->src->program;
+    const bytecode_t *dp = t->dst->program;
+    if (sp == dp) {
+        return fn_index;
+    }
+    if (sp == NULL || dp == NULL || fn_index >= sp->num_functions) {
+        return dp == NULL ? 0 : dp->num_functions;
+    }
+    if (t->fn_indices == NULL) {
+        t->fn_indices = rt_alloc(t->dst, sp->num_functions * sizeof(size_t));
+        for (size_t i = 0; i < sp->num_functions; i++) {
+            t->fn_indices[i] = SIZE_MAX;
+        }
+    }
+    if (t->fn_indices[fn_index] == SIZE_MAX) {
+        const func_t *fn = &sp->functions[fn_index];
+        size_t found = dp->num_functions;
+        for (size_t i = 0; i < dp->num_functions && fn->name != NULL; i++) {
+            const func_t *candidate = &dp->functions[i];
+            if (candidate->name != NULL && candidate->num_args == fn->num_args &&
+                    strcmp(candidate->name, fn->name) == 0) {
+                found = i;
+                break;
+            }
+        }
+        t->fn_indices[fn_index] = found;
+    }
+    return t->fn_indices[fn_index];
+}
+
+nar_object_t transfer_insert(void *ctx, nar_object_kind_t kind, void *item) {
+    transfer_t *t = ctx;
+    if (kind == NAR_OBJECT_KIND_CLOSURE) {
+        nar_closure_t *closure = item;
+        closure->fn_index = transfer_fn_index(t, closure->fn_index);
+        if (t->dst->program == NULL || closure->fn_index >= t->dst->program->num_functions) {
+            nar_fail(t->dst, "closure function is missing in destination program");
+            return NAR_INVALID_OBJECT;
+        }
+    }
+    return insert(t->dst, kind, item);
+}
+
+nar_object_t nar_copy_object(nar_runtime_t dst, nar_runtime_t src, nar_object_t obj) {
+    if (dst == src) {
+        return obj;
+    }
+    transfer_t t = {.dst = (runtime_t *) dst, .src = (runtime_t *) src};
+    nar_object_t result = copy_walk(&(copy_walk_t) {
+            .src = t.src,
+            .ctx = &t,
+            .resolve = &transfer_resolve,
+            .insert = &transfer_insert,
+    }, obj);
+    if (t.fn_indices != NULL) {
+        rt_free(t.dst, t.fn_indices);
+    }
+    return result;
+}